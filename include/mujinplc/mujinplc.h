@@ -5,6 +5,16 @@
 
 #include <mujinplc/plcmemory.h>
 #include <mujinplc/plcserver.h>
+#include <mujinplc/plcreactor.h>
+#include <mujinplc/plcconnectionmonitor.h>
+#include <mujinplc/plcchangequeue.h>
 #include <mujinplc/plccontroller.h>
+#include <mujinplc/plclogic.h>
+#include <mujinplc/plcprotocol.h>
+#include <mujinplc/plcsharedmemory.h>
+#include <mujinplc/plcpersistence.h>
+#include <mujinplc/plcmetrics.h>
+#include <mujinplc/plcrecorder.h>
+#include <mujinplc/plcschema.h>
 
 #endif
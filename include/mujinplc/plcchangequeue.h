@@ -0,0 +1,84 @@
+#ifndef MUJINPLC_PLCCHANGEQUEUE_H
+#define MUJINPLC_PLCCHANGEQUEUE_H
+
+#include <deque>
+#include <vector>
+
+#include <mujinplc/config.h>
+#include <mujinplc/plcmemory.h>
+
+namespace mujinplc {
+
+/// what a full PLCChangeQueue does with one more batch
+enum MUJINPLC_API PLCQueueOverflowPolicy {
+    PLCQueueOverflowPolicy_Coalesce = 0, ///< merge it into the newest batch, keeping the latest value of every key and the edges of edge sensitive keys
+    PLCQueueOverflowPolicy_Block = 1, ///< make the writer wait until a batch is dequeued, nothing is lost, see PLCController::SetQueueLimit
+};
+
+/// bounded queue of the change batches a controller has not seen yet, not thread safe.
+/// batches stay apart while there is room, so a controller that keeps up sees every intermediate state.
+/// once maxBatches are pending, further batches are coalesced into the newest one, which then only grows with the
+/// number of distinct keys changed. coalescing keeps the latest value of a key, except that edge sensitive keys also
+/// keep up to maxEdges of their intermediate values, in order, so that waiting for a pulse does not miss it.
+class MUJINPLC_API PLCChangeQueue {
+public:
+    typedef std::vector<std::pair<PLCKeyHandle, PLCValue>> Batch; ///< a key appears several times for its edges, oldest first
+
+    struct Stats {
+        size_t numBatches = 0;
+        size_t maxNumBatches = 0; ///< high water mark since the last ResetHighWaterMarks
+        size_t numEntries = 0; ///< key values pending over all batches
+        size_t maxNumEntries = 0; ///< high water mark since the last ResetHighWaterMarks
+        uint64_t numCoalesced = 0; ///< batches merged into the newest one
+        uint64_t numDroppedEdges = 0; ///< intermediate values of edge sensitive keys dropped for exceeding maxEdges
+    };
+
+    // zero maxBatches means unbounded
+    PLCChangeQueue(size_t maxBatches=1024, PLCQueueOverflowPolicy policy=PLCQueueOverflowPolicy_Coalesce);
+    virtual ~PLCChangeQueue();
+
+    void SetLimit(size_t maxBatches, PLCQueueOverflowPolicy policy);
+    PLCQueueOverflowPolicy GetPolicy() const;
+
+    // keep up to maxEdges intermediate values of the key when coalescing, zero makes it a plain key again.
+    // once a coalesced batch holds maxEdges of them, newer ones are dropped and only the latest value is kept.
+    void SetEdgeSensitive(PLCKeyHandle key, size_t maxEdges);
+
+    bool IsEmpty() const;
+    bool IsFull() const; ///< whether the next Push coalesces
+    size_t GetSize() const;
+
+    // takes the content of batch, returns false if it was coalesced into the newest batch.
+    // a full queue coalesces whatever the policy, callers honoring PLCQueueOverflowPolicy_Block wait until not IsFull first.
+    bool Push(Batch& batch);
+
+    // returns false if empty
+    bool Pop(Batch& batch);
+    void PopAll(std::deque<Batch>& batches); ///< batches is overwritten
+
+    const Stats& GetStats() const;
+    void ResetHighWaterMarks(); ///< back to the current size
+
+private:
+    static const uint32_t NoPosition = UINT32_MAX;
+
+    void _Index(); ///< start coalescing into the newest batch
+    void _Unindex(); ///< the newest batch is about to be dequeued or to stop being the newest
+    void _Coalesce(Batch& batch);
+
+    std::deque<Batch> _batches;
+    size_t _maxBatches;
+    PLCQueueOverflowPolicy _policy;
+    std::vector<uint32_t> _maxEdges; ///< indexed by key handle, zero for keys that are not edge sensitive
+
+    // index of the newest batch while coalescing into it, so that merging a batch costs O(its size)
+    bool _indexed;
+    std::vector<uint32_t> _positions; ///< indexed by key handle, position of the latest entry of the key in the newest batch
+    std::vector<uint32_t> _numEdges; ///< indexed by key handle, entries of the key in the newest batch before its latest one
+
+    Stats _stats;
+};
+
+}
+
+#endif
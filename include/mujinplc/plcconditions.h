@@ -0,0 +1,87 @@
+#ifndef MUJINPLC_PLCCONDITIONS_H
+#define MUJINPLC_PLCCONDITIONS_H
+
+#include <functional>
+#include <vector>
+
+#include <mujinplc/config.h>
+#include <mujinplc/plcmemory.h>
+
+namespace mujinplc {
+
+/// wait conditions compiled into a key to condition index.
+/// each change only touches the conditions watching that key, and every condition keeps a counter of its
+/// satisfied expectations, so checking a wait costs O(changed keys) instead of a rescan of all keys.
+/// not thread safe, meant to live next to the snapshot it is fed from.
+class MUJINPLC_API PLCConditionRegistry {
+public:
+    typedef uint32_t ConditionId;
+
+    PLCConditionRegistry();
+    virtual ~PLCConditionRegistry();
+
+    // met when all keys are at their expected value, or as soon as any key is at its exceptional value.
+    // current returns the present value of a key, or NULL if the key has no value yet.
+    // can already be met when added.
+    ConditionId AddUntilAll(const std::vector<std::pair<PLCKeyHandle, PLCValue>>& expectations, const std::vector<std::pair<PLCKeyHandle, PLCValue>>& exceptions, const std::function<const PLCValue*(PLCKeyHandle)>& current);
+
+    // met as soon as any key changes to its expected value.
+    // if the expected value of a key is null, any change to that key meets it.
+    ConditionId AddForAny(const std::vector<std::pair<PLCKeyHandle, PLCValue>>& keyvalues);
+
+    // stop tracking the condition, its id may be reused
+    void Remove(ConditionId id);
+
+    bool IsMet(ConditionId id) const;
+
+    // whether there is any condition to update at all
+    bool IsEmpty() const;
+
+    // feed a change of a key, ids of the conditions that became met with this change are appended to met.
+    // exceptions and changes meet their conditions right away, expectations are only counted until Commit.
+    void Update(PLCKeyHandle key, const PLCValue& value);
+    void Update(PLCKeyHandle key, const PLCValue& value, std::vector<ConditionId>& met);
+
+    // call after the last Update of a batch, conditions whose expectations all hold now become met.
+    // a batch that sets one expected key and resets another one does not meet anything half way through.
+    void Commit();
+    void Commit(std::vector<ConditionId>& met);
+
+private:
+    enum WatchType {
+        WatchType_Expectation, ///< counts towards the condition when at the value
+        WatchType_Exception, ///< meets the condition when at the value
+        WatchType_Change, ///< meets the condition when changing to the value, or changing at all if the value is null
+    };
+
+    struct Watch {
+        ConditionId id;
+        WatchType type;
+        PLCValue value;
+        bool satisfied; ///< for expectations, whether the key is currently at the value
+    };
+
+    struct Condition {
+        bool used = false;
+        bool met = false;
+        bool pending = false; ///< whether it is in _pending, for its expectations to be checked on Commit
+        size_t numExpectations = 0;
+        size_t numSatisfied = 0;
+        std::vector<PLCKeyHandle> keys; ///< keys watched, to unregister on removal
+    };
+
+    ConditionId _Allocate();
+    void _Watch(ConditionId id, PLCKeyHandle key, WatchType type, const PLCValue& value, bool satisfied);
+    void _Update(PLCKeyHandle key, const PLCValue& value, std::vector<ConditionId>* met);
+    void _Commit(std::vector<ConditionId>* met);
+
+    std::vector<Condition> _conditions; ///< indexed by condition id
+    std::vector<ConditionId> _freeIds; ///< unused slots in _conditions
+    std::vector<ConditionId> _pending; ///< conditions whose satisfied expectations changed since the last Commit
+    std::vector<std::vector<Watch>> _watches; ///< indexed by key handle
+    size_t _numConditions; ///< number of conditions in use
+};
+
+}
+
+#endif
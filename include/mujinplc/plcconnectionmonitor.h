@@ -0,0 +1,86 @@
+#ifndef MUJINPLC_PLCCONNECTIONMONITOR_H
+#define MUJINPLC_PLCCONNECTIONMONITOR_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <mujinplc/config.h>
+#include <mujinplc/plcmemory.h>
+
+namespace mujinplc {
+
+/// told when a heartbeat of a PLCConnectionMonitor comes and goes, always called on the monitor thread
+class MUJINPLC_API PLCConnectionObserver {
+public:
+    virtual ~PLCConnectionObserver() = default;
+    virtual void Connected(const std::string& signal) = 0;
+    virtual void Disconnected(const std::string& signal) = 0;
+};
+
+/// tracks heartbeat signals of a memory, each connected as long as it changed within its interval.
+/// a heartbeat only costs an atomic store on the writer's thread. a monitor thread sleeps until the next heartbeat
+/// would be lost and calls the observers on every change of the connection state, so nothing polls.
+class MUJINPLC_API PLCConnectionMonitor {
+public:
+    PLCConnectionMonitor(const std::shared_ptr<PLCMemory>& memory);
+    virtual ~PLCConnectionMonitor();
+
+    // track a signal, any change of it within maxInterval keeps it connected. an empty signal tracks any modification of the memory.
+    // call before Start, throws std::runtime_error after
+    void AddHeartbeat(const std::string& signal, const std::chrono::milliseconds& maxInterval);
+
+    // observer is told about every later change of the connection state, thread safe
+    void AddObserver(const std::shared_ptr<PLCConnectionObserver>& observer);
+
+    // start watching the memory, signals already in the memory count as a first heartbeat
+    void Start();
+    void Stop();
+
+    // whether every heartbeat is connected, true without heartbeats. lock free.
+    bool IsConnected() const;
+    bool IsConnected(const std::string& signal) const; ///< false for a signal not tracked
+
+    // when the first heartbeat gets lost if none of them changes until then, time_point::max() without heartbeats. lock free.
+    std::chrono::steady_clock::time_point GetDisconnectDeadline() const;
+
+    // wait until IsConnected() would return true, a timeout of zero waits forever
+    bool WaitUntilConnected(const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
+
+private:
+    struct Heartbeat {
+        std::string signal;
+        std::chrono::nanoseconds maxInterval;
+        std::atomic<int64_t> deadline{0}; ///< steady clock nanoseconds of the last change plus maxInterval, 0 before the first change
+        std::atomic<bool> reported{false}; ///< connection state last told to the observers, written by the monitor thread
+    };
+
+    class MemoryObserver;
+
+    void _Beat(const std::map<std::string, PLCValue>& keyvalues); ///< on the writer's thread
+    void _RunThread();
+    static int64_t _Now();
+
+    std::shared_ptr<PLCMemory> _memory;
+    std::deque<Heartbeat> _heartbeats; ///< fixed once started
+    bool _anyModification; ///< whether a heartbeat tracks any modification
+    std::shared_ptr<MemoryObserver> _memoryObserver;
+
+    std::mutex _mutex;
+    std::condition_variable _condition; ///< wakes the monitor thread and WaitUntilConnected when a heartbeat reconnects
+    std::vector<std::weak_ptr<PLCConnectionObserver>> _observers; ///< protected by _mutex
+    bool _running; ///< protected by _mutex
+    bool _shutdown; ///< protected by _mutex
+    std::atomic<int> _numWaiters; ///< threads in WaitUntilConnected, changed under _mutex so that _Beat knows to notify them
+    std::thread _thread;
+};
+
+}
+
+#endif
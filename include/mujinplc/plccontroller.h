@@ -6,18 +6,33 @@
 #include <mutex>
 #include <condition_variable>
 #include <deque>
+#include <thread>
+#include <unordered_map>
 
 #include <mujinplc/config.h>
 #include <mujinplc/plcmemory.h>
+#include <mujinplc/plcchangequeue.h>
+#include <mujinplc/plcconditions.h>
+#include <mujinplc/plcconnectionmonitor.h>
+#include <mujinplc/plcschema.h>
 
 namespace mujinplc {
 
 class MUJINPLC_API PLCControllerObserver;
+class MUJINPLC_API PLCLogic;
 class MUJINPLC_API PLCController {
 public:
+    // connected as long as heartbeatSignal changes within maxHeartbeatInterval, or any key if heartbeatSignal is empty.
+    // always connected if maxHeartbeatInterval is zero.
     PLCController(const std::shared_ptr<PLCMemory>& memory, const std::chrono::milliseconds& maxHeartbeatInterval=std::chrono::milliseconds::zero(), const std::string& heartbeatSignal="");
+
+    // connected as long as all heartbeats of the monitor are, the monitor can be shared between controllers
+    PLCController(const std::shared_ptr<PLCMemory>& memory, const std::shared_ptr<PLCConnectionMonitor>& monitor);
     virtual ~PLCController();
 
+    // monitor tracking the heartbeats, to observe connects and disconnects. NULL if always connected.
+    const std::shared_ptr<PLCConnectionMonitor>& GetConnectionMonitor() const;
+
     // whether plc is connected
     virtual bool IsConnected() const;
 
@@ -27,58 +42,179 @@ public:
     // wait until plc connected, IsConnected() would return true
     virtual bool WaitUntilConnected(const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
 
+    // bound the changes queued for this controller and not seen yet, see PLCChangeQueue. zero maxBatches means unbounded.
+    // with PLCQueueOverflowPolicy_Block, writers wait for the controller to catch up, except the thread dequeuing itself
+    // and the dispatcher thread of the memory, whose changes are coalesced as with PLCQueueOverflowPolicy_Coalesce.
+    // a writer waiting for this controller holds up the other observers notified on its thread. two controllers whose
+    // threads write keys the other one watches can deadlock once both queues are full, use Block for one of them only.
+    virtual void SetQueueLimit(size_t maxBatches, PLCQueueOverflowPolicy policy=PLCQueueOverflowPolicy_Coalesce);
+
+    // keep up to maxEdges intermediate values of the key when queued changes get coalesced, so that WaitFor still sees
+    // every edge of e.g. a pulse or a toggling handshake signal. zero maxEdges only keeps the latest value again.
+    virtual void SetEdgeSensitive(const std::string& key, size_t maxEdges=16);
+    virtual void SetEdgeSensitive(PLCKeyHandle key, size_t maxEdges=16);
+
+    // current size, high water marks and losses of the queue
+    virtual PLCChangeQueue::Stats GetQueueStats() const;
+    virtual void ResetQueueHighWaterMarks();
+
+    // queueing, coalescing and blocking of the changes of this controller, see also PLCServer::AddController
+    PLCControllerMetrics& GetMetrics();
+
+    // intern a key name into a handle, handle based overloads below skip the string lookups
+    virtual PLCKeyHandle GetKeyHandle(const std::string& key);
+
     // wait for the key to become the expected value after some change, if value is null, wait for any change of the key
     // if the key is already at the value, it waits for it to change to something else, then back
     virtual bool WaitFor(const std::string& key, const PLCValue& value, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
+    virtual bool WaitFor(PLCKeyHandle key, const PLCValue& value, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
 
     // wait for multiple keys, return as soon as any one key has the expected value.
     // if the passed in expected value of a key is null, then wait for any change to that key.
     virtual bool WaitForAny(const std::map<std::string, PLCValue>& keyvalues, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
+    virtual bool WaitForAny(const std::vector<std::pair<PLCKeyHandle, PLCValue>>& keyvalues, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
 
     // wait until a key is at expected value.
     // if already at such value, return immediately.
     virtual bool WaitUntil(const std::string& key, const PLCValue& value, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
+    virtual bool WaitUntil(PLCKeyHandle key, const PLCValue& value, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
 
     // wait until multiple keys are all at their expected value, or any one key is at its exceptional value.
     // if all keys are already satisfying the expectations, return immediately.
     // if any of the exceptional conditions is met, return immediately.
     virtual bool WaitUntilAll(const std::map<std::string, PLCValue>& keyvalues, const std::map<std::string, PLCValue>& exceptions, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
+    virtual bool WaitUntilAll(const std::vector<std::pair<PLCKeyHandle, PLCValue>>& keyvalues, const std::vector<std::pair<PLCKeyHandle, PLCValue>>& exceptions, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
 
     virtual void Set(const std::string& key, const PLCValue& value);
+    virtual void Set(PLCKeyHandle key, const PLCValue& value);
     virtual void Set(const std::map<std::string, PLCValue>& keyvalues);
 
     virtual const PLCValue& Get(const std::string& key, const PLCValue& defaultValue=PLCValue()) const;
+    virtual const PLCValue& Get(PLCKeyHandle key, const PLCValue& defaultValue=PLCValue()) const;
     virtual const PLCValue& SyncAndGet(const std::string& key, const PLCValue& defaultValue=PLCValue());
 
     virtual const std::string& GetString(const std::string& key, const std::string& defaultValue="") const;
+    virtual const std::string& GetString(PLCKeyHandle key, const std::string& defaultValue="") const;
     virtual const std::string& SyncAndGetString(const std::string& key, const std::string& defaultValue="");
 
     virtual int GetInteger(const std::string& key, int defaultValue=0) const;
+    virtual int GetInteger(PLCKeyHandle key, int defaultValue=0) const;
     virtual int SyncAndGetInteger(const std::string& key, int defaultValue=0);
 
     virtual bool GetBoolean(const std::string& key, bool defaultValue=false) const;
+    virtual bool GetBoolean(PLCKeyHandle key, bool defaultValue=false) const;
     virtual bool SyncAndGetBoolean(const std::string& key, bool defaultValue=false);
 
+    // bind the typed accessors below to the signals of the schema, interning their names once. null unbinds them.
+    virtual void SetSchema(const std::shared_ptr<PLCSchema>& schema);
+
+    // typed accessors of the signals of the schema, resolved through their slot without any string lookup.
+    // they throw std::runtime_error if the schema has another signal in the slot, its name, type and direction are
+    // compared the first time the signal is used.
+    // Get returns defaultValue if the signal has no value yet, and throws std::runtime_error if it holds another type.
+    template <typename T, PLCSignalDirection Direction>
+    T Get(const PLCSignal<T, Direction>& signal, const typename PLCSignal<T, Direction>::ValueType& defaultValue=T()) const {
+        const Entry* entry = _Find(_GetSignalHandle(signal));
+        if (entry == NULL || entry->value.IsNull()) {
+            return defaultValue;
+        }
+        if (!PLCValueTraits<T>::Is(entry->value)) {
+            _ThrowTypeMismatch(signal.slot);
+        }
+        return PLCValueTraits<T>::Get(entry->value);
+    }
+
+    template <typename T, PLCSignalDirection Direction>
+    void Set(const PLCSignal<T, Direction>& signal, const typename PLCSignal<T, Direction>::ValueType& value) {
+        static_assert(Direction != PLCSignalDirection_Input, "input signals are only written by the plc");
+        _memory->Write(_GetSignalHandle(signal), PLCValue(value));
+    }
+
+    template <typename T, PLCSignalDirection Direction>
+    bool WaitFor(const PLCSignal<T, Direction>& signal, const typename PLCSignal<T, Direction>::ValueType& value, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero()) {
+        return WaitFor(_GetSignalHandle(signal), PLCValue(value), timeout);
+    }
+
+    template <typename T, PLCSignalDirection Direction>
+    bool WaitUntil(const PLCSignal<T, Direction>& signal, const typename PLCSignal<T, Direction>::ValueType& value, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero()) {
+        return WaitUntil(_GetSignalHandle(signal), PLCValue(value), timeout);
+    }
+
 private:
-    void _Enqueue(const std::map<std::string, PLCValue>& keyvalues);
-    bool _Dequeue(std::map<std::string, PLCValue>& keyvalues, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero(), bool timeoutOnDisconnect=true);
-    void _DequeueAll();
+    struct Entry {
+        PLCValue value;
+        bool valid = false; ///< whether the key has been received
+    };
 
-    std::shared_ptr<PLCMemory> _memory;
-    std::chrono::milliseconds _maxHeartbeatInterval;
-    std::string _heartbeatSignal;
+    typedef std::chrono::steady_clock::time_point Deadline; ///< Deadline::max() means no deadline
+
+    static Deadline _GetDeadline(const std::chrono::milliseconds& timeout);
 
-    std::chrono::time_point<std::chrono::steady_clock> _lastHeartbeat; ///< timestamp of last successful heartbeat
+    void _Enqueue(const std::map<std::string, PLCValue>& keyvalues);
 
-    std::map<std::string, PLCValue> _state; ///< no lock protection, current snapshot of the memory
+    // block until a change batch is available and apply it to _state, the deadline passes, or, if timeoutOnDisconnect, the heartbeat is lost
+    bool _Dequeue(std::vector<std::pair<PLCKeyHandle, PLCValue>>& keyvalues, const Deadline& deadline, bool timeoutOnDisconnect=true);
+    void _DequeueAll();
+    void _Interrupt(); ///< make the _Dequeue in progress, or else the next one, return false right away
+    bool _WaitForAny(const std::vector<std::pair<PLCKeyHandle, PLCValue>>& keyvalues, const Deadline& deadline);
+    bool _WaitUntilMet(PLCConditionRegistry::ConditionId id, const Deadline& deadline); ///< removes the condition before returning
+    void _Apply(const std::vector<std::pair<PLCKeyHandle, PLCValue>>& keyvalues);
+    const Entry* _Find(PLCKeyHandle key) const;
+    struct CheckedSignal {
+        const char* name = NULL; ///< address of the name the signal of the slot was last checked with
+        PLCValueType type = PLCValueType_Null;
+        PLCSignalDirection direction = PLCSignalDirection_Input;
+    };
+
+    template <typename T, PLCSignalDirection Direction>
+    PLCKeyHandle _GetSignalHandle(const PLCSignal<T, Direction>& signal) const {
+        if (signal.slot >= _signalHandles.size()) {
+            _ThrowNotInSchema(signal.slot);
+        }
+        // the name is usually the same string literal every time, so it is only compared once
+        const CheckedSignal& checked = _checkedSignals[signal.slot];
+        if (checked.name != signal.name || checked.type != PLCValueTraits<T>::Type || checked.direction != Direction) {
+            _CheckSignal(signal.slot, signal.name, PLCValueTraits<T>::Type, Direction);
+        }
+        return _signalHandles[signal.slot];
+    }
+    void _CheckSignal(uint32_t slot, const char* name, PLCValueType type, PLCSignalDirection direction) const; ///< throws if the schema has another signal in the slot
+    [[noreturn]] void _ThrowNotInSchema(uint32_t slot) const;
+    [[noreturn]] void _ThrowTypeMismatch(uint32_t slot) const;
+    void _ToHandles(const std::map<std::string, PLCValue>& keyvalues, std::vector<std::pair<PLCKeyHandle, PLCValue>>& handlevalues);
+    void _ToEnqueuedHandles(const std::map<std::string, PLCValue>& keyvalues, std::vector<std::pair<PLCKeyHandle, PLCValue>>& handlevalues); ///< through _enqueuedHandles, _mutex has to be held
+    void _TakeNewHandles(); ///< moves _newHandles to _handles, _mutex has to be held by the dequeuing thread
+    PLCKeyHandle _FindKeyHandle(const std::string& key) const; ///< through _handles, PLCKeyHandle_Invalid for keys never dequeued
 
-    std::deque<std::map<std::string, PLCValue>> _queue; ///< incoming memory modifications, protected by _mutex
+    std::shared_ptr<PLCMemory> _memory;
+    std::shared_ptr<PLCConnectionMonitor> _monitor; ///< NULL if always connected
+    std::shared_ptr<PLCSchema> _schema;
+    std::vector<PLCKeyHandle> _signalHandles; ///< handles of the signals of _schema, indexed by slot
+    mutable std::vector<CheckedSignal> _checkedSignals; ///< no lock protection, last signal that matched each slot of _schema
+
+    std::vector<Entry> _state; ///< no lock protection, current snapshot of the memory, indexed by key handle
+    PLCConditionRegistry _conditions; ///< no lock protection, conditions of the waits in progress, fed from _Apply
+    bool _collectMet; ///< no lock protection, whether _Apply collects the conditions it meets into _met, set while PLCLogic::Run drives the controller
+    std::vector<PLCConditionRegistry::ConditionId> _met; ///< no lock protection, conditions met since PLCLogic last took them
+    std::unordered_map<std::string, PLCKeyHandle> _handles; ///< no lock protection, names of the keys that can be in _state, taken from _newHandles when dequeuing
+
+    PLCChangeQueue _queue; ///< incoming memory modifications, protected by _mutex
     std::condition_variable _condition; ///< incoming memory modification condition variable, protected by _mutex
-    std::mutex _mutex; ///< protects _queue and _condition
+    std::condition_variable _spaceCondition; ///< wakes writers blocked on a full queue, protected by _mutex
+    size_t _numBlockedWriters; ///< protected by _mutex
+    std::thread::id _dequeuingThread; ///< thread that dequeued last, never blocked on a full queue, protected by _mutex
+    bool _closing; ///< releases blocked writers on destruction, protected by _mutex
+    bool _interrupted; ///< see _Interrupt, protected by _mutex
+    std::unordered_map<std::string, PLCKeyHandle> _enqueuedHandles; ///< names of the keys notified so far, the memory is only asked on a miss, protected by _mutex
+    std::vector<std::pair<std::string, PLCKeyHandle>> _newHandles; ///< added to _enqueuedHandles since the last dequeue, protected by _mutex
+    mutable std::mutex _mutex; ///< protects _queue, _condition, _spaceCondition and _interrupted
 
     std::shared_ptr<PLCControllerObserver> _observer;
 
+    PLCControllerMetrics _metrics;
+
     friend class PLCControllerObserver; ///< so that _Enqueue can be called
+    friend class PLCLogic; ///< runs its flows on the snapshot and conditions of the controller
 };
 
 }
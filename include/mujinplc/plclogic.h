@@ -2,25 +2,304 @@
 #define MUJINPLC_PLCLOGIC_H
 
 #include <chrono>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define MUJINPLC_HAS_COROUTINES 1
+#endif
 
 #include <mujinplc/config.h>
 #include <mujinplc/plccontroller.h>
 
 namespace mujinplc {
 
+/// how a wait of PLCLogic ended
+enum MUJINPLC_API PLCLogicWaitResult {
+    PLCLogicWaitResult_Met = 0, ///< the condition was met, or the sleep is over
+    PLCLogicWaitResult_Timeout = 1,
+    PLCLogicWaitResult_Cancelled = 2, ///< the PLCLogic was destroyed first, the waiter must not touch it anymore
+    PLCLogicWaitResult_Disconnected = 3, ///< the heartbeat was lost, as when the waits of PLCController return false
+};
+
+#if MUJINPLC_HAS_COROUTINES
+class PLCLogicFlow;
+class PLCLogicWait;
+#endif
+
+/// runs many handshake flows, e.g. one per conveyor or pick location, on the one thread calling Run.
+/// a flow waits for signals without blocking the thread, every wait registers a condition in the controller and
+/// goes to sleep until a change of the memory meets it or its timeout passes. timeouts are kept in a timer wheel,
+/// so the thread sleeps until the next change or the next timeout and no wait is ever polled.
+/// with c++20, flows are coroutines returning PLCLogicFlow that co_await WaitUntil and friends, started with Spawn,
+/// as in src/mujinplcexample/logic.cpp.
+/// without, the Async functions take a callback instead.
+/// all flows share the controller, which must not be used by anything else while Run is going on.
+/// to spread flows over a few threads, give each thread a PLCLogic with its own controller.
 class MUJINPLC_API PLCLogic {
 
 public:
+    typedef std::vector<std::pair<PLCKeyHandle, PLCValue>> KeyValues;
+    typedef std::function<void(PLCLogicWaitResult)> Callback;
+
     PLCLogic(const std::shared_ptr<PLCController>& controller);
-    virtual ~PLCLogic();
+    virtual ~PLCLogic(); ///< cancels whatever is still waiting
 
+    // blocks the calling thread, not to be used from within a flow
     virtual bool WaitUntilConnected(const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
 
+    // run flows on the calling thread until Stop is called, or, if untilDone, until no flow is waiting anymore.
+    // an exception escaping a flow or callback propagates out of Run, the other flows are kept for the next Run.
+    void Run(bool untilDone=false);
+
+    // make Run return as soon as the running flow waits again, thread safe
+    void Stop();
+
+    // call the callback on the Run thread with PLCLogicWaitResult_Met, thread safe
+    void Post(const Callback& callback);
+
+    // the Async functions are only to be called on the Run thread, or before Run.
+    // a timeout of zero waits forever, as for PLCController.
+    // if the condition is met already, they return true and the callback is not called. otherwise the callback is
+    // called once from Run when the condition is met or the timeout passes.
+
+    // the waits for conditions end with PLCLogicWaitResult_Disconnected as soon as the heartbeat of the controller is
+    // lost, sleeps are not affected.
+
+    // same as PLCController::WaitUntilAll
+    bool AsyncWaitUntilAll(const KeyValues& expectations, const KeyValues& exceptions, const std::chrono::milliseconds& timeout, const Callback& callback);
+
+    // same as PLCController::WaitForAny, never met already
+    bool AsyncWaitForAny(const KeyValues& keyvalues, const std::chrono::milliseconds& timeout, const Callback& callback);
+
+    // the callback is called with PLCLogicWaitResult_Met after the duration
+    void AsyncSleep(const std::chrono::milliseconds& duration, const Callback& callback);
+
+    // the snapshot the flows see, same as PLCController::Get and Set
+    const PLCValue& Get(PLCKeyHandle key, const PLCValue& defaultValue=PLCValue()) const;
+    void Set(PLCKeyHandle key, const PLCValue& value);
+    PLCKeyHandle GetKeyHandle(const std::string& key);
+
+    // number of waits in progress
+    size_t GetNumWaiting() const;
+
+#if MUJINPLC_HAS_COROUTINES
+    // start the flow on the Run thread, thread safe
+    void Spawn(PLCLogicFlow flow);
+
+    [[nodiscard]] PLCLogicWait WaitUntil(PLCKeyHandle key, const PLCValue& value, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
+    [[nodiscard]] PLCLogicWait WaitUntilAll(const KeyValues& expectations, const KeyValues& exceptions=KeyValues(), const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
+    [[nodiscard]] PLCLogicWait WaitFor(PLCKeyHandle key, const PLCValue& value, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
+    [[nodiscard]] PLCLogicWait WaitForAny(const KeyValues& keyvalues, const std::chrono::milliseconds& timeout=std::chrono::milliseconds::zero());
+    [[nodiscard]] PLCLogicWait Sleep(const std::chrono::milliseconds& duration);
+#endif
+
 private:
+    static const size_t NumTimerSlots = 512; ///< ticks of one turn of the timer wheel, a power of two
+    typedef std::chrono::milliseconds Tick; ///< resolution of the timeouts, they never end early but up to a tick late
+
+    typedef uint32_t WaitId;
+
+    struct Wait {
+        Callback callback;
+        bool used = false;
+        bool hasCondition = false;
+        bool hasTimer = false;
+        PLCConditionRegistry::ConditionId condition = 0;
+        uint32_t generation = 0; ///< incremented when released, so that timer entries of earlier waits in the same slot are ignored
+    };
+
+    struct Timer {
+        WaitId wait;
+        uint32_t generation;
+        uint64_t expiry; ///< tick, the slot holds every expiry that is the same modulo NumTimerSlots
+    };
+
+    WaitId _AddWait(const Callback& callback, const std::chrono::milliseconds& timeout);
+    void _ReleaseWait(WaitId id, PLCLogicWaitResult result); ///< queues the callback with the result into _ready
+    void _Run(bool untilDone);
+    void _TakeMet(); ///< queues the waits whose conditions the controller met
+    void _TakeAllMet(); ///< same as _TakeMet, but for conditions met while Run was not going on, checks every wait
+    void _Expire(const std::chrono::steady_clock::time_point& now); ///< queues the waits whose timeouts passed
+    void _Disconnect(const std::chrono::steady_clock::time_point& now); ///< queues the waits for conditions if the heartbeat is lost
+    std::chrono::steady_clock::time_point _GetNextExpiry() const;
+    uint64_t _GetTick(const std::chrono::steady_clock::time_point& time) const; ///< rounded down
+
     std::shared_ptr<PLCController> _controller;
+
+    // only used by the Run thread
+    std::vector<Wait> _waits; ///< indexed by wait id
+    std::vector<WaitId> _freeWaits;
+    std::vector<WaitId> _conditionWaits; ///< wait of a condition of the controller, indexed by condition id
+    size_t _numWaiting;
+    size_t _numConditionWaits; ///< waits with a condition, they end on disconnect
+    std::chrono::steady_clock::time_point _start; ///< time of tick 0
+    std::vector<std::vector<Timer>> _timerSlots;
+    uint64_t _currentTick; ///< every timer up to this tick has expired
+    size_t _numTimers; ///< timers of waits still in progress
+    std::deque<std::pair<Callback, PLCLogicWaitResult>> _ready; ///< callbacks to call next
+
+    std::mutex _mutex; ///< protects _posted and _stopping
+    std::vector<Callback> _posted;
+    bool _stopping;
+};
+
+#if MUJINPLC_HAS_COROUTINES
+
+/// coroutine run by PLCLogic::Spawn. it starts suspended, and its frame is freed by whoever resumed it once it returns.
+/// an exception escaping it is kept until then and rethrown out of PLCLogic::Run.
+/// if its PLCLogic is destroyed while it waits, its frame is destroyed at that wait.
+class PLCLogicFlow {
+public:
+    struct promise_type {
+        PLCLogicFlow get_return_object() {
+            return PLCLogicFlow(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+        void return_void() {
+        }
+        void unhandled_exception() {
+            exception = std::current_exception();
+        }
+
+        std::exception_ptr exception; ///< escaped the flow, rethrown by _Resume
+    };
+
+    PLCLogicFlow(PLCLogicFlow&& other) noexcept : _handle(other._handle) {
+        other._handle = nullptr;
+    }
+    PLCLogicFlow(const PLCLogicFlow&) = delete;
+    PLCLogicFlow& operator=(const PLCLogicFlow&) = delete;
+    ~PLCLogicFlow() {
+        // never spawned
+        if (_handle) {
+            _handle.destroy();
+        }
+    }
+
+private:
+    explicit PLCLogicFlow(std::coroutine_handle<promise_type> handle) : _handle(handle) {
+    }
+
+    // run the flow until its next wait. if it ended, free its frame and rethrow what escaped it.
+    static void _Resume(std::coroutine_handle<promise_type> handle) {
+        handle.resume();
+        if (handle.done()) {
+            std::exception_ptr exception = std::move(handle.promise().exception);
+            handle.destroy();
+            if (exception) {
+                std::rethrow_exception(exception);
+            }
+        }
+    }
+
+    std::coroutine_handle<promise_type> _handle;
+
+    friend class PLCLogic;
+    friend class PLCLogicWait;
 };
 
+/// awaitable returned by the waits of PLCLogic, co_await gives true if the condition was met, false on timeout or disconnect.
+/// only a PLCLogicFlow can await it.
+class PLCLogicWait {
+public:
+    bool await_ready() const noexcept {
+        return false;
+    }
+
+    // returning false resumes right away, when the condition is met already
+    bool await_suspend(std::coroutine_handle<PLCLogicFlow::promise_type> handle) {
+        PLCLogic::Callback callback = [this, handle](PLCLogicWaitResult result) {
+            if (result == PLCLogicWaitResult_Cancelled) {
+                handle.destroy();
+                return;
+            }
+            _met = result == PLCLogicWaitResult_Met;
+            // this lives in the frame, which is gone if the flow ends here
+            PLCLogicFlow::_Resume(handle);
+        };
+        switch (_type) {
+        case Type_UntilAll:
+            return !(_met = _logic->AsyncWaitUntilAll(_keyvalues, _exceptions, _timeout, callback));
+        case Type_ForAny:
+            return !(_met = _logic->AsyncWaitForAny(_keyvalues, _timeout, callback));
+        case Type_Sleep:
+            _logic->AsyncSleep(_timeout, callback);
+            return true;
+        }
+        return false;
+    }
+
+    bool await_resume() const noexcept {
+        return _met;
+    }
+
+private:
+    enum Type {
+        Type_UntilAll,
+        Type_ForAny,
+        Type_Sleep,
+    };
+
+    PLCLogicWait(PLCLogic* logic, Type type, PLCLogic::KeyValues keyvalues, PLCLogic::KeyValues exceptions, const std::chrono::milliseconds& timeout) : _logic(logic), _type(type), _keyvalues(std::move(keyvalues)), _exceptions(std::move(exceptions)), _timeout(timeout) {
+    }
+
+    PLCLogic* _logic;
+    Type _type;
+    PLCLogic::KeyValues _keyvalues;
+    PLCLogic::KeyValues _exceptions;
+    std::chrono::milliseconds _timeout;
+    bool _met = false;
+
+    friend class PLCLogic;
+};
+
+inline void PLCLogic::Spawn(PLCLogicFlow flow) {
+    std::coroutine_handle<PLCLogicFlow::promise_type> handle = flow._handle;
+    flow._handle = nullptr;
+    Post([handle](PLCLogicWaitResult result) {
+        if (result == PLCLogicWaitResult_Cancelled) {
+            handle.destroy();
+        }
+        else {
+            PLCLogicFlow::_Resume(handle);
+        }
+    });
+}
+
+inline PLCLogicWait PLCLogic::WaitUntil(PLCKeyHandle key, const PLCValue& value, const std::chrono::milliseconds& timeout) {
+    return PLCLogicWait(this, PLCLogicWait::Type_UntilAll, KeyValues{{key, value}}, KeyValues(), timeout);
+}
+
+inline PLCLogicWait PLCLogic::WaitUntilAll(const KeyValues& expectations, const KeyValues& exceptions, const std::chrono::milliseconds& timeout) {
+    return PLCLogicWait(this, PLCLogicWait::Type_UntilAll, expectations, exceptions, timeout);
+}
+
+inline PLCLogicWait PLCLogic::WaitFor(PLCKeyHandle key, const PLCValue& value, const std::chrono::milliseconds& timeout) {
+    return PLCLogicWait(this, PLCLogicWait::Type_ForAny, KeyValues{{key, value}}, KeyValues(), timeout);
+}
+
+inline PLCLogicWait PLCLogic::WaitForAny(const KeyValues& keyvalues, const std::chrono::milliseconds& timeout) {
+    return PLCLogicWait(this, PLCLogicWait::Type_ForAny, keyvalues, KeyValues(), timeout);
+}
+
+inline PLCLogicWait PLCLogic::Sleep(const std::chrono::milliseconds& duration) {
+    return PLCLogicWait(this, PLCLogicWait::Type_Sleep, KeyValues(), KeyValues(), duration);
+}
+
+#endif
+
 }
 
 #endif
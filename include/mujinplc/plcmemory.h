@@ -1,12 +1,21 @@
 #ifndef MUJINPLC_PLCMEMORY_H
 #define MUJINPLC_PLCMEMORY_H
 
+#include <atomic>
 #include <map>
+#include <deque>
 #include <vector>
 #include <mutex>
 #include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include <unordered_map>
 
 #include <mujinplc/config.h>
+#include <mujinplc/plcmetrics.h>
 
 namespace mujinplc
 {
@@ -16,20 +25,48 @@ enum MUJINPLC_API PLCValueType {
     PLCValueType_String,
     PLCValueType_Boolean,
     PLCValueType_Integer,
+    PLCValueType_Double,
+    PLCValueType_Integer64,
+    PLCValueType_IntegerArray,
+    PLCValueType_DoubleArray,
+    PLCValueType_Blob,
 };
 
+/// storage of the bulk value types, shared by every copy of a PLCValue and only modified by a value owning it alone.
+/// storage handed to a PLCValue must not be allocated as a const object, e.g. std::make_shared<std::vector<int>>(...).
+typedef std::shared_ptr<const std::vector<int>> PLCIntegerArray;
+typedef std::shared_ptr<const std::vector<double>> PLCDoubleArray;
+typedef std::shared_ptr<const std::string> PLCBlob; ///< raw bytes
+
+/// tagged union of the supported value types.
+/// scalars are stored inline and copied without touching the heap, strings rely on the
+/// small string optimization of std::string so short signal values do not allocate either.
+/// arrays and blobs live in shared storage, so copying them through observers and queues only bumps a reference count.
+/// the storage is copied on write, when modified through a PLCValue that does not own it alone.
 class MUJINPLC_API PLCValue {
 public:
-    PLCValue();
+    PLCValue() noexcept;
     PLCValue(std::string value);
-    PLCValue(int value);
-    PLCValue(bool value);
+    PLCValue(int value) noexcept;
+    PLCValue(bool value) noexcept;
+    PLCValue(double value) noexcept;
+    PLCValue(int64_t value) noexcept;
+    PLCValue(PLCIntegerArray value) noexcept;
+    PLCValue(PLCDoubleArray value) noexcept;
+    PLCValue(PLCBlob value) noexcept;
     PLCValue(const PLCValue& other);
-    virtual ~PLCValue();
+    PLCValue(PLCValue&& other) noexcept;
+    ~PLCValue();
+
+    PLCValue& operator=(const PLCValue& other);
+    PLCValue& operator=(PLCValue&& other) noexcept;
+
+    PLCValueType GetType() const;
 
     bool IsString() const;
     const std::string& GetString() const;
     void SetString(const std::string& value);
+    void SetString(const char* value, size_t length); ///< reuses the current string storage if already a string
 
     bool IsBoolean() const;
     bool GetBoolean() const;
@@ -39,24 +76,121 @@ public:
     int GetInteger() const;
     void SetInteger(int value);
 
+    bool IsDouble() const;
+    double GetDouble() const;
+    void SetDouble(double value);
+
+    bool IsInteger64() const;
+    int64_t GetInteger64() const;
+    void SetInteger64(int64_t value);
+
+    // getters of the bulk types return an empty array or blob when the value is of another type.
+    // the shared getters return the storage itself, null when the value is of another type.
+    // the mutable getters copy the storage first if it is shared, the reference is valid until the value is copied or changed.
+    // without keepElements, shared storage is replaced by an empty one instead, for callers about to overwrite every element.
+    bool IsIntegerArray() const;
+    const std::vector<int>& GetIntegerArray() const;
+    PLCIntegerArray GetSharedIntegerArray() const;
+    std::vector<int>& GetMutableIntegerArray(bool keepElements=true); ///< turns the value into an empty array if of another type
+    void SetIntegerArray(std::vector<int> value);
+    void SetIntegerArray(PLCIntegerArray value);
+
+    bool IsDoubleArray() const;
+    const std::vector<double>& GetDoubleArray() const;
+    PLCDoubleArray GetSharedDoubleArray() const;
+    std::vector<double>& GetMutableDoubleArray(bool keepElements=true); ///< turns the value into an empty array if of another type
+    void SetDoubleArray(std::vector<double> value);
+    void SetDoubleArray(PLCDoubleArray value);
+
+    bool IsBlob() const;
+    const std::string& GetBlob() const;
+    PLCBlob GetSharedBlob() const;
+    std::string& GetMutableBlob(bool keepElements=true); ///< turns the value into an empty blob if of another type
+    void SetBlob(std::string value);
+    void SetBlob(const char* value, size_t length);
+    void SetBlob(PLCBlob value);
+
     bool IsNull() const;
     void SetNull();
 
 private:
+    void _Destroy() noexcept; ///< release the string or shared storage if any, leaves the value null
+    bool _IsShared() const; ///< whether _sharedValue is in use
+    void _SetShared(PLCValueType type, std::shared_ptr<const void> value); ///< null storage stays null, getters treat it as empty
+    void* _GetMutableShared(PLCValueType type, bool keepElements); ///< the storage of a bulk type, owned by this value alone
+
     PLCValueType _type;
 
-    std::string _stringValue;
-    int _integerValue;
-    bool _booleanValue;
+    union {
+        int _integerValue;
+        bool _booleanValue;
+        double _doubleValue;
+        int64_t _integer64Value;
+        std::string _stringValue; ///< only constructed when _type is PLCValueType_String
+        std::shared_ptr<const void> _sharedValue; ///< only constructed for arrays and blobs, points to the vector or string of the type
+    };
 };
 
 MUJINPLC_API bool operator==(const PLCValue& lhs, const PLCValue& rhs);
 MUJINPLC_API bool operator!=(const PLCValue& lhs, const PLCValue& rhs);
 
+/// stable integer handle of an interned key name, usable as an index into dense storage
+typedef uint32_t PLCKeyHandle;
+const PLCKeyHandle PLCKeyHandle_Invalid = UINT32_MAX;
+
+/// interns key names into stable integer handles.
+/// not thread safe by itself, PLCMemory protects its registry with its own mutex.
+class MUJINPLC_API PLCKeyRegistry {
+public:
+    PLCKeyRegistry();
+    virtual ~PLCKeyRegistry();
+
+    // return the handle of the key, registering it if it has not been seen before
+    PLCKeyHandle Intern(const std::string& key);
+
+    // return the handle of the key, or PLCKeyHandle_Invalid if it was never registered
+    PLCKeyHandle Find(const std::string& key) const;
+
+    // return the name of a registered handle, the reference stays valid for the lifetime of the registry
+    const std::string& GetName(PLCKeyHandle handle) const;
+
+    // number of registered keys, handles are always in [0, GetSize())
+    size_t GetSize() const;
+
+private:
+    std::unordered_map<std::string, PLCKeyHandle> _handles;
+    std::deque<std::string> _names; ///< indexed by handle, deque so that references are never invalidated
+};
+
+enum MUJINPLC_API PLCOperationType {
+    PLCOperationType_Read = 0,
+    PLCOperationType_Write = 1,
+    PLCOperationType_CompareAndSwap = 2, ///< write only if the key is at the expected value
+};
+
+/// one step of PLCMemory::Execute
+struct MUJINPLC_API PLCOperation {
+    PLCOperationType type = PLCOperationType_Read;
+    std::string key;
+    PLCValue value; ///< for write and compare and swap, the value to write
+    PLCValue expected; ///< for compare and swap, null matches a key that was never written
+};
+
+struct MUJINPLC_API PLCOperationResult {
+    bool success = false; ///< for read, whether the key has a value. for compare and swap, whether it was written. always true for write.
+    PLCValue value; ///< value of the key before the operation, null if the key was never written
+};
+
 class MUJINPLC_API PLCMemoryObserver {
 public:
     virtual ~PLCMemoryObserver() = default;
     virtual void MemoryModified(const std::map<std::string, PLCValue>& keyvalues) = 0;
+
+    // same as above with the sequence number of the write batch (see PLCMemory::GetSequence), override to receive it.
+    // batches merged by the dispatcher carry the latest sequence number, the initial state carries the one at subscription.
+    virtual void MemoryModified(uint64_t /*sequence*/, const std::map<std::string, PLCValue>& keyvalues) {
+        MemoryModified(keyvalues);
+    }
 };
 
 class MUJINPLC_API PLCMemory {
@@ -67,12 +201,128 @@ public:
     void Read(const std::vector<std::string> &keys, std::map<std::string, PLCValue> &keyvalues);
     void Write(const std::map<std::string, PLCValue> &keyvalues);
 
+    // same as above in the order of keys, overwrites keyvalues in place so that reading the same keys again does not allocate
+    void Read(const std::vector<std::string>& keys, std::vector<std::pair<std::string, PLCValue>>& keyvalues);
+
+    // intern key names into handles, handles stay valid for the lifetime of the memory
+    PLCKeyHandle GetKeyHandle(const std::string& key);
+    PLCKeyHandle FindKeyHandle(const std::string& key); ///< does not intern, returns PLCKeyHandle_Invalid for unknown keys
+    void GetKeyHandles(const std::vector<std::string>& keys, std::vector<PLCKeyHandle>& handles);
+    const std::string& GetKeyName(PLCKeyHandle handle);
+
+    // handle based access, avoids string compares on the hot path.
+    // reads of a handle this memory never gave out find nothing, writes throw std::invalid_argument and write nothing.
+    bool Read(PLCKeyHandle key, PLCValue& value);
+    void Read(const std::vector<PLCKeyHandle>& keys, std::vector<std::pair<PLCKeyHandle, PLCValue>>& keyvalues);
+    void Write(PLCKeyHandle key, const PLCValue& value);
+    void Write(const std::vector<std::pair<PLCKeyHandle, PLCValue>>& keyvalues);
+
+    // execute the operations in order under one lock, each one sees the effect of the ones before it.
+    // all writes form one write batch with one sequence number and one notification. results has one entry per operation.
+    // returns the sequence number of the write batch, 0 if nothing was modified.
+    uint64_t Execute(const std::vector<PLCOperation>& operations, std::vector<PLCOperationResult>& results);
+
+    // read the keys starting with any of the prefixes under one lock in key order, all keys if there are no prefixes.
+    // walks an ordered index of the key names, so the cost follows the number of matching keys, not the size of the memory.
+    // overwrites keyvalues in place like Read, returns the current sequence number.
+    uint64_t ReadPrefixes(const std::vector<std::string>& prefixes, std::vector<std::pair<std::string, PLCValue>>& keyvalues);
+
+    // read the keys in [begin, end) under one lock in key order, up to the last key if end is empty.
+    // returns at most maxKeys if not zero, the next page then begins at the last key returned followed by '\0'.
+    uint64_t ReadRange(const std::string& begin, const std::string& end, std::vector<std::pair<std::string, PLCValue>>& keyvalues, size_t maxKeys=0);
+
+    // sequence number of the last modification, every write batch that modifies something increments it by one
+    uint64_t GetSequence();
+
+    // read only the keys modified after the given sequence number, returns the current sequence number to pass in next time.
+    // a sequence number newer than the memory (e.g. after a restart of the memory) returns everything.
+    uint64_t ReadModifiedSince(uint64_t sequence, std::map<std::string, PLCValue>& keyvalues);
+    uint64_t ReadModifiedSince(uint64_t sequence, std::vector<std::pair<PLCKeyHandle, PLCValue>>& keyvalues);
+
+    // observer receives every modification, and the whole memory right away
     void AddObserver(const std::shared_ptr<PLCMemoryObserver>& observer);
 
+    // observer only receives modifications of the listed keys and of keys starting with one of the prefixes.
+    // it is never invoked for a write that does not touch any of them.
+    void AddObserver(const std::shared_ptr<PLCMemoryObserver>& observer, const std::vector<std::string>& keys, const std::vector<std::string>& prefixes=std::vector<std::string>());
+
+    // deliver observer notifications from a dedicated dispatcher thread, so Write only enqueues the change batches.
+    // once an observer has maxPendingBatches batches waiting, further batches are merged into the last one,
+    // keeping only the latest value of each key. zero means never merge.
+    void StartDispatcher(size_t maxPendingBatches=16);
+
+    // go back to notifying observers on the writer's thread, delivers what is still pending first
+    void StopDispatcher();
+
+    // whether the calling thread is the dispatcher thread, which an observer must not block
+    bool IsDispatcherThread();
+
+    // writes, lock contention and observer callbacks of this memory
+    PLCMemoryMetrics& GetMetrics();
+
 private:
-    std::map<std::string, PLCValue> _entries;
+    struct Entry {
+        PLCValue value;
+        uint64_t sequence = 0; ///< sequence number of the last modification, 0 if never written
+        PLCKeyHandle newer = PLCKeyHandle_Invalid; ///< next more recently modified entry
+        PLCKeyHandle older = PLCKeyHandle_Invalid; ///< next less recently modified entry
+        std::vector<uint32_t> subscribers; ///< indices into _subscriptions of the filtered observers watching this key
+    };
+
+    struct Subscription {
+        std::weak_ptr<PLCMemoryObserver> observer;
+        bool all = false; ///< receives every modification, no filtering
+        std::vector<std::string> prefixes; ///< matched against keys registered after the subscription
+    };
+
+    struct Notification {
+        uint32_t subscription = 0; ///< index into _subscriptions
+        std::weak_ptr<PLCMemoryObserver> observer;
+        bool all = false; ///< if true, gets the full modifications instead of keyvalues
+        std::map<std::string, PLCValue> keyvalues; ///< slice of the modifications the observer subscribed to
+    };
+
+    PLCKeyHandle _Intern(const std::string& key); ///< needs _mutex
+    bool _Assign(PLCKeyHandle key, const PLCValue& value, uint64_t sequence); ///< needs _mutex, returns true if modified
+    void _Commit(const std::vector<PLCKeyHandle>& modifiedKeys, std::map<std::string, PLCValue>& modifications, std::vector<Notification>& notifications); ///< needs _mutex
+    void _Notify(uint64_t sequence, const std::map<std::string, PLCValue>& modifications, const std::vector<Notification>& notifications);
+    void _Subscribe(const std::shared_ptr<PLCMemoryObserver>& observer, bool all, const std::vector<std::string>& keys, const std::vector<std::string>& prefixes);
+
+    struct Batch {
+        uint64_t sequence = 0; ///< sequence number of the latest write merged into the batch
+        std::map<std::string, PLCValue> keyvalues;
+    };
+
+    struct PendingBatches {
+        std::weak_ptr<PLCMemoryObserver> observer;
+        std::deque<std::shared_ptr<Batch>> batches; ///< shared between observers until merged into
+    };
+
+    void _Post(uint64_t sequence, std::map<std::string, PLCValue>& modifications, std::vector<Notification>& notifications); ///< needs _mutex, so batches are queued in sequence order
+    void _Post(uint32_t subscription, const std::weak_ptr<PLCMemoryObserver>& observer, const std::shared_ptr<Batch>& batch); ///< needs _dispatcherMutex
+    void _RunDispatcherThread();
+    void _WaitUntilDrained(); ///< before notifying on the writer's thread, lets the dispatcher deliver what was posted before
+
+    PLCKeyRegistry _registry; ///< protected by _mutex
+    std::vector<Entry> _entries; ///< indexed by key handle, protected by _mutex
+    std::map<std::string_view, PLCKeyHandle> _orderedKeys; ///< names of _registry in order, for prefix and range reads, protected by _mutex
+    PLCKeyHandle _newest; ///< most recently modified entry, head of the list ordered by sequence, protected by _mutex
+    uint64_t _sequence; ///< sequence number of the last modification, protected by _mutex
     std::mutex _mutex;
-    std::vector<std::weak_ptr<PLCMemoryObserver>> _observers;
+    std::vector<Subscription> _subscriptions; ///< protected by _mutex
+    bool _dispatching; ///< whether notifications go through the dispatcher thread, protected by _mutex
+
+    std::thread _dispatcherThread;
+    std::vector<PendingBatches> _pending; ///< indexed by subscription, protected by _dispatcherMutex
+    std::deque<uint32_t> _ready; ///< subscriptions with pending batches in delivery order, protected by _dispatcherMutex
+    size_t _maxPendingBatches; ///< protected by _dispatcherMutex
+    bool _dispatcherShutdown; ///< protected by _dispatcherMutex
+    std::atomic<bool> _draining; ///< dispatcher stopped but still delivering, set under _mutex and cleared under _dispatcherMutex
+    std::thread::id _dispatcherThreadId; ///< protected by _dispatcherMutex
+    std::condition_variable _dispatcherCondition;
+    std::mutex _dispatcherMutex; ///< protects the dispatcher queues, may be taken while holding _mutex but not the other way around
+
+    PLCMemoryMetrics _metrics;
 };
 
 }
@@ -0,0 +1,136 @@
+#ifndef MUJINPLC_PLCMETRICS_H
+#define MUJINPLC_PLCMETRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <mujinplc/config.h>
+
+namespace mujinplc {
+
+// every counter, gauge and histogram is on cache lines of its own, so that the ones updated by different threads,
+// e.g. the writers and the consumer of a controller, do not slow each other down
+static const size_t PLCMetricAlignment = 64;
+
+/// number of events, counted with a relaxed atomic add so that it can stay on in the hot path
+class MUJINPLC_API PLCCounter {
+public:
+    void Add(uint64_t value=1) {
+        _value.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    uint64_t Get() const {
+        return _value.load(std::memory_order_relaxed);
+    }
+
+    void Reset() {
+        _value.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    alignas(PLCMetricAlignment) std::atomic<uint64_t> _value{0};
+};
+
+/// current level of something, e.g. a queue depth, and the highest level it reached since the last reset
+class MUJINPLC_API PLCGauge {
+public:
+    void Add(int64_t delta);
+
+    int64_t Get() const {
+        return _value.load(std::memory_order_relaxed);
+    }
+
+    int64_t GetMax() const {
+        return _max.load(std::memory_order_relaxed);
+    }
+
+    void Reset(); ///< only resets the maximum to the current level, the level itself is still tracked
+
+private:
+    alignas(PLCMetricAlignment) std::atomic<int64_t> _value{0};
+    std::atomic<int64_t> _max{0};
+};
+
+/// log linear histogram of non negative values, e.g. durations in nanoseconds.
+/// values below 8 have a bucket each, every power of two above is split into 8 linear buckets, so a percentile is
+/// off by at most an eighth of its value. recording is two relaxed atomic adds, there are no locks.
+class MUJINPLC_API PLCHistogram {
+public:
+    static const size_t NumSubBuckets = 8;
+    static const size_t NumBuckets = (64 - 2) * NumSubBuckets;
+
+    void Record(uint64_t value);
+
+    // record the nanoseconds elapsed since start
+    void RecordSince(const std::chrono::steady_clock::time_point& start) {
+        Record(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    uint64_t GetCount() const;
+    uint64_t GetSum() const;
+    uint64_t GetMax() const;
+
+    // upper bound of the bucket holding the given percentile (0 to 100), 0 if nothing was recorded
+    uint64_t GetPercentile(double percentile) const;
+
+    void Reset();
+
+private:
+    static size_t _GetBucket(uint64_t value);
+    static uint64_t _GetUpperBound(size_t bucket);
+
+    alignas(PLCMetricAlignment) std::atomic<uint64_t> _sum{0};
+    std::atomic<uint64_t> _max{0};
+    std::atomic<uint64_t> _buckets[NumBuckets] = {};
+};
+
+/// metrics of one PLCServer, see PLCServer::GetMetrics, always on. durations are in nanoseconds.
+struct MUJINPLC_API PLCServerMetrics {
+    static const size_t NumCommands = 16; ///< size of the per command counters, indexed by PLCCommand
+
+    PLCCounter requests[NumCommands]; ///< requests served, malformed ones count as PLCCommand_Unknown
+    PLCCounter rejectedRequests; ///< requests rejected by the schema of the server, see PLCServer::SetSchema
+    PLCHistogram decodeTime;
+    PLCHistogram handleTime;
+    PLCHistogram encodeTime;
+    PLCHistogram requestTime; ///< from receiving the request to sending the reply
+
+    void Reset();
+
+    // append all of the above as a json object, histograms as {"count", "mean", "p50", "p90", "p99", "p999", "max"}
+    void Write(std::string& json) const;
+};
+
+/// metrics of one PLCMemory, see PLCMemory::GetMetrics, always on. durations are in nanoseconds.
+struct MUJINPLC_API PLCMemoryMetrics {
+    static const uint32_t LockHoldSampling = 8; ///< every thread times one in that many of its writes, reading the clock costs as much as a write
+
+    PLCCounter writes; ///< write batches that modified something
+    PLCCounter modifiedKeys;
+    PLCHistogram lockWaitTime; ///< writers that found the memory locked, uncontended locking is not recorded
+    PLCHistogram lockHoldTime; ///< writers holding the memory lock, sampled, see LockHoldSampling
+    PLCHistogram observerCallbackTime; ///< one MemoryModified call, on the writer or the dispatcher thread
+
+    void Reset();
+    void Write(std::string& json) const; ///< same as PLCServerMetrics::Write
+};
+
+/// metrics of one PLCController, see PLCController::GetMetrics, always on. durations are in nanoseconds.
+struct MUJINPLC_API PLCControllerMetrics {
+    PLCCounter enqueued; ///< change batches queued
+    PLCCounter dequeued;
+    PLCGauge queueDepth; ///< change batches waiting
+    PLCGauge queueEntries; ///< key values waiting, see PLCChangeQueue
+    PLCHistogram queueDepthAtEnqueue; ///< depth of the queue right after queueing
+    PLCCounter coalesced; ///< change batches merged into another because the queue was full
+    PLCCounter droppedEdges; ///< intermediate values of edge sensitive keys lost to coalescing
+    PLCHistogram blockedTime; ///< writers waiting for room in the queue with PLCQueueOverflowPolicy_Block
+
+    void Reset();
+    void Write(std::string& json) const; ///< same as PLCServerMetrics::Write
+};
+
+}
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef MUJINPLC_PLCPERSISTENCE_H
+#define MUJINPLC_PLCPERSISTENCE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <mujinplc/config.h>
+#include <mujinplc/plcmemory.h>
+
+namespace mujinplc {
+
+/// persists a PLCMemory into a directory, so that a restarted process comes back with the signals it had.
+/// a background thread appends the keys modified since its last flush to a memory mapped write ahead log,
+/// and compacts the log into a snapshot of the whole memory once it is half full. writers of the memory never wait for it.
+/// both files hold binary write requests (see plcprotocol.h), checksummed together with the generation of the snapshot
+/// they belong to, so that a torn record or a log left over from an interrupted compaction is never replayed.
+class MUJINPLC_API PLCPersistence {
+public:
+    // flushInterval bounds how much of the latest modifications a crash of the process can lose.
+    // the log lives in the page cache, so it survives the process crashing. syncToDisk also msyncs it after every flush,
+    // to survive the host crashing, at the cost of a disk write per flush.
+    PLCPersistence(const std::shared_ptr<PLCMemory>& memory, const std::string& directory, std::chrono::milliseconds flushInterval=std::chrono::milliseconds(10), size_t logSize=16*1024*1024, bool syncToDisk=false);
+    virtual ~PLCPersistence();
+
+    // restore the snapshot and replay the log into the memory as one write, then keep logging its modifications.
+    // call before anything else writes to the memory. returns the number of keys restored.
+    // throws std::system_error when the files cannot be opened and std::runtime_error when they are corrupt.
+    size_t Start();
+
+    // flush what is left, then stop logging
+    void Stop();
+    bool IsRunning() const;
+
+    // append the keys modified since the last flush to the log right away
+    void Flush();
+
+    // write a snapshot of the whole memory and start over with an empty log
+    void Compact();
+
+private:
+    void _RunThread();
+    void _Flush(); ///< needs _mutex
+    void _Compact(); ///< needs _mutex
+    void _OpenLog(); ///< needs _mutex
+    void _ResetLog(uint64_t generation); ///< needs _mutex
+    bool _ReadSnapshot(std::string& payload); ///< needs _mutex, returns false if there is no snapshot yet
+    void _WriteSnapshot(uint64_t generation, const std::string& payload); ///< needs _mutex
+    void _Append(const std::string& payload); ///< needs _mutex and enough room in the log
+
+    std::shared_ptr<PLCMemory> _memory;
+    std::string _directory;
+    std::chrono::milliseconds _flushInterval;
+    size_t _logSize;
+    bool _syncToDisk;
+
+    std::atomic<bool> _shutdown;
+    std::thread _thread;
+    std::condition_variable _condition;
+
+    std::mutex _mutex; ///< serializes flushes and compactions
+    bool _running; ///< protected by _mutex
+    int _logFd; ///< protected by _mutex
+    char* _log; ///< mapping of the log file, protected by _mutex
+    size_t _mappedSize; ///< _logSize, unless the file on disk was written with another size and not reset yet, protected by _mutex
+    size_t _logOffset; ///< where the next record goes, protected by _mutex
+    uint64_t _generation; ///< generation of the current snapshot and log, protected by _mutex
+    uint64_t _sequence; ///< sequence number of the memory flushed up to, protected by _mutex
+    std::string _payload; ///< encoding buffer reused between flushes, protected by _mutex
+};
+
+}
+
+#endif
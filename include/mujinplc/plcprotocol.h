@@ -0,0 +1,102 @@
+#ifndef MUJINPLC_PLCPROTOCOL_H
+#define MUJINPLC_PLCPROTOCOL_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <mujinplc/config.h>
+#include <mujinplc/plcmemory.h>
+
+namespace mujinplc {
+
+/// encoding of a message on the wire, selected per message by its first byte.
+/// json messages start with '{' (or whitespace), binary messages start with PLCBinaryHeader.
+enum MUJINPLC_API PLCEncoding {
+    PLCEncoding_JSON,
+    PLCEncoding_Binary,
+};
+
+/// first byte of a binary message, never the start of a json text
+const unsigned char PLCBinaryHeader = 0x01;
+
+enum MUJINPLC_API PLCCommand {
+    PLCCommand_Unknown = 0,
+    PLCCommand_Read = 1, ///< json {"command": "read", "keys": [...]}
+    PLCCommand_Write = 2, ///< json {"command": "write", "keyvalues": {...}}
+    PLCCommand_ReadModified = 3, ///< json {"command": "readmodified", "sequence": n, "keys": [...] (optional)}
+    PLCCommand_Snapshot = 4, ///< json {"command": "snapshot", "prefixes": [...] (optional)}, keys starting with any of the prefixes, all keys if none
+    PLCCommand_Batch = 5, ///< json {"command": "batch", "operations": [{"op": "read"|"write"|"cas", "key": k, "expected": v (cas), "value": v (write, cas)}, ...]}, see PLCMemory::Execute
+    PLCCommand_Stats = 6, ///< json {"command": "stats"}, see PLCServer::GetMetrics
+    PLCCommand_ReadRange = 7, ///< json {"command": "readrange", "begin": b, "end": e, "limit": n (all optional)}, keys in [begin, end) in order, see PLCMemory::ReadRange
+};
+
+// json name of the command, "unknown" for anything that is not a command
+MUJINPLC_API const char* GetCommandName(PLCCommand command);
+
+/// decoded request, the same for every encoding
+struct MUJINPLC_API PLCRequest {
+    PLCCommand command = PLCCommand_Unknown;
+    std::vector<std::string> keys; ///< keys to read
+    bool hasKeys = false; ///< for readmodified, whether keys filters the result
+    std::map<std::string, PLCValue> keyvalues; ///< keyvalues to write
+    uint64_t sequence = 0; ///< for readmodified, sequence returned by the previous call
+    std::vector<std::string> prefixes; ///< for snapshot, key prefixes to return
+    std::string begin; ///< for readrange, first key to return
+    std::string end; ///< for readrange, key after the last one to return, empty for up to the last key
+    uint64_t limit = 0; ///< for readrange, maximum number of keys to return, zero for no limit
+    std::vector<PLCOperation> operations; ///< for batch
+};
+
+/// decoded response, the same for every encoding. fields not present are not sent.
+struct MUJINPLC_API PLCResponse {
+    bool hasKeyValues = false;
+    std::vector<std::pair<std::string, PLCValue>> keyvalues; ///< a vector so that a reused response does not allocate
+    bool hasSequence = false;
+    uint64_t sequence = 0;
+    bool hasResults = false;
+    std::vector<PLCOperationResult> results; ///< for batch, json [{"success": b, "value": v}, ...]
+    bool hasStats = false;
+    std::string stats; ///< for stats, {"server": PLCServerMetrics::Write, "memory": PLCMemoryMetrics::Write, "controllers": [PLCControllerMetrics::Write or null, ...]}, embedded as is in json responses
+};
+
+// binary layout, integers are little endian, varint is unsigned leb128:
+//   request  = header command:u8 payload
+//     read         payload = count:varint key*
+//     write        payload = count:varint (key value)*
+//     readmodified payload = sequence:varint hasKeys:u8 [count:varint key*]
+//     snapshot     payload = count:varint prefix*
+//     batch        payload = count:varint (type:u8 (PLCOperationType) key [expected:value if cas] [value if not read])*
+//     stats        payload = nothing
+//     readrange    payload = begin:key end:key limit:varint
+//   response = header flags:u8 [count:varint (key value)*] [sequence:varint] [count:varint (success:u8 value)*] [stats:key]
+//     flags bit 0 = has keyvalues, bit 1 = has sequence, bit 2 = has results, bit 3 = has stats
+//   key      = length:varint bytes
+//   value    = type:u8 (PLCValueType) then null: nothing, boolean: u8, integer: i32, string: length:varint bytes,
+//              double: f64, integer64: i64, integerarray: count:varint i32*, doublearray: count:varint f64*, blob: length:varint bytes
+//   update   = header sequence:varint value
+
+MUJINPLC_API PLCEncoding GetEncoding(const char* data, size_t size);
+
+// decoding detects the encoding from the first byte, returns false for malformed messages.
+// requests and responses are overwritten in place and the json codec keeps per thread scratch buffers,
+// so decoding and encoding the same shape of message again does not allocate.
+MUJINPLC_API bool DecodeRequest(const char* data, size_t size, PLCRequest& request);
+MUJINPLC_API void EncodeRequest(const PLCRequest& request, PLCEncoding encoding, std::string& data);
+
+MUJINPLC_API bool DecodeResponse(const char* data, size_t size, PLCResponse& response);
+MUJINPLC_API void EncodeResponse(const PLCResponse& response, PLCEncoding encoding, std::string& data);
+
+// change stream of the publisher, one message of two frames per modified key: the key as topic so that subscribers
+// can filter by key prefix, then the update, always binary.
+// a late subscriber catches up without reading the whole memory all the time:
+//   1. subscribe to the prefixes it needs and buffer the updates
+//   2. send a snapshot request for the same prefixes, or a readmodified request with the sequence it last applied
+//   3. apply the response, then every buffered and future update whose sequence is newer than the one of the
+//      response and than the last update applied to the same key (updates of concurrent writes can arrive out of order)
+MUJINPLC_API void EncodeUpdate(uint64_t sequence, const PLCValue& value, std::string& data);
+MUJINPLC_API bool DecodeUpdate(const char* data, size_t size, uint64_t& sequence, PLCValue& value);
+
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef MUJINPLC_PLCREACTOR_H
+#define MUJINPLC_PLCREACTOR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <mujinplc/config.h>
+#include <mujinplc/plcserver.h>
+
+namespace mujinplc {
+
+/// serves the endpoints of many servers, each with its own memory, from a single thread polling all of their sockets.
+/// the thread sleeps in zmq_poll until a request arrives. Add, Remove and Stop wake it up through an eventfd, so they
+/// take effect right away instead of after a poll timeout.
+/// only servers with a single worker can be added. a publisher endpoint of a server still gets a thread of its own.
+class MUJINPLC_API PLCReactor {
+public:
+    // ctx is used for the servers constructed without a context, so that they share its io threads. NULL creates one.
+    // inproc endpoints are only reachable through the context the server is bound with.
+    PLCReactor(void* ctx=NULL);
+    virtual ~PLCReactor(); ///< stops, then hands every server back as if removed
+
+    // serve the endpoint of the server from the reactor thread, from the next Start on if not running.
+    // throws std::invalid_argument if the server has more than one worker or is already running.
+    void Add(const std::shared_ptr<PLCServer>& server);
+
+    // stop serving the endpoint of the server, returns once its socket is closed
+    void Remove(const std::shared_ptr<PLCServer>& server);
+
+    size_t GetNumServers() const;
+
+    bool IsRunning() const;
+    void Start();
+    void Stop(); ///< returns once every socket is closed, the servers stay added and are served again on the next Start
+
+private:
+    struct Endpoint {
+        std::shared_ptr<PLCServer> server;
+        std::shared_ptr<PLCServerSession> session; ///< NULL until bound
+        std::chrono::steady_clock::time_point retry; ///< when to try binding again
+    };
+
+    void _Wakeup();
+    void _RunThread();
+    void _Update(std::vector<Endpoint>& endpoints); ///< needs _mutex, follow _servers
+
+    void* _ctx;
+    bool _ownsContext;
+    int _wakeupFd; ///< eventfd polled next to the sockets
+
+    mutable std::mutex _mutex;
+    std::condition_variable _condition; ///< notified when the thread applied a generation of _servers
+    std::vector<std::shared_ptr<PLCServer>> _servers; ///< protected by _mutex
+    uint64_t _generation; ///< bumped by every change of _servers, protected by _mutex
+    uint64_t _appliedGeneration; ///< generation of _servers the thread serves, protected by _mutex
+    bool _running; ///< protected by _mutex
+    bool _shutdown; ///< protected by _mutex
+    std::thread _thread;
+};
+
+}
+
+#endif
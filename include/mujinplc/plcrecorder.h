@@ -0,0 +1,80 @@
+#ifndef MUJINPLC_PLCRECORDER_H
+#define MUJINPLC_PLCRECORDER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <mujinplc/config.h>
+
+namespace mujinplc {
+
+/// one request served by PLCServer and the response it got, as recorded by PLCRecorder
+struct MUJINPLC_API PLCRecord {
+    uint64_t time = 0; ///< nanoseconds from the start of the recording to receiving the request
+    uint64_t duration = 0; ///< nanoseconds from receiving the request to having the response ready to send
+    std::string request; ///< as received, json or binary
+    std::string response; ///< as sent
+};
+
+/// records the traffic of a PLCServer into a compact binary file, see PLCServer::SetRecorder.
+/// records are appended to a buffer in memory and written out by a background thread, so the server never waits for
+/// the disk. when the disk cannot keep up and maxBufferedBytes are waiting, further records are dropped and counted.
+/// file layout, varint is unsigned leb128:
+///   header = magic:u32 "MPLR" version:u32
+///   record = time:varint duration:varint requestLength:varint request responseLength:varint response
+class MUJINPLC_API PLCRecorder {
+public:
+    // throws std::system_error if the file cannot be created
+    PLCRecorder(const std::string& filename, size_t maxBufferedBytes=64*1024*1024);
+    virtual ~PLCRecorder(); ///< writes out what is still buffered
+
+    // thread safe, called by every server worker
+    void Record(const std::chrono::steady_clock::time_point& received, const std::chrono::steady_clock::time_point& replied, const char* request, size_t requestSize, const char* response, size_t responseSize);
+
+    // block until everything recorded so far is written to the file
+    void Flush();
+
+    uint64_t GetNumRecorded() const;
+    uint64_t GetNumDropped() const;
+
+private:
+    void _RunThread();
+
+    FILE* _file;
+    std::chrono::steady_clock::time_point _start;
+    size_t _maxBufferedBytes;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _condition; ///< wakes up the writer thread, and Flush once written
+    std::string _buffer; ///< records not handed to the writer thread yet, protected by _mutex
+    uint64_t _numBuffered; ///< records appended to _buffer since the start, protected by _mutex
+    uint64_t _numWritten; ///< records written to the file, protected by _mutex
+    uint64_t _numDropped; ///< protected by _mutex
+    bool _shutdown; ///< protected by _mutex
+    std::thread _thread;
+};
+
+/// reads back the records of a file written by PLCRecorder, in the order they were recorded
+class MUJINPLC_API PLCRecordReader {
+public:
+    // throws std::system_error if the file cannot be opened and std::runtime_error if it is not a recording
+    PLCRecordReader(const std::string& filename);
+    virtual ~PLCRecordReader();
+
+    // returns false at the end of the file, a record cut short by a crash of the recording process also ends it
+    bool Read(PLCRecord& record);
+
+private:
+    bool _ReadVarint(uint64_t& value);
+    bool _ReadBytes(std::string& bytes);
+
+    FILE* _file;
+};
+
+}
+
+#endif
@@ -0,0 +1,203 @@
+#ifndef MUJINPLC_PLCSCHEMA_H
+#define MUJINPLC_PLCSCHEMA_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <mujinplc/config.h>
+#include <mujinplc/plcmemory.h>
+
+namespace mujinplc {
+
+/// who writes a signal
+enum MUJINPLC_API PLCSignalDirection {
+    PLCSignalDirection_Input = 0, ///< written by the plc through PLCServer, only read by the controller
+    PLCSignalDirection_Output = 1, ///< written by the controller, only read by the plc
+    PLCSignalDirection_InOut = 2, ///< written by both
+};
+
+/// c++ type of the values of a signal, one of bool, int, int64_t, double, std::string, PLCIntegerArray, PLCDoubleArray or PLCBlob
+template <typename T>
+struct PLCValueTraits;
+
+template <>
+struct PLCValueTraits<bool> {
+    static constexpr PLCValueType Type = PLCValueType_Boolean;
+    static bool Is(const PLCValue& value) {
+        return value.IsBoolean();
+    }
+    static bool Get(const PLCValue& value) {
+        return value.GetBoolean();
+    }
+};
+
+template <>
+struct PLCValueTraits<int> {
+    static constexpr PLCValueType Type = PLCValueType_Integer;
+    static bool Is(const PLCValue& value) {
+        return value.IsInteger();
+    }
+    static int Get(const PLCValue& value) {
+        return value.GetInteger();
+    }
+};
+
+template <>
+struct PLCValueTraits<std::string> {
+    static constexpr PLCValueType Type = PLCValueType_String;
+    static bool Is(const PLCValue& value) {
+        return value.IsString();
+    }
+    static const std::string& Get(const PLCValue& value) {
+        return value.GetString();
+    }
+};
+
+template <>
+struct PLCValueTraits<int64_t> {
+    static constexpr PLCValueType Type = PLCValueType_Integer64;
+    static bool Is(const PLCValue& value) {
+        return value.IsInteger64();
+    }
+    static int64_t Get(const PLCValue& value) {
+        return value.GetInteger64();
+    }
+};
+
+template <>
+struct PLCValueTraits<double> {
+    static constexpr PLCValueType Type = PLCValueType_Double;
+    static bool Is(const PLCValue& value) {
+        return value.IsDouble();
+    }
+    static double Get(const PLCValue& value) {
+        return value.GetDouble();
+    }
+};
+
+// bulk types are read as their storage, which the caller can keep without copying the elements
+template <>
+struct PLCValueTraits<PLCIntegerArray> {
+    static constexpr PLCValueType Type = PLCValueType_IntegerArray;
+    static bool Is(const PLCValue& value) {
+        return value.IsIntegerArray();
+    }
+    static PLCIntegerArray Get(const PLCValue& value) {
+        return value.GetSharedIntegerArray();
+    }
+};
+
+template <>
+struct PLCValueTraits<PLCDoubleArray> {
+    static constexpr PLCValueType Type = PLCValueType_DoubleArray;
+    static bool Is(const PLCValue& value) {
+        return value.IsDoubleArray();
+    }
+    static PLCDoubleArray Get(const PLCValue& value) {
+        return value.GetSharedDoubleArray();
+    }
+};
+
+template <>
+struct PLCValueTraits<PLCBlob> {
+    static constexpr PLCValueType Type = PLCValueType_Blob;
+    static bool Is(const PLCValue& value) {
+        return value.IsBlob();
+    }
+    static PLCBlob Get(const PLCValue& value) {
+        return value.GetSharedBlob();
+    }
+};
+
+/// one signal of a schema, meant to be constexpr. the slot is its index in the schema, so that typed accessors
+/// resolve it with an array lookup instead of hashing its name, and the direction is part of the type, so that
+/// writing an input signal does not compile.
+///   constexpr mujinplc::PLCInputSignal<bool> startOrderCycle{"startOrderCycle", 0};
+///   constexpr mujinplc::PLCOutputSignal<int> orderCycleStatus{"orderCycleStatus", 1};
+///   constexpr mujinplc::PLCSignalInfo schema[] = {mujinplc::Describe(startOrderCycle), mujinplc::Describe(orderCycleStatus)};
+///   static_assert(mujinplc::IsValidSchema(schema), "slots must match the order of the schema and names must be unique");
+template <typename T, PLCSignalDirection Direction>
+struct PLCSignal {
+    typedef T ValueType;
+    static constexpr PLCSignalDirection SignalDirection = Direction;
+
+    const char* name;
+    uint32_t slot;
+};
+
+template <typename T> using PLCInputSignal = PLCSignal<T, PLCSignalDirection_Input>;
+template <typename T> using PLCOutputSignal = PLCSignal<T, PLCSignalDirection_Output>;
+template <typename T> using PLCInOutSignal = PLCSignal<T, PLCSignalDirection_InOut>;
+
+/// untyped description of a signal, an array of them makes a schema
+struct MUJINPLC_API PLCSignalInfo {
+    const char* name;
+    PLCValueType type;
+    PLCSignalDirection direction;
+    uint32_t slot;
+};
+
+template <typename T, PLCSignalDirection Direction>
+constexpr PLCSignalInfo Describe(const PLCSignal<T, Direction>& signal) {
+    return PLCSignalInfo{signal.name, PLCValueTraits<T>::Type, Direction, signal.slot};
+}
+
+constexpr bool IsSameSignalName(const char* lhs, const char* rhs) {
+    return *lhs == *rhs && (*lhs == '\0' || IsSameSignalName(lhs + 1, rhs + 1));
+}
+
+// whether every signal sits in its slot and no name appears twice, for a static_assert
+template <size_t NumSignals>
+constexpr bool IsValidSchema(const PLCSignalInfo (&signals)[NumSignals]) {
+    for (size_t index = 0; index < NumSignals; ++index) {
+        if (signals[index].slot != index) {
+            return false;
+        }
+        for (size_t other = 0; other < index; ++other) {
+            if (IsSameSignalName(signals[index].name, signals[other].name)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/// schema at runtime, for PLCController::SetSchema and PLCServer::SetSchema
+class MUJINPLC_API PLCSchema {
+public:
+    static const uint32_t InvalidSlot = UINT32_MAX;
+
+    PLCSchema(const PLCSignalInfo* signals, size_t numSignals); ///< throws std::invalid_argument if IsValidSchema would fail
+
+    template <size_t NumSignals>
+    explicit PLCSchema(const PLCSignalInfo (&signals)[NumSignals]) : PLCSchema(signals, NumSignals) {
+    }
+
+    // the names of _signals point into _names, share the schema through a shared_ptr instead
+    PLCSchema(const PLCSchema&) = delete;
+    PLCSchema& operator=(const PLCSchema&) = delete;
+
+    virtual ~PLCSchema();
+
+    size_t GetNumSignals() const;
+    const PLCSignalInfo& GetSignal(uint32_t slot) const;
+    const std::string& GetName(uint32_t slot) const;
+
+    // slot of the signal, InvalidSlot if not in the schema
+    uint32_t Find(const std::string& name) const;
+
+    // whether the plc may write the value to the key. slot is set to the slot of the key.
+    // a key outside of the schema may only be written if not strict.
+    bool IsWritableByPLC(const std::string& key, const PLCValue& value, bool strict, uint32_t& slot) const;
+
+private:
+    std::vector<PLCSignalInfo> _signals;
+    std::vector<std::string> _names; ///< owned copies of the names, indexed by slot
+    std::unordered_map<std::string, uint32_t> _slots;
+};
+
+}
+
+#endif
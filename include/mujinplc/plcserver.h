@@ -1,30 +1,94 @@
 #ifndef MUJINPLC_PLCSERVER_H
 #define MUJINPLC_PLCSERVER_H
 
+#include <atomic>
 #include <thread>
 #include <mujinplc/config.h>
 #include <mujinplc/plcmemory.h>
+#include <mujinplc/plcschema.h>
 
 namespace mujinplc {
 
+class PLCController;
+class PLCPublisherObserver;
+class PLCReactor;
+class PLCRecorder;
+class PLCServerSession;
+struct PLCRequest;
+
 class MUJINPLC_API PLCServer {
 public:
-    PLCServer(const std::shared_ptr<PLCMemory>& memory, void* ctx, const std::string& endpoint);
+    // with more than one worker, a ROUTER socket is bound to the endpoint and requests are handled by a pool of worker threads.
+    // all requests of one client go to the same worker, so they are still answered in order.
+    // with a publisher endpoint, a PUB socket is bound to it that streams every modification of the memory, see EncodeUpdate.
+    PLCServer(const std::shared_ptr<PLCMemory>& memory, void* ctx, const std::string& endpoint, size_t numWorkers=1, const std::string& publisherEndpoint=std::string());
     virtual ~PLCServer();
 
     bool IsRunning() const;
+
+    // record every request and its response, call before Start. a null recorder stops recording on the next Start.
+    void SetRecorder(const std::shared_ptr<PLCRecorder>& recorder);
+
+    // check the writes of clients against the schema, call before Start. a request writing an output signal, a value of
+    // the wrong type, or, if strict, a key outside of the schema is rejected like a malformed one and writes nothing.
+    // writes of schema signals only are applied through the handles of the signals, without looking up their names.
+    void SetSchema(const std::shared_ptr<PLCSchema>& schema, bool strict=false);
+
+    // serve on a thread of its own. throws std::runtime_error while served by a PLCReactor, Stop does nothing then.
     void Start();
     void SetStop();
     void Stop();
 
+    // requests served by this server, also reported along with the metrics of its memory by the stats command
+    PLCServerMetrics& GetMetrics();
+
+    // also report the metrics of the controller, queue depth included, by the stats command, call before Start.
+    // only a weak reference is kept, a controller destroyed since is reported as null.
+    void AddController(const std::shared_ptr<PLCController>& controller);
+
 private:
     void _RunThread();
+    void _RunRouter();
+
+    // serve requests on one socket until stop, either the bound REP socket, or a PAIR socket connected to the router
+    void _Serve(void* ctx, const std::string& endpoint, bool worker, const std::atomic<bool>& stop);
 
-    bool _shutdown;
+    // open the socket of an endpoint to serve, NULL if it cannot be bound or connected right now
+    std::shared_ptr<PLCServerSession> _OpenSession(void* ctx, const std::string& endpoint, bool worker) const;
+    static void* _GetSocket(const PLCServerSession& session); ///< zmq socket to poll for requests
+
+    // answer the request waiting on the socket of the session, returns false if the socket failed and has to be opened again
+    bool _ServeRequest(PLCServerSession& session);
+
+    void _StartPublisher();
+    void _StopPublisher();
+
+    // whether the schema allows the writes of the request. if all keys of a write request are signals, handlevalues
+    // gets them with their handles, otherwise it is left empty.
+    bool _CheckSchema(const PLCSchema& schema, const PLCRequest& request, std::vector<std::pair<PLCKeyHandle, PLCValue>>& handlevalues) const;
+
+    // publish the modifications collected by the observer until shutdown
+    void _RunPublisher(std::shared_ptr<PLCPublisherObserver> publisher);
+
+    std::atomic<bool> _shutdown;
+    std::atomic<bool> _hosted; ///< whether a PLCReactor serves the endpoint instead of _thread
     std::thread _thread;
     std::shared_ptr<PLCMemory> _memory;
     void *_ctx;
     std::string _endpoint;
+    size_t _numWorkers;
+    std::string _publisherEndpoint;
+    std::shared_ptr<PLCPublisherObserver> _publisher; ///< observing the memory while running with a publisher endpoint
+    std::thread _publisherThread;
+    std::shared_ptr<PLCRecorder> _recorder; ///< only changed while stopped
+    std::shared_ptr<PLCSchema> _schema; ///< only changed while stopped
+    std::vector<PLCKeyHandle> _signalHandles; ///< handles of the signals of _schema, indexed by slot
+    bool _strictSchema;
+    std::vector<std::weak_ptr<PLCController>> _controllers; ///< only changed while stopped, reported by the stats command
+
+    PLCServerMetrics _metrics;
+
+    friend class PLCReactor; ///< serves sessions of the server from its own thread
 };
 
 }
@@ -0,0 +1,115 @@
+#ifndef MUJINPLC_PLCSHAREDMEMORY_H
+#define MUJINPLC_PLCSHAREDMEMORY_H
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <mujinplc/config.h>
+#include <mujinplc/plcmemory.h>
+
+namespace mujinplc {
+
+/// signals in a shared memory segment, for processes on the same host to exchange them with plain memory operations.
+/// keys live in a fixed number of fixed size slots, found by open addressing on a hash of the key, and are never removed.
+/// every slot is protected by a seqlock: writers take it by making its counter odd, readers retry when it changed under them.
+/// every write batch bumps a futex word in the header, so that other processes can block until something changes.
+class MUJINPLC_API PLCSharedMemory {
+public:
+    static const size_t MaxKeyLength = 64;
+    static const size_t MaxStringLength = 256;
+
+    // create a new segment. with a name, it is a posix shared memory object that other processes attach to by name until unlinked.
+    // without a name, it is a memfd, to hand over to the other process as a file descriptor.
+    static std::shared_ptr<PLCSharedMemory> Create(const std::string& name, uint32_t numSlots=1024);
+    static std::shared_ptr<PLCSharedMemory> Attach(const std::string& name);
+    static std::shared_ptr<PLCSharedMemory> Attach(int fd); ///< fd is duplicated, the caller keeps its own
+    static void Unlink(const std::string& name);
+
+    virtual ~PLCSharedMemory();
+
+    int GetFileDescriptor() const;
+
+    // whether the key and value fit into a slot, only null, boolean, integer and short string values do
+    static bool IsStorable(const std::string& key, const PLCValue& value);
+
+    // returns false if the key was never written
+    bool Read(const std::string& key, PLCValue& value);
+
+    // write all keyvalues, then wake up waiting processes once.
+    // writer tags the slots, so that a process can skip its own writes in ReadModifiedSince.
+    // throws std::invalid_argument for keyvalues that are not storable and std::runtime_error when out of slots.
+    void Write(const std::vector<std::pair<std::string, PLCValue>>& keyvalues, uint32_t writer=0);
+
+    // sequence number of the last slot write
+    uint64_t GetSequence() const;
+
+    // keys written after the given sequence number by anyone but excludedWriter, returns the sequence number to pass in next time.
+    // keys written concurrently may be returned again next time.
+    uint64_t ReadModifiedSince(uint64_t sequence, std::vector<std::pair<std::string, PLCValue>>& keyvalues, uint32_t excludedWriter=0);
+
+    // counter bumped by every write batch, only compare it for equality
+    uint32_t GetChangeCounter() const;
+
+    // block until the change counter differs from the given one, returns false on timeout
+    bool WaitForChange(uint32_t changeCounter, std::chrono::milliseconds timeout);
+
+private:
+    struct Header;
+    struct Slot;
+
+    PLCSharedMemory(int fd, bool create, uint32_t numSlots);
+
+    Slot* _FindSlot(const std::string& key, bool create); ///< returns NULL if not found and not creating
+    void _WriteSlot(Slot& slot, const PLCValue& value, uint32_t writer);
+    void _NotifyChange(); ///< bump the change counter and wake up waiting processes
+
+    int _fd;
+    void* _data;
+    size_t _size;
+    Header* _header;
+    Slot* _slots;
+
+    std::mutex _mutex;
+    std::unordered_map<std::string, Slot*> _slotCache; ///< slots already found by this process, protected by _mutex
+};
+
+/// keeps a PLCMemory in sync with a PLCSharedMemory, so that PLCController and memory observers in this process see
+/// the signals written by other processes attached to the segment, and the other way around.
+/// has to be owned by a shared_ptr, as it observes the memory.
+class MUJINPLC_API PLCSharedMemoryBridge : public PLCMemoryObserver, public std::enable_shared_from_this<PLCSharedMemoryBridge> {
+public:
+    PLCSharedMemoryBridge(const std::shared_ptr<PLCMemory>& memory, const std::shared_ptr<PLCSharedMemory>& sharedMemory);
+    virtual ~PLCSharedMemoryBridge();
+
+    // pull the current content of the segment into the memory, push the keys only the memory has, then keep both in sync
+    void Start();
+    void Stop();
+    bool IsRunning() const;
+
+    virtual void MemoryModified(const std::map<std::string, PLCValue>& keyvalues) override;
+    virtual void MemoryModified(uint64_t sequence, const std::map<std::string, PLCValue>& keyvalues) override;
+
+private:
+    void _RunThread();
+    void _Pull(); ///< copy the writes of other processes into the memory
+
+    std::shared_ptr<PLCMemory> _memory;
+    std::shared_ptr<PLCSharedMemory> _sharedMemory;
+    uint32_t _writer; ///< tags the writes of this bridge in the segment
+
+    std::atomic<bool> _shutdown;
+    std::thread _thread;
+
+    std::mutex _mutex; ///< serializes pulls with pushes
+    bool _running; ///< whether modifications of the memory are pushed, protected by _mutex
+    bool _observing; ///< whether already added as observer, the memory has no way to remove it again, protected by _mutex
+    uint64_t _sharedSequence; ///< sequence number of the segment pulled up to, protected by _mutex
+    std::unordered_map<std::string, uint64_t> _syncedSequences; ///< sequence number of the memory at which a key was last pulled or pushed, protected by _mutex
+};
+
+}
+
+#endif
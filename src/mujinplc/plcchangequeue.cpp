@@ -0,0 +1,159 @@
+#include "mujinplc/plcchangequeue.h"
+
+const uint32_t mujinplc::PLCChangeQueue::NoPosition;
+
+mujinplc::PLCChangeQueue::PLCChangeQueue(size_t maxBatches, mujinplc::PLCQueueOverflowPolicy policy) : _maxBatches(maxBatches), _policy(policy), _indexed(false) {
+}
+
+mujinplc::PLCChangeQueue::~PLCChangeQueue() {
+}
+
+void mujinplc::PLCChangeQueue::SetLimit(size_t maxBatches, mujinplc::PLCQueueOverflowPolicy policy) {
+    _maxBatches = maxBatches;
+    _policy = policy;
+}
+
+mujinplc::PLCQueueOverflowPolicy mujinplc::PLCChangeQueue::GetPolicy() const {
+    return _policy;
+}
+
+void mujinplc::PLCChangeQueue::SetEdgeSensitive(mujinplc::PLCKeyHandle key, size_t maxEdges) {
+    if (key >= _maxEdges.size()) {
+        _maxEdges.resize(key + 1, 0);
+    }
+    _maxEdges[key] = (uint32_t)maxEdges;
+}
+
+bool mujinplc::PLCChangeQueue::IsEmpty() const {
+    return _batches.empty();
+}
+
+bool mujinplc::PLCChangeQueue::IsFull() const {
+    return _maxBatches != 0 && _batches.size() >= _maxBatches;
+}
+
+size_t mujinplc::PLCChangeQueue::GetSize() const {
+    return _batches.size();
+}
+
+bool mujinplc::PLCChangeQueue::Push(Batch& batch) {
+    if (batch.empty()) {
+        return true;
+    }
+
+    bool queued = !IsFull() || _batches.empty();
+    if (queued) {
+        if (_indexed) {
+            _Unindex();
+        }
+        _stats.numEntries += batch.size();
+        _batches.emplace_back();
+        _batches.back().swap(batch);
+        _stats.numBatches = _batches.size();
+        if (_stats.numBatches > _stats.maxNumBatches) {
+            _stats.maxNumBatches = _stats.numBatches;
+        }
+    }
+    else {
+        _Coalesce(batch);
+        batch.clear();
+        _stats.numCoalesced++;
+    }
+    if (_stats.numEntries > _stats.maxNumEntries) {
+        _stats.maxNumEntries = _stats.numEntries;
+    }
+    return queued;
+}
+
+bool mujinplc::PLCChangeQueue::Pop(Batch& batch) {
+    if (_batches.empty()) {
+        return false;
+    }
+    if (_indexed && _batches.size() == 1) {
+        _Unindex();
+    }
+    batch.swap(_batches.front());
+    _batches.pop_front();
+    _stats.numBatches = _batches.size();
+    _stats.numEntries -= batch.size();
+    return true;
+}
+
+void mujinplc::PLCChangeQueue::PopAll(std::deque<Batch>& batches) {
+    if (_indexed) {
+        _Unindex();
+    }
+    batches.clear();
+    batches.swap(_batches);
+    _stats.numBatches = 0;
+    _stats.numEntries = 0;
+}
+
+const mujinplc::PLCChangeQueue::Stats& mujinplc::PLCChangeQueue::GetStats() const {
+    return _stats;
+}
+
+void mujinplc::PLCChangeQueue::ResetHighWaterMarks() {
+    _stats.maxNumBatches = _stats.numBatches;
+    _stats.maxNumEntries = _stats.numEntries;
+}
+
+void mujinplc::PLCChangeQueue::_Index() {
+    // a batch only gets duplicate keys by coalescing, so before that every key is in it once
+    const Batch& newest = _batches.back();
+    for (uint32_t position = 0; position < newest.size(); ++position) {
+        mujinplc::PLCKeyHandle key = newest[position].first;
+        if (key >= _positions.size()) {
+            _positions.resize(key + 1, NoPosition);
+            _numEdges.resize(key + 1, 0);
+        }
+        _positions[key] = position;
+        _numEdges[key] = 0;
+    }
+    _indexed = true;
+}
+
+void mujinplc::PLCChangeQueue::_Unindex() {
+    // only touch the keys of the newest batch, the index is as large as the memory
+    for (auto& keyvalue : _batches.back()) {
+        _positions[keyvalue.first] = NoPosition;
+    }
+    _indexed = false;
+}
+
+void mujinplc::PLCChangeQueue::_Coalesce(Batch& batch) {
+    if (!_indexed) {
+        _Index();
+    }
+    Batch& newest = _batches.back();
+    for (auto& keyvalue : batch) {
+        mujinplc::PLCKeyHandle key = keyvalue.first;
+        if (key >= _positions.size()) {
+            _positions.resize(key + 1, NoPosition);
+            _numEdges.resize(key + 1, 0);
+        }
+
+        uint32_t position = _positions[key];
+        if (position == NoPosition) {
+            _positions[key] = (uint32_t)newest.size();
+            _numEdges[key] = 0;
+            newest.emplace_back(key, std::move(keyvalue.second));
+            _stats.numEntries++;
+            continue;
+        }
+
+        uint32_t maxEdges = key < _maxEdges.size() ? _maxEdges[key] : 0;
+        if (_numEdges[key] < maxEdges) {
+            // the value it had becomes an edge, applied before the new one
+            _positions[key] = (uint32_t)newest.size();
+            _numEdges[key]++;
+            newest.emplace_back(key, std::move(keyvalue.second));
+            _stats.numEntries++;
+            continue;
+        }
+        if (maxEdges > 0) {
+            _stats.numDroppedEdges++;
+        }
+        newest[position].second = std::move(keyvalue.second);
+    }
+}
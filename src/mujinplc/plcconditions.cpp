@@ -0,0 +1,184 @@
+#include "mujinplc/plcconditions.h"
+
+mujinplc::PLCConditionRegistry::PLCConditionRegistry() : _numConditions(0) {
+}
+
+mujinplc::PLCConditionRegistry::~PLCConditionRegistry() {
+}
+
+mujinplc::PLCConditionRegistry::ConditionId mujinplc::PLCConditionRegistry::_Allocate() {
+    ConditionId id;
+    if (!_freeIds.empty()) {
+        id = _freeIds.back();
+        _freeIds.pop_back();
+    }
+    else {
+        id = (ConditionId)_conditions.size();
+        _conditions.emplace_back();
+    }
+
+    Condition& condition = _conditions[id];
+    condition.used = true;
+    condition.met = false;
+    condition.pending = false;
+    condition.numExpectations = 0;
+    condition.numSatisfied = 0;
+    condition.keys.clear();
+    _numConditions++;
+    return id;
+}
+
+void mujinplc::PLCConditionRegistry::_Watch(ConditionId id, mujinplc::PLCKeyHandle key, WatchType type, const mujinplc::PLCValue& value, bool satisfied) {
+    if (key >= _watches.size()) {
+        _watches.resize(key + 1);
+    }
+    _watches[key].push_back(Watch{id, type, value, satisfied});
+    _conditions[id].keys.push_back(key);
+}
+
+mujinplc::PLCConditionRegistry::ConditionId mujinplc::PLCConditionRegistry::AddUntilAll(const std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& expectations, const std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& exceptions, const std::function<const mujinplc::PLCValue*(mujinplc::PLCKeyHandle)>& current) {
+    ConditionId id = _Allocate();
+    Condition& condition = _conditions[id];
+
+    for (auto& keyvalue : exceptions) {
+        const mujinplc::PLCValue* value = current(keyvalue.first);
+        if (value != NULL && *value == keyvalue.second) {
+            condition.met = true;
+        }
+        _Watch(id, keyvalue.first, WatchType_Exception, keyvalue.second, false);
+    }
+
+    for (auto& keyvalue : expectations) {
+        const mujinplc::PLCValue* value = current(keyvalue.first);
+        bool satisfied = value != NULL && *value == keyvalue.second;
+        _Watch(id, keyvalue.first, WatchType_Expectation, keyvalue.second, satisfied);
+        condition.numExpectations++;
+        if (satisfied) {
+            condition.numSatisfied++;
+        }
+    }
+
+    if (condition.numSatisfied == condition.numExpectations) {
+        condition.met = true;
+    }
+    return id;
+}
+
+mujinplc::PLCConditionRegistry::ConditionId mujinplc::PLCConditionRegistry::AddForAny(const std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& keyvalues) {
+    ConditionId id = _Allocate();
+    for (auto& keyvalue : keyvalues) {
+        _Watch(id, keyvalue.first, WatchType_Change, keyvalue.second, false);
+    }
+    return id;
+}
+
+void mujinplc::PLCConditionRegistry::Remove(ConditionId id) {
+    if (id >= _conditions.size() || !_conditions[id].used) {
+        return;
+    }
+
+    Condition& condition = _conditions[id];
+    for (auto& key : condition.keys) {
+        std::vector<Watch>& watches = _watches[key];
+        for (size_t index = 0; index < watches.size(); ) {
+            if (watches[index].id == id) {
+                watches[index] = std::move(watches.back());
+                watches.pop_back();
+            }
+            else {
+                ++index;
+            }
+        }
+    }
+    condition.keys.clear();
+    condition.used = false;
+    _freeIds.push_back(id);
+    _numConditions--;
+}
+
+bool mujinplc::PLCConditionRegistry::IsMet(ConditionId id) const {
+    return id < _conditions.size() && _conditions[id].used && _conditions[id].met;
+}
+
+bool mujinplc::PLCConditionRegistry::IsEmpty() const {
+    return _numConditions == 0;
+}
+
+void mujinplc::PLCConditionRegistry::Update(mujinplc::PLCKeyHandle key, const mujinplc::PLCValue& value) {
+    _Update(key, value, NULL);
+}
+
+void mujinplc::PLCConditionRegistry::Update(mujinplc::PLCKeyHandle key, const mujinplc::PLCValue& value, std::vector<ConditionId>& met) {
+    _Update(key, value, &met);
+}
+
+void mujinplc::PLCConditionRegistry::_Update(mujinplc::PLCKeyHandle key, const mujinplc::PLCValue& value, std::vector<ConditionId>* met) {
+    if (key >= _watches.size()) {
+        return;
+    }
+
+    for (auto& watch : _watches[key]) {
+        Condition& condition = _conditions[watch.id];
+        bool wasMet = condition.met;
+        switch (watch.type) {
+        case WatchType_Expectation: {
+            bool satisfied = value == watch.value;
+            if (satisfied != watch.satisfied) {
+                watch.satisfied = satisfied;
+                if (satisfied) {
+                    condition.numSatisfied++;
+                }
+                else {
+                    condition.numSatisfied--;
+                }
+                if (!condition.pending && !condition.met) {
+                    condition.pending = true;
+                    _pending.push_back(watch.id);
+                }
+            }
+            break;
+        }
+        case WatchType_Exception:
+            if (value == watch.value) {
+                condition.met = true;
+            }
+            break;
+        case WatchType_Change:
+            if (watch.value.IsNull() || value == watch.value) {
+                condition.met = true;
+            }
+            break;
+        }
+
+        // a condition stays met once met, so it is reported only once
+        if (!wasMet && condition.met && met != NULL) {
+            met->push_back(watch.id);
+        }
+    }
+}
+
+void mujinplc::PLCConditionRegistry::Commit() {
+    _Commit(NULL);
+}
+
+void mujinplc::PLCConditionRegistry::Commit(std::vector<ConditionId>& met) {
+    _Commit(&met);
+}
+
+void mujinplc::PLCConditionRegistry::_Commit(std::vector<ConditionId>* met) {
+    for (ConditionId id : _pending) {
+        // removed since, or removed and allocated again, which clears pending
+        Condition& condition = _conditions[id];
+        if (!condition.used || !condition.pending) {
+            continue;
+        }
+        condition.pending = false;
+        if (!condition.met && condition.numSatisfied == condition.numExpectations) {
+            condition.met = true;
+            if (met != NULL) {
+                met->push_back(id);
+            }
+        }
+    }
+    _pending.clear();
+}
@@ -0,0 +1,248 @@
+#include "mujinplc/plcconnectionmonitor.h"
+
+#include <stdexcept>
+
+namespace mujinplc {
+
+class PLCConnectionMonitor::MemoryObserver : public PLCMemoryObserver {
+public:
+    MemoryObserver(PLCConnectionMonitor* monitor) : _monitor(monitor), _numCalls(0) {
+    }
+
+    virtual void MemoryModified(const std::map<std::string, PLCValue>& keyvalues) override {
+        // the memory calls observers outside of its lock, so a notification can still come in while the monitor stops
+        PLCConnectionMonitor* monitor;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_monitor == NULL) {
+                return;
+            }
+            monitor = _monitor;
+            _numCalls++;
+        }
+        monitor->_Beat(keyvalues);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (--_numCalls == 0) {
+                _condition.notify_all();
+            }
+        }
+    }
+
+    // stop calling into the monitor, and wait for the calls in progress to return
+    void Detach() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _monitor = NULL;
+        _condition.wait(lock, [this] { return _numCalls == 0; });
+    }
+
+private:
+    PLCConnectionMonitor* _monitor; ///< protected by _mutex, NULL once detached
+    size_t _numCalls; ///< calls of _Beat in progress, protected by _mutex
+    std::condition_variable _condition;
+    std::mutex _mutex;
+};
+
+}
+
+mujinplc::PLCConnectionMonitor::PLCConnectionMonitor(const std::shared_ptr<mujinplc::PLCMemory>& memory) : _memory(memory), _anyModification(false), _running(false), _shutdown(false), _numWaiters(0) {
+}
+
+mujinplc::PLCConnectionMonitor::~PLCConnectionMonitor() {
+    Stop();
+}
+
+void mujinplc::PLCConnectionMonitor::AddHeartbeat(const std::string& signal, const std::chrono::milliseconds& maxInterval) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_running) {
+        throw std::runtime_error("cannot add heartbeat " + signal + " to a running connection monitor");
+    }
+    _heartbeats.emplace_back();
+    _heartbeats.back().signal = signal;
+    _heartbeats.back().maxInterval = maxInterval;
+    if (signal.empty()) {
+        _anyModification = true;
+    }
+}
+
+void mujinplc::PLCConnectionMonitor::AddObserver(const std::shared_ptr<mujinplc::PLCConnectionObserver>& observer) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _observers.push_back(observer);
+}
+
+void mujinplc::PLCConnectionMonitor::Start() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_running) {
+            return;
+        }
+        _running = true;
+        _shutdown = false;
+    }
+    _thread = std::thread(&mujinplc::PLCConnectionMonitor::_RunThread, this);
+
+    // the memory only keeps a weak reference, Stop detaches it so that a notification in progress cannot outlive the monitor
+    _memoryObserver.reset(new MemoryObserver(this));
+    if (_anyModification) {
+        _memory->AddObserver(_memoryObserver);
+    }
+    else {
+        std::vector<std::string> signals;
+        for (auto& heartbeat : _heartbeats) {
+            signals.push_back(heartbeat.signal);
+        }
+        _memory->AddObserver(_memoryObserver, signals);
+    }
+}
+
+void mujinplc::PLCConnectionMonitor::Stop() {
+    if (!!_memoryObserver) {
+        _memoryObserver->Detach();
+        _memoryObserver.reset();
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _shutdown = true;
+    }
+    _condition.notify_all();
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _running = false;
+}
+
+int64_t mujinplc::PLCConnectionMonitor::_Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool mujinplc::PLCConnectionMonitor::IsConnected() const {
+    int64_t now = _Now();
+    for (auto& heartbeat : _heartbeats) {
+        if (now >= heartbeat.deadline.load()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool mujinplc::PLCConnectionMonitor::IsConnected(const std::string& signal) const {
+    for (auto& heartbeat : _heartbeats) {
+        if (heartbeat.signal == signal) {
+            return _Now() < heartbeat.deadline.load();
+        }
+    }
+    return false;
+}
+
+std::chrono::steady_clock::time_point mujinplc::PLCConnectionMonitor::GetDisconnectDeadline() const {
+    if (_heartbeats.empty()) {
+        return std::chrono::steady_clock::time_point::max();
+    }
+    int64_t deadline = INT64_MAX;
+    for (auto& heartbeat : _heartbeats) {
+        int64_t heartbeatDeadline = heartbeat.deadline.load();
+        if (heartbeatDeadline < deadline) {
+            deadline = heartbeatDeadline;
+        }
+    }
+    return std::chrono::steady_clock::time_point(std::chrono::nanoseconds(deadline));
+}
+
+bool mujinplc::PLCConnectionMonitor::WaitUntilConnected(const std::chrono::milliseconds& timeout) {
+    // a heartbeat that reconnects notifies, one that gets lost does not matter here
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::unique_lock<std::mutex> lock(_mutex);
+    _numWaiters++;
+    bool connected;
+    while (!(connected = IsConnected())) {
+        if (timeout.count() == 0) {
+            _condition.wait(lock);
+        }
+        else if (_condition.wait_until(lock, deadline) == std::cv_status::timeout) {
+            connected = IsConnected();
+            break;
+        }
+    }
+    _numWaiters--;
+    return connected;
+}
+
+void mujinplc::PLCConnectionMonitor::_Beat(const std::map<std::string, mujinplc::PLCValue>& keyvalues) {
+    int64_t now = _Now();
+    bool reconnected = false;
+    for (auto& heartbeat : _heartbeats) {
+        if (heartbeat.signal.empty() || keyvalues.find(heartbeat.signal) != keyvalues.end()) {
+            // the monitor thread may not have stored reported=false yet for a deadline that passed, so look at both
+            int64_t previous = heartbeat.deadline.exchange(now + heartbeat.maxInterval.count());
+            if (previous <= now || !heartbeat.reported.load()) {
+                reconnected = true;
+            }
+        }
+    }
+    // paired with WaitUntilConnected counting itself before reading the deadlines, one of the two sees the other
+    if (reconnected || _numWaiters.load() > 0) {
+        // under the lock, so that neither the monitor thread nor a waiter can be between checking and waiting
+        std::lock_guard<std::mutex> lock(_mutex);
+        _condition.notify_all();
+    }
+}
+
+void mujinplc::PLCConnectionMonitor::_RunThread() {
+    struct Event {
+        const std::string* signal;
+        bool connected;
+    };
+    std::vector<Event> events;
+    std::vector<std::shared_ptr<mujinplc::PLCConnectionObserver>> observers;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_shutdown) {
+        int64_t now = _Now();
+        int64_t wakeup = INT64_MAX;
+        for (auto& heartbeat : _heartbeats) {
+            int64_t deadline = heartbeat.deadline.load();
+            bool connected = now < deadline;
+            if (connected != heartbeat.reported.load()) {
+                heartbeat.reported.store(connected);
+                events.push_back(Event{&heartbeat.signal, connected});
+            }
+            if (connected && deadline < wakeup) {
+                wakeup = deadline;
+            }
+        }
+
+        if (!events.empty()) {
+            for (auto& observer : _observers) {
+                if (auto locked = observer.lock()) {
+                    observers.push_back(locked);
+                }
+            }
+            // reconnections wake up WaitUntilConnected
+            _condition.notify_all();
+            lock.unlock();
+            for (auto& event : events) {
+                for (auto& observer : observers) {
+                    if (event.connected) {
+                        observer->Connected(*event.signal);
+                    }
+                    else {
+                        observer->Disconnected(*event.signal);
+                    }
+                }
+            }
+            events.clear();
+            observers.clear();
+            lock.lock();
+            // heartbeats may have come in meanwhile, look again before sleeping
+            continue;
+        }
+
+        if (wakeup == INT64_MAX) {
+            _condition.wait(lock);
+        }
+        else {
+            _condition.wait_until(lock, std::chrono::steady_clock::time_point(std::chrono::nanoseconds(wakeup)));
+        }
+    }
+}
@@ -1,95 +1,328 @@
 #include "mujinplc/plccontroller.h"
+#include "mujinplc/plcmetrics.h"
+
+#include <cstring>
+#include <stdexcept>
 
 namespace mujinplc {
 
 class PLCControllerObserver : public PLCMemoryObserver {
 public:
-    PLCControllerObserver(PLCController *controller) : _controller(controller) {
+    PLCControllerObserver(PLCController *controller) : _controller(controller), _numCalls(0) {
     }
     virtual ~PLCControllerObserver() {
     }
 
     virtual void MemoryModified(const std::map<std::string, PLCValue>& keyvalues) {
-        _controller->_Enqueue(keyvalues);
+        // the memory calls observers outside of its lock, so a notification can still come in while the controller is destroyed
+        PLCController* controller;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_controller == NULL) {
+                return;
+            }
+            controller = _controller;
+            _numCalls++;
+        }
+        try {
+            controller->_Enqueue(keyvalues);
+        }
+        catch (...) {
+            _Return();
+            throw;
+        }
+        _Return();
     }
 
-    PLCController *_controller;
+    // stop calling into the controller, and wait for the calls in progress, blocked writers included, to return
+    void Detach() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _controller = NULL;
+        _condition.wait(lock, [this] { return _numCalls == 0; });
+    }
+
+private:
+    void _Return() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_numCalls == 0) {
+            _condition.notify_all();
+        }
+    }
+
+    PLCController *_controller; ///< protected by _mutex, NULL once detached
+    size_t _numCalls; ///< calls of _Enqueue in progress, protected by _mutex
+    std::condition_variable _condition;
+    std::mutex _mutex;
 };
 
 }
 
-mujinplc::PLCController::PLCController(const std::shared_ptr<mujinplc::PLCMemory>& memory, const std::chrono::milliseconds& maxHeartbeatInterval, const std::string& heartbeatSignal) : _memory(memory), _maxHeartbeatInterval(maxHeartbeatInterval), _heartbeatSignal(heartbeatSignal) {
+mujinplc::PLCController::PLCController(const std::shared_ptr<mujinplc::PLCMemory>& memory, const std::chrono::milliseconds& maxHeartbeatInterval, const std::string& heartbeatSignal) : _memory(memory), _collectMet(false), _numBlockedWriters(0), _closing(false), _interrupted(false) {
+    if (maxHeartbeatInterval.count() != 0) {
+        _monitor.reset(new mujinplc::PLCConnectionMonitor(_memory));
+        _monitor->AddHeartbeat(heartbeatSignal, maxHeartbeatInterval);
+        _monitor->Start();
+    }
+
+    _observer.reset(new PLCControllerObserver(this));
+    _memory->AddObserver(_observer);
+}
 
+mujinplc::PLCController::PLCController(const std::shared_ptr<mujinplc::PLCMemory>& memory, const std::shared_ptr<mujinplc::PLCConnectionMonitor>& monitor) : _memory(memory), _monitor(monitor), _collectMet(false), _numBlockedWriters(0), _closing(false), _interrupted(false) {
     _observer.reset(new PLCControllerObserver(this));
     _memory->AddObserver(_observer);
 }
 
 mujinplc::PLCController::~PLCController() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closing = true;
+    }
+    _spaceCondition.notify_all();
+    // the members must outlive the writers still in _Enqueue
+    _observer->Detach();
 }
 
-void mujinplc::PLCController::_Enqueue(const std::map<std::string, mujinplc::PLCValue>& keyvalues) {
-    if (_heartbeatSignal == "" || keyvalues.find(_heartbeatSignal) != keyvalues.end()) {
-        _lastHeartbeat = std::chrono::steady_clock::now();
+void mujinplc::PLCController::_ToHandles(const std::map<std::string, mujinplc::PLCValue>& keyvalues, std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& handlevalues) {
+    std::vector<std::string> keys;
+    std::vector<mujinplc::PLCKeyHandle> handles;
+    keys.reserve(keyvalues.size());
+    for (auto& keyvalue : keyvalues) {
+        keys.push_back(keyvalue.first);
     }
+    _memory->GetKeyHandles(keys, handles);
+
+    handlevalues.clear();
+    handlevalues.reserve(keyvalues.size());
+    size_t index = 0;
+    for (auto& keyvalue : keyvalues) {
+        handlevalues.emplace_back(handles[index++], keyvalue.second);
+    }
+}
+
+void mujinplc::PLCController::_ToEnqueuedHandles(const std::map<std::string, mujinplc::PLCValue>& keyvalues, std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& handlevalues) {
+    handlevalues.clear();
+    handlevalues.reserve(keyvalues.size());
+    for (auto& keyvalue : keyvalues) {
+        auto it = _enqueuedHandles.find(keyvalue.first);
+        if (it == _enqueuedHandles.end()) {
+            // once per key, the memory notifies only of keys it already interned
+            it = _enqueuedHandles.emplace(keyvalue.first, _memory->GetKeyHandle(keyvalue.first)).first;
+            _newHandles.emplace_back(it->first, it->second);
+        }
+        handlevalues.emplace_back(it->second, keyvalue.second);
+    }
+}
+
+void mujinplc::PLCController::_TakeNewHandles() {
+    for (auto& handle : _newHandles) {
+        _handles.emplace(std::move(handle.first), handle.second);
+    }
+    _newHandles.clear();
+}
+
+mujinplc::PLCKeyHandle mujinplc::PLCController::_FindKeyHandle(const std::string& key) const {
+    auto it = _handles.find(key);
+    if (it != _handles.end()) {
+        return it->second;
+    }
+    return mujinplc::PLCKeyHandle_Invalid;
+}
+
+mujinplc::PLCController::Deadline mujinplc::PLCController::_GetDeadline(const std::chrono::milliseconds& timeout) {
+    if (timeout.count() == 0) {
+        return Deadline::max();
+    }
+    return std::chrono::steady_clock::now() + timeout;
+}
+
+void mujinplc::PLCController::_Enqueue(const std::map<std::string, mujinplc::PLCValue>& keyvalues) {
+    std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>> handlevalues;
     {
         std::unique_lock<std::mutex> lock(_mutex);
-        _queue.push_back(keyvalues);
+
+        // the dequeuing thread writing to the memory itself would wait for itself, its own changes are coalesced instead.
+        // so are the ones delivered by the dispatcher thread of the memory, waiting there would stall every observer.
+        if (_queue.IsFull() && _queue.GetPolicy() == mujinplc::PLCQueueOverflowPolicy_Block && std::this_thread::get_id() != _dequeuingThread && !_memory->IsDispatcherThread()) {
+            auto start = std::chrono::steady_clock::now();
+            _numBlockedWriters++;
+            _spaceCondition.wait(lock, [this] {
+                return !_queue.IsFull() || _queue.GetPolicy() != mujinplc::PLCQueueOverflowPolicy_Block || _closing;
+            });
+            _numBlockedWriters--;
+            _metrics.blockedTime.RecordSince(start);
+        }
+        if (_closing) {
+            // nobody dequeues anymore
+            return;
+        }
+
+        _ToEnqueuedHandles(keyvalues, handlevalues);
+        size_t numEntries = _queue.GetStats().numEntries;
+        uint64_t numDroppedEdges = _queue.GetStats().numDroppedEdges;
+        if (_queue.Push(handlevalues)) {
+            _metrics.queueDepth.Add(1);
+        }
+        else {
+            _metrics.coalesced.Add();
+        }
+        _metrics.enqueued.Add();
+        _metrics.queueEntries.Add((int64_t)(_queue.GetStats().numEntries - numEntries));
+        _metrics.droppedEdges.Add(_queue.GetStats().numDroppedEdges - numDroppedEdges);
+        _metrics.queueDepthAtEnqueue.Record(_queue.GetSize());
     }
     _condition.notify_all();
 }
 
-bool mujinplc::PLCController::_Dequeue(std::map<std::string, mujinplc::PLCValue>& keyvalues, const std::chrono::milliseconds& timeout, bool timeoutOnDisconnect) {
-    auto start = std::chrono::steady_clock::now();
+void mujinplc::PLCController::SetQueueLimit(size_t maxBatches, mujinplc::PLCQueueOverflowPolicy policy) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.SetLimit(maxBatches, policy);
+    }
+    // a larger limit or another policy can release blocked writers
+    _spaceCondition.notify_all();
+}
+
+void mujinplc::PLCController::SetEdgeSensitive(const std::string& key, size_t maxEdges) {
+    SetEdgeSensitive(_memory->GetKeyHandle(key), maxEdges);
+}
 
+void mujinplc::PLCController::SetEdgeSensitive(mujinplc::PLCKeyHandle key, size_t maxEdges) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _queue.SetEdgeSensitive(key, maxEdges);
+}
+
+mujinplc::PLCChangeQueue::Stats mujinplc::PLCController::GetQueueStats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _queue.GetStats();
+}
+
+void mujinplc::PLCController::ResetQueueHighWaterMarks() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _queue.ResetHighWaterMarks();
+}
+
+mujinplc::PLCControllerMetrics& mujinplc::PLCController::GetMetrics() {
+    return _metrics;
+}
+
+bool mujinplc::PLCController::_Dequeue(std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& keyvalues, const Deadline& deadline, bool timeoutOnDisconnect) {
     keyvalues.clear();
-    while (true) {
-        if (timeout.count() != 0 && timeout.count() < 0) {
-            // timed out
-            return false;
-        }
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _dequeuingThread = std::this_thread::get_id();
+        while (_queue.IsEmpty()) {
+            if (_interrupted) {
+                _interrupted = false;
+                return false;
+            }
 
-        {
-            std::unique_lock<std::mutex> lock(_mutex);
-            if (_condition.wait_for(lock, std::chrono::milliseconds(50)) == std::cv_status::no_timeout) {
-                keyvalues = _queue.front();
-                _queue.pop_front();
-                // successfully took
-                return true;
+            auto now = std::chrono::steady_clock::now();
+            if (now >= deadline) {
+                // timed out
+                return false;
             }
-        }
 
-        if (timeout.count() != 0 && std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start) > timeout) {
-            // timed out
-            return false;
+            // wake up exactly when the heartbeat would be lost, no need to poll
+            Deadline wakeup = deadline;
+            if (timeoutOnDisconnect && !!_monitor) {
+                Deadline heartbeatDeadline = _monitor->GetDisconnectDeadline();
+                if (now >= heartbeatDeadline) {
+                    // if disconnection is detected, immediately timeout
+                    return false;
+                }
+                if (heartbeatDeadline < wakeup) {
+                    wakeup = heartbeatDeadline;
+                }
+            }
+
+            if (wakeup == Deadline::max()) {
+                _condition.wait(lock);
+            }
+            else {
+                _condition.wait_until(lock, wakeup);
+            }
         }
 
-        if (timeoutOnDisconnect && !IsConnected()) {
-            // if disconnection is detected, immediately timeout
-            return false;
+        _queue.Pop(keyvalues);
+        _TakeNewHandles();
+
+        _metrics.dequeued.Add();
+        _metrics.queueDepth.Add(-1);
+        _metrics.queueEntries.Add(-(int64_t)keyvalues.size());
+        if (_numBlockedWriters > 0) {
+            _spaceCondition.notify_all();
         }
     }
 
-    for (auto& keyvalue : keyvalues) {
-        _state[keyvalue.first] = keyvalue.second;
-    }
+    _Apply(keyvalues);
     return true;
 }
 
 void mujinplc::PLCController::_DequeueAll() {
-    std::map<std::string, mujinplc::PLCValue> keyvalues;
+    std::deque<mujinplc::PLCChangeQueue::Batch> queue;
     {
         std::unique_lock<std::mutex> lock(_mutex);
-        while (!_queue.empty()) {
-            for (auto& keyvalue : _queue.front()) {
-                 keyvalues[keyvalue.first] = keyvalue.second;
-            }
-            _queue.pop_front();
+        _dequeuingThread = std::this_thread::get_id();
+        size_t numEntries = _queue.GetStats().numEntries;
+        _queue.PopAll(queue);
+        _TakeNewHandles();
+
+        _metrics.dequeued.Add(queue.size());
+        _metrics.queueDepth.Add(-(int64_t)queue.size());
+        _metrics.queueEntries.Add(-(int64_t)numEntries);
+        if (_numBlockedWriters > 0) {
+            _spaceCondition.notify_all();
         }
     }
 
+    for (auto& keyvalues : queue) {
+        _Apply(keyvalues);
+    }
+}
+
+void mujinplc::PLCController::_Interrupt() {
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _interrupted = true;
+    }
+    _condition.notify_all();
+}
+
+void mujinplc::PLCController::_Apply(const std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& keyvalues) {
+    bool updateConditions = !_conditions.IsEmpty();
     for (auto& keyvalue : keyvalues) {
-        _state[keyvalue.first] = keyvalue.second;
+        if (keyvalue.first >= _state.size()) {
+            _state.resize(keyvalue.first + 1);
+        }
+        _state[keyvalue.first].value = keyvalue.second;
+        _state[keyvalue.first].valid = true;
+        if (updateConditions) {
+            if (_collectMet) {
+                _conditions.Update(keyvalue.first, keyvalue.second, _met);
+            }
+            else {
+                _conditions.Update(keyvalue.first, keyvalue.second);
+            }
+        }
     }
+
+    // expectations are judged on the state after the whole batch, as it was written
+    if (updateConditions) {
+        if (_collectMet) {
+            _conditions.Commit(_met);
+        }
+        else {
+            _conditions.Commit();
+        }
+    }
+}
+
+const mujinplc::PLCController::Entry* mujinplc::PLCController::_Find(mujinplc::PLCKeyHandle key) const {
+    if (key < _state.size() && _state[key].valid) {
+        return &_state[key];
+    }
+    return NULL;
 }
 
 void mujinplc::PLCController::Sync() {
@@ -97,108 +330,95 @@ void mujinplc::PLCController::Sync() {
 }
 
 bool mujinplc::PLCController::IsConnected() const {
-    if (_maxHeartbeatInterval.count() != 0) {
-        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - _lastHeartbeat) < _maxHeartbeatInterval;
-    }
-    return true;
+    return !_monitor || _monitor->IsConnected();
 }
 
-bool mujinplc::PLCController::WaitUntilConnected(const std::chrono::milliseconds& timeout) {
-    std::map<std::string, mujinplc::PLCValue> modifications;
-    std::chrono::milliseconds timeleft = timeout;
-    while (!IsConnected()) {
-        auto start = std::chrono::steady_clock::now();
-        if (!_Dequeue(modifications, timeout, false)) {
-            return false;
-        }
+const std::shared_ptr<mujinplc::PLCConnectionMonitor>& mujinplc::PLCController::GetConnectionMonitor() const {
+    return _monitor;
+}
 
-        if (timeleft.count() != 0) {
-            timeleft -= std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
-        }
+bool mujinplc::PLCController::WaitUntilConnected(const std::chrono::milliseconds& timeout) {
+    if (IsConnected()) {
+        return true;
     }
+    if (!_monitor->WaitUntilConnected(timeout)) {
+        return false;
+    }
+    // consume the changes that came with the heartbeat, as when waiting on the queue
+    _DequeueAll();
     return true;
 }
 
+mujinplc::PLCKeyHandle mujinplc::PLCController::GetKeyHandle(const std::string& key) {
+    return _memory->GetKeyHandle(key);
+}
+
 bool mujinplc::PLCController::WaitFor(const std::string& key, const mujinplc::PLCValue& value, const std::chrono::milliseconds& timeout) {
-    std::map<std::string, mujinplc::PLCValue> keyvalues;
-    keyvalues.emplace(key, value);
+    return WaitFor(_memory->GetKeyHandle(key), value, timeout);
+}
+
+bool mujinplc::PLCController::WaitFor(mujinplc::PLCKeyHandle key, const mujinplc::PLCValue& value, const std::chrono::milliseconds& timeout) {
+    std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>> keyvalues;
+    keyvalues.emplace_back(key, value);
     return WaitForAny(keyvalues, timeout);
 }
 
 bool mujinplc::PLCController::WaitForAny(const std::map<std::string, mujinplc::PLCValue>& keyvalues, const std::chrono::milliseconds& timeout) {
-    std::map<std::string, mujinplc::PLCValue> modifications;
-    std::chrono::milliseconds timeleft = timeout;
-    while (true) {
-        auto start = std::chrono::steady_clock::now();
+    std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>> handlevalues;
+    _ToHandles(keyvalues, handlevalues);
+    return WaitForAny(handlevalues, timeout);
+}
 
-        if (!_Dequeue(modifications, timeleft)) {
-            return false;
-        }
+bool mujinplc::PLCController::WaitForAny(const std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& keyvalues, const std::chrono::milliseconds& timeout) {
+    return _WaitForAny(keyvalues, _GetDeadline(timeout));
+}
 
-        for (auto& modification : modifications) {
-            auto it = keyvalues.find(modification.first);
-            if (it != keyvalues.end()) {
-                if (it->second.IsNull() || modification.second == it->second) {
-                    return true;
-                }
-            }
-        }
+bool mujinplc::PLCController::_WaitForAny(const std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& keyvalues, const Deadline& deadline) {
+    return _WaitUntilMet(_conditions.AddForAny(keyvalues), deadline);
+}
 
-        if (timeleft.count() != 0) {
-            timeleft -= std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+bool mujinplc::PLCController::_WaitUntilMet(mujinplc::PLCConditionRegistry::ConditionId id, const Deadline& deadline) {
+    // every dequeued change goes through _Apply, which only touches the conditions watching the changed keys
+    std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>> modifications;
+    while (!_conditions.IsMet(id)) {
+        if (!_Dequeue(modifications, deadline)) {
+            _conditions.Remove(id);
+            return false;
         }
     }
+    _conditions.Remove(id);
+    return true;
 }
 
 bool mujinplc::PLCController::WaitUntil(const std::string& key, const mujinplc::PLCValue& value, const std::chrono::milliseconds& timeout) {
-    std::map<std::string, mujinplc::PLCValue> expectations, exceptions;
-    expectations.emplace(key, value);
+    return WaitUntil(_memory->GetKeyHandle(key), value, timeout);
+}
+
+bool mujinplc::PLCController::WaitUntil(mujinplc::PLCKeyHandle key, const mujinplc::PLCValue& value, const std::chrono::milliseconds& timeout) {
+    std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>> expectations, exceptions;
+    expectations.emplace_back(key, value);
     return WaitUntilAll(expectations, exceptions, timeout);
 }
 
 bool mujinplc::PLCController::WaitUntilAll(const std::map<std::string, mujinplc::PLCValue>& expectations, const std::map<std::string, mujinplc::PLCValue>& exceptions, const std::chrono::milliseconds& timeout) {
-    std::map<std::string, mujinplc::PLCValue> keyvalues;
-    std::chrono::milliseconds timeleft = timeout;
+    std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>> expectationHandles, exceptionHandles;
+    _ToHandles(expectations, expectationHandles);
+    _ToHandles(exceptions, exceptionHandles);
+    return WaitUntilAll(expectationHandles, exceptionHandles, timeout);
+}
 
-    // combine dictionaries
-    keyvalues.insert(expectations.begin(), expectations.end());
-    keyvalues.insert(exceptions.begin(), exceptions.end());
+bool mujinplc::PLCController::WaitUntilAll(const std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& expectations, const std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& exceptions, const std::chrono::milliseconds& timeout) {
+    Deadline deadline = _GetDeadline(timeout);
 
     // always clear the queue first
     _DequeueAll();
 
-    while (true) {
-        // check if any exceptions is already met
-        for (auto& keyvalue : exceptions) {
-            auto it = _state.find(keyvalue.first);
-            if (it != _state.end() && it->second == keyvalue.second) {
-                return true;
-            }
-        }
-
-        // check if all expectations are already met
-        bool met = true;
-        for (auto& keyvalue : expectations) {
-            auto it = _state.find(keyvalue.first);
-            if (it == _state.end() || it->second != keyvalue.second) {
-                met = false;
-                break;
-            }
-        }
-        if (met) {
-            return true;
-        }
-
-        // wait for it to change
-        auto start = std::chrono::steady_clock::now();
-        if (!WaitForAny(keyvalues, timeleft)) {
-            return false;
-        }
-
-        if (timeleft.count() != 0) {
-            timeleft -= std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
-        }
-    }
+    // if all expectations or any exception are already met, it returns immediately
+    PLCConditionRegistry::ConditionId id = _conditions.AddUntilAll(expectations, exceptions, [this](mujinplc::PLCKeyHandle key) -> const mujinplc::PLCValue* {
+        const Entry* entry = _Find(key);
+        return entry != NULL ? &entry->value : NULL;
+    });
+    return _WaitUntilMet(id, deadline);
 }
 
 void mujinplc::PLCController::Set(const std::string& key, const PLCValue& value) {
@@ -207,16 +427,22 @@ void mujinplc::PLCController::Set(const std::string& key, const PLCValue& value)
     _memory->Write(keyvalues);
 }
 
+void mujinplc::PLCController::Set(mujinplc::PLCKeyHandle key, const PLCValue& value) {
+    _memory->Write(key, value);
+}
 
 void mujinplc::PLCController::Set(const std::map<std::string, PLCValue>& keyvalues) {
     _memory->Write(keyvalues);
 }
 
-
 const mujinplc::PLCValue& mujinplc::PLCController::Get(const std::string& key, const mujinplc::PLCValue& defaultValue) const {
-    auto it = _state.find(key);
-    if (it != _state.end()) {
-        return it->second;
+    return Get(_FindKeyHandle(key), defaultValue);
+}
+
+const mujinplc::PLCValue& mujinplc::PLCController::Get(mujinplc::PLCKeyHandle key, const mujinplc::PLCValue& defaultValue) const {
+    const Entry* entry = _Find(key);
+    if (entry != NULL) {
+        return entry->value;
     }
     return defaultValue;
 }
@@ -227,10 +453,14 @@ const mujinplc::PLCValue& mujinplc::PLCController::SyncAndGet(const std::string&
 }
 
 const std::string& mujinplc::PLCController::GetString(const std::string& key, const std::string& defaultValue) const {
-    auto it = _state.find(key);
-    if (it != _state.end()) {
-        if (it->second.IsString()) {
-            return it->second.GetString();
+    return GetString(_FindKeyHandle(key), defaultValue);
+}
+
+const std::string& mujinplc::PLCController::GetString(mujinplc::PLCKeyHandle key, const std::string& defaultValue) const {
+    const Entry* entry = _Find(key);
+    if (entry != NULL) {
+        if (entry->value.IsString()) {
+            return entry->value.GetString();
         }
     }
     return defaultValue;
@@ -242,10 +472,14 @@ const std::string& mujinplc::PLCController::SyncAndGetString(const std::string&
 }
 
 int mujinplc::PLCController::GetInteger(const std::string& key, int defaultValue) const {
-    auto it = _state.find(key);
-    if (it != _state.end()) {
-        if (it->second.IsInteger()) {
-            return it->second.GetInteger();
+    return GetInteger(_FindKeyHandle(key), defaultValue);
+}
+
+int mujinplc::PLCController::GetInteger(mujinplc::PLCKeyHandle key, int defaultValue) const {
+    const Entry* entry = _Find(key);
+    if (entry != NULL) {
+        if (entry->value.IsInteger()) {
+            return entry->value.GetInteger();
         }
     }
     return defaultValue;
@@ -257,10 +491,14 @@ int mujinplc::PLCController::SyncAndGetInteger(const std::string& key, int defau
 }
 
 bool mujinplc::PLCController::GetBoolean(const std::string& key, bool defaultValue) const {
-    auto it = _state.find(key);
-    if (it != _state.end()) {
-        if (it->second.IsBoolean()) {
-            return it->second.GetBoolean();
+    return GetBoolean(_FindKeyHandle(key), defaultValue);
+}
+
+bool mujinplc::PLCController::GetBoolean(mujinplc::PLCKeyHandle key, bool defaultValue) const {
+    const Entry* entry = _Find(key);
+    if (entry != NULL) {
+        if (entry->value.IsBoolean()) {
+            return entry->value.GetBoolean();
         }
     }
     return defaultValue;
@@ -270,3 +508,36 @@ bool mujinplc::PLCController::SyncAndGetBoolean(const std::string& key, bool def
     Sync();
     return GetBoolean(key, defaultValue);
 }
+
+void mujinplc::PLCController::SetSchema(const std::shared_ptr<mujinplc::PLCSchema>& schema) {
+    _signalHandles.clear();
+    _checkedSignals.clear();
+    if (!!schema) {
+        std::vector<std::string> names;
+        for (uint32_t slot = 0; slot < schema->GetNumSignals(); ++slot) {
+            names.push_back(schema->GetName(slot));
+        }
+        _memory->GetKeyHandles(names, _signalHandles);
+        _checkedSignals.resize(_signalHandles.size());
+    }
+    _schema = schema;
+}
+
+void mujinplc::PLCController::_CheckSignal(uint32_t slot, const char* name, mujinplc::PLCValueType type, mujinplc::PLCSignalDirection direction) const {
+    const mujinplc::PLCSignalInfo& signal = _schema->GetSignal(slot);
+    if (std::strcmp(signal.name, name) != 0 || signal.type != type || signal.direction != direction) {
+        throw std::runtime_error(std::string("signal ") + name + " does not match the name, type or direction of signal " + signal.name + " in slot " + std::to_string(slot) + " of the schema of the controller");
+    }
+    CheckedSignal& checked = _checkedSignals[slot];
+    checked.name = name;
+    checked.type = type;
+    checked.direction = direction;
+}
+
+void mujinplc::PLCController::_ThrowNotInSchema(uint32_t slot) const {
+    throw std::runtime_error("no signal in slot " + std::to_string(slot) + " of the schema of the controller");
+}
+
+void mujinplc::PLCController::_ThrowTypeMismatch(uint32_t slot) const {
+    throw std::runtime_error("signal " + _schema->GetName(slot) + " does not hold a value of its type");
+}
@@ -1,11 +1,309 @@
 #include "mujinplc/plclogic.h"
 
-mujinplc::PLCLogic::PLCLogic(const std::shared_ptr<mujinplc::PLCController>& controller) : _controller(controller) {
+const size_t mujinplc::PLCLogic::NumTimerSlots;
+
+mujinplc::PLCLogic::PLCLogic(const std::shared_ptr<mujinplc::PLCController>& controller) : _controller(controller), _numWaiting(0), _numConditionWaits(0), _start(std::chrono::steady_clock::now()), _timerSlots(NumTimerSlots), _currentTick(0), _numTimers(0), _stopping(false) {
 }
 
 mujinplc::PLCLogic::~PLCLogic() {
+    // flows cancelled here may not wait again, so one pass over everything pending is enough
+    std::vector<Callback> cancelled;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        cancelled.swap(_posted);
+    }
+    for (auto& ready : _ready) {
+        cancelled.push_back(std::move(ready.first));
+    }
+    _ready.clear();
+    for (WaitId id = 0; id < _waits.size(); ++id) {
+        if (_waits[id].used) {
+            if (_waits[id].hasCondition) {
+                _controller->_conditions.Remove(_waits[id].condition);
+            }
+            cancelled.push_back(std::move(_waits[id].callback));
+            _waits[id].used = false;
+        }
+    }
+    for (auto& callback : cancelled) {
+        callback(mujinplc::PLCLogicWaitResult_Cancelled);
+    }
 }
 
 bool mujinplc::PLCLogic::WaitUntilConnected(const std::chrono::milliseconds& timeout) {
-	return _controller->WaitUntilConnected(timeout);
+    return _controller->WaitUntilConnected(timeout);
+}
+
+void mujinplc::PLCLogic::Run(bool untilDone) {
+    // the controller only collects the met conditions while Run takes them, conditions met before are found by scanning
+    _controller->_collectMet = true;
+    try {
+        _TakeAllMet();
+        _Run(untilDone);
+    }
+    catch (...) {
+        _controller->_collectMet = false;
+        _controller->_met.clear();
+        throw;
+    }
+    _controller->_collectMet = false;
+    _controller->_met.clear();
+}
+
+void mujinplc::PLCLogic::_Run(bool untilDone) {
+    std::vector<Callback> posted;
+    std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>> modifications;
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_stopping) {
+                _stopping = false;
+                return;
+            }
+            posted.swap(_posted);
+        }
+        for (auto& callback : posted) {
+            _ready.emplace_back(std::move(callback), mujinplc::PLCLogicWaitResult_Met);
+        }
+        posted.clear();
+
+        // a callback can meet other conditions or post more, so take those again after every callback
+        auto now = std::chrono::steady_clock::now();
+        _TakeMet();
+        _Expire(now);
+        _Disconnect(now);
+        while (!_ready.empty()) {
+            std::pair<Callback, mujinplc::PLCLogicWaitResult> ready = std::move(_ready.front());
+            _ready.pop_front();
+            ready.first(ready.second);
+            _TakeMet();
+        }
+
+        if (untilDone && _numWaiting == 0) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_posted.empty()) {
+                return;
+            }
+            continue;
+        }
+
+        // changes go through _Apply, which collects the conditions met for _TakeMet. Post and Stop interrupt it.
+        // waits for conditions also need to wake up when the heartbeat would be lost, right away if it is already.
+        std::chrono::steady_clock::time_point wakeup = _GetNextExpiry();
+        if (_numConditionWaits > 0 && !!_controller->_monitor) {
+            std::chrono::steady_clock::time_point heartbeatDeadline = _controller->_monitor->GetDisconnectDeadline();
+            if (heartbeatDeadline < wakeup) {
+                wakeup = heartbeatDeadline;
+            }
+        }
+        _controller->_Dequeue(modifications, wakeup, false);
+    }
+}
+
+void mujinplc::PLCLogic::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _controller->_Interrupt();
+}
+
+void mujinplc::PLCLogic::Post(const Callback& callback) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _posted.push_back(callback);
+    }
+    _controller->_Interrupt();
+}
+
+bool mujinplc::PLCLogic::AsyncWaitUntilAll(const KeyValues& expectations, const KeyValues& exceptions, const std::chrono::milliseconds& timeout, const Callback& callback) {
+    // same as PLCController::WaitUntilAll, start from the latest state
+    _controller->_DequeueAll();
+    _TakeMet();
+
+    mujinplc::PLCConditionRegistry::ConditionId condition = _controller->_conditions.AddUntilAll(expectations, exceptions, [this](mujinplc::PLCKeyHandle key) -> const mujinplc::PLCValue* {
+        const mujinplc::PLCController::Entry* entry = _controller->_Find(key);
+        return entry != NULL ? &entry->value : NULL;
+    });
+    if (_controller->_conditions.IsMet(condition)) {
+        _controller->_conditions.Remove(condition);
+        return true;
+    }
+
+    WaitId id = _AddWait(callback, timeout);
+    _waits[id].hasCondition = true;
+    _waits[id].condition = condition;
+    _numConditionWaits++;
+    if (condition >= _conditionWaits.size()) {
+        _conditionWaits.resize(condition + 1, (WaitId)-1);
+    }
+    _conditionWaits[condition] = id;
+    return false;
+}
+
+bool mujinplc::PLCLogic::AsyncWaitForAny(const KeyValues& keyvalues, const std::chrono::milliseconds& timeout, const Callback& callback) {
+    mujinplc::PLCConditionRegistry::ConditionId condition = _controller->_conditions.AddForAny(keyvalues);
+    WaitId id = _AddWait(callback, timeout);
+    _waits[id].hasCondition = true;
+    _waits[id].condition = condition;
+    _numConditionWaits++;
+    if (condition >= _conditionWaits.size()) {
+        _conditionWaits.resize(condition + 1, (WaitId)-1);
+    }
+    _conditionWaits[condition] = id;
+    return false;
+}
+
+void mujinplc::PLCLogic::AsyncSleep(const std::chrono::milliseconds& duration, const Callback& callback) {
+    // a timer without condition, expiring is what it waits for
+    _AddWait(callback, duration > std::chrono::milliseconds::zero() ? duration : std::chrono::milliseconds(1));
+}
+
+const mujinplc::PLCValue& mujinplc::PLCLogic::Get(mujinplc::PLCKeyHandle key, const mujinplc::PLCValue& defaultValue) const {
+    return _controller->Get(key, defaultValue);
+}
+
+void mujinplc::PLCLogic::Set(mujinplc::PLCKeyHandle key, const mujinplc::PLCValue& value) {
+    _controller->Set(key, value);
+}
+
+mujinplc::PLCKeyHandle mujinplc::PLCLogic::GetKeyHandle(const std::string& key) {
+    return _controller->GetKeyHandle(key);
+}
+
+size_t mujinplc::PLCLogic::GetNumWaiting() const {
+    return _numWaiting;
+}
+
+mujinplc::PLCLogic::WaitId mujinplc::PLCLogic::_AddWait(const Callback& callback, const std::chrono::milliseconds& timeout) {
+    WaitId id;
+    if (!_freeWaits.empty()) {
+        id = _freeWaits.back();
+        _freeWaits.pop_back();
+    }
+    else {
+        id = (WaitId)_waits.size();
+        _waits.emplace_back();
+    }
+
+    Wait& wait = _waits[id];
+    wait.callback = callback;
+    wait.used = true;
+    wait.hasCondition = false;
+    wait.hasTimer = timeout.count() != 0;
+    _numWaiting++;
+
+    if (wait.hasTimer) {
+        // round up, a timeout never ends early
+        auto now = std::chrono::steady_clock::now();
+        uint64_t expiry = _GetTick(now + timeout + Tick(1) - std::chrono::nanoseconds(1));
+        if (expiry <= _currentTick) {
+            expiry = _currentTick + 1;
+        }
+        _timerSlots[expiry & (NumTimerSlots - 1)].push_back(Timer{id, wait.generation, expiry});
+        _numTimers++;
+    }
+    return id;
+}
+
+void mujinplc::PLCLogic::_ReleaseWait(WaitId id, mujinplc::PLCLogicWaitResult result) {
+    Wait& wait = _waits[id];
+    if (wait.hasCondition) {
+        _controller->_conditions.Remove(wait.condition);
+        _conditionWaits[wait.condition] = (WaitId)-1;
+        _numConditionWaits--;
+    }
+    if (wait.hasTimer) {
+        // its entry stays in the slot until the wheel gets there, the generation tells it apart
+        _numTimers--;
+    }
+    _ready.emplace_back(std::move(wait.callback), result);
+    wait.callback = Callback();
+    wait.used = false;
+    wait.generation++;
+    _numWaiting--;
+    _freeWaits.push_back(id);
+}
+
+void mujinplc::PLCLogic::_TakeMet() {
+    std::vector<mujinplc::PLCConditionRegistry::ConditionId>& met = _controller->_met;
+    for (auto condition : met) {
+        // the condition can have been released by a timeout already, and even reused since
+        if (condition < _conditionWaits.size() && _conditionWaits[condition] != (WaitId)-1 && _controller->_conditions.IsMet(condition)) {
+            _ReleaseWait(_conditionWaits[condition], mujinplc::PLCLogicWaitResult_Met);
+        }
+    }
+    met.clear();
+}
+
+void mujinplc::PLCLogic::_TakeAllMet() {
+    for (mujinplc::PLCConditionRegistry::ConditionId condition = 0; condition < _conditionWaits.size(); ++condition) {
+        if (_conditionWaits[condition] != (WaitId)-1 && _controller->_conditions.IsMet(condition)) {
+            _ReleaseWait(_conditionWaits[condition], mujinplc::PLCLogicWaitResult_Met);
+        }
+    }
+}
+
+void mujinplc::PLCLogic::_Expire(const std::chrono::steady_clock::time_point& now) {
+    uint64_t tick = _GetTick(now);
+    if (tick <= _currentTick) {
+        return;
+    }
+
+    // one turn visits every slot, no need to go around more than once however long Run slept
+    uint64_t numTicks = tick - _currentTick < NumTimerSlots ? tick - _currentTick : NumTimerSlots;
+    for (uint64_t index = 1; index <= numTicks && _numTimers > 0; ++index) {
+        std::vector<Timer>& slot = _timerSlots[(_currentTick + index) & (NumTimerSlots - 1)];
+        size_t kept = 0;
+        for (size_t position = 0; position < slot.size(); ++position) {
+            const Timer& timer = slot[position];
+            if (timer.expiry > tick) {
+                // a later turn of the wheel
+                slot[kept++] = timer;
+                continue;
+            }
+            Wait& wait = _waits[timer.wait];
+            if (wait.used && wait.generation == timer.generation) {
+                _ReleaseWait(timer.wait, wait.hasCondition ? mujinplc::PLCLogicWaitResult_Timeout : mujinplc::PLCLogicWaitResult_Met);
+            }
+        }
+        slot.resize(kept);
+    }
+    _currentTick = tick;
+}
+
+void mujinplc::PLCLogic::_Disconnect(const std::chrono::steady_clock::time_point& now) {
+    // same as the waits of PLCController, which give up as soon as the heartbeat is lost
+    if (_numConditionWaits == 0 || !_controller->_monitor || now < _controller->_monitor->GetDisconnectDeadline()) {
+        return;
+    }
+    for (mujinplc::PLCConditionRegistry::ConditionId condition = 0; condition < _conditionWaits.size(); ++condition) {
+        if (_conditionWaits[condition] != (WaitId)-1) {
+            _ReleaseWait(_conditionWaits[condition], mujinplc::PLCLogicWaitResult_Disconnected);
+        }
+    }
+}
+
+std::chrono::steady_clock::time_point mujinplc::PLCLogic::_GetNextExpiry() const {
+    if (!_ready.empty()) {
+        return std::chrono::steady_clock::time_point::min();
+    }
+    if (_numTimers == 0) {
+        return std::chrono::steady_clock::time_point::max();
+    }
+
+    // the first slot ahead with a live timer due in this turn, otherwise wake up after a turn to look again
+    for (uint64_t tick = _currentTick + 1; tick <= _currentTick + NumTimerSlots; ++tick) {
+        for (const Timer& timer : _timerSlots[tick & (NumTimerSlots - 1)]) {
+            const Wait& wait = _waits[timer.wait];
+            if (timer.expiry == tick && wait.used && wait.generation == timer.generation) {
+                return _start + Tick(tick);
+            }
+        }
+    }
+    return _start + Tick(_currentTick + NumTimerSlots);
+}
+
+uint64_t mujinplc::PLCLogic::_GetTick(const std::chrono::steady_clock::time_point& time) const {
+    return std::chrono::duration_cast<Tick>(time - _start).count();
 }
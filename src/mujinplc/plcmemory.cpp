@@ -1,21 +1,249 @@
 #include "mujinplc/plcmemory.h"
+#include "mujinplc/plcmetrics.h"
 
-mujinplc::PLCValue::PLCValue() : _type(mujinplc::PLCValueType_Null) {
+#include <algorithm>
+#include <stdexcept>
+
+namespace mujinplc {
+
+static const std::string s_emptyString;
+static const std::vector<int> s_emptyIntegerArray;
+static const std::vector<double> s_emptyDoubleArray;
+
+/// set the key value at index of a vector being read into, reusing the strings and values already there
+static void AssignKeyValue(std::vector<std::pair<std::string, PLCValue>>& keyvalues, size_t index, std::string_view key, const PLCValue& value) {
+    if (index < keyvalues.size()) {
+        keyvalues[index].first.assign(key.data(), key.size());
+        keyvalues[index].second = value;
+    }
+    else {
+        keyvalues.emplace_back(std::string(key), value);
+    }
 }
 
-mujinplc::PLCValue::PLCValue(std::string value) : _type(mujinplc::PLCValueType_String), _stringValue(value) {
+/// counts the writes of this thread, to time only one in PLCMemoryMetrics::LockHoldSampling of them
+static thread_local uint32_t s_numLockedWrites = 0;
+
+/// lock guard of the writers, records how long they waited for a contended lock, and for a sample of the writes how
+/// long they held it. an uncontended lock that is not sampled does not read the clock at all.
+class TimedLockGuard {
+public:
+    TimedLockGuard(std::mutex& mutex, PLCMemoryMetrics& metrics) : _mutex(mutex), _metrics(metrics), _sampled(++s_numLockedWrites % PLCMemoryMetrics::LockHoldSampling == 0) {
+        if (_mutex.try_lock()) {
+            if (_sampled) {
+                _locked = std::chrono::steady_clock::now();
+            }
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        _mutex.lock();
+        _locked = std::chrono::steady_clock::now();
+        _metrics.lockWaitTime.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(_locked - start).count());
+    }
+
+    ~TimedLockGuard() {
+        if (!_sampled) {
+            _mutex.unlock();
+            return;
+        }
+        auto unlocked = std::chrono::steady_clock::now();
+        _mutex.unlock();
+        _metrics.lockHoldTime.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(unlocked - _locked).count());
+    }
+
+private:
+    std::mutex& _mutex;
+    PLCMemoryMetrics& _metrics;
+    bool _sampled;
+    std::chrono::steady_clock::time_point _locked;
+};
+
+}
+
+mujinplc::PLCValue::PLCValue() noexcept : _type(mujinplc::PLCValueType_Null), _integerValue(0) {
+}
+
+mujinplc::PLCValue::PLCValue(std::string value) : _type(mujinplc::PLCValueType_String) {
+    new (&_stringValue) std::string(std::move(value));
 }
 
-mujinplc::PLCValue::PLCValue(int value) : _type(mujinplc::PLCValueType_Integer), _integerValue(value) {
+mujinplc::PLCValue::PLCValue(int value) noexcept : _type(mujinplc::PLCValueType_Integer), _integerValue(value) {
 }
 
-mujinplc::PLCValue::PLCValue(bool value) : _type(mujinplc::PLCValueType_Boolean), _booleanValue(value) {
+mujinplc::PLCValue::PLCValue(bool value) noexcept : _type(mujinplc::PLCValueType_Boolean), _booleanValue(value) {
 }
 
-mujinplc::PLCValue::PLCValue(const mujinplc::PLCValue& other) : _type(other._type), _stringValue(other._stringValue), _integerValue(other._integerValue), _booleanValue(other._booleanValue) {
+mujinplc::PLCValue::PLCValue(double value) noexcept : _type(mujinplc::PLCValueType_Double), _doubleValue(value) {
+}
+
+mujinplc::PLCValue::PLCValue(int64_t value) noexcept : _type(mujinplc::PLCValueType_Integer64), _integer64Value(value) {
+}
+
+mujinplc::PLCValue::PLCValue(mujinplc::PLCIntegerArray value) noexcept : _type(mujinplc::PLCValueType_IntegerArray) {
+    new (&_sharedValue) std::shared_ptr<const void>(std::move(value));
+}
+
+mujinplc::PLCValue::PLCValue(mujinplc::PLCDoubleArray value) noexcept : _type(mujinplc::PLCValueType_DoubleArray) {
+    new (&_sharedValue) std::shared_ptr<const void>(std::move(value));
+}
+
+mujinplc::PLCValue::PLCValue(mujinplc::PLCBlob value) noexcept : _type(mujinplc::PLCValueType_Blob) {
+    new (&_sharedValue) std::shared_ptr<const void>(std::move(value));
+}
+
+mujinplc::PLCValue::PLCValue(const mujinplc::PLCValue& other) : _type(other._type) {
+    switch (_type) {
+    case mujinplc::PLCValueType_String:
+        new (&_stringValue) std::string(other._stringValue);
+        break;
+    case mujinplc::PLCValueType_Boolean:
+        _booleanValue = other._booleanValue;
+        break;
+    case mujinplc::PLCValueType_Double:
+        _doubleValue = other._doubleValue;
+        break;
+    case mujinplc::PLCValueType_Integer64:
+        _integer64Value = other._integer64Value;
+        break;
+    case mujinplc::PLCValueType_IntegerArray:
+    case mujinplc::PLCValueType_DoubleArray:
+    case mujinplc::PLCValueType_Blob:
+        new (&_sharedValue) std::shared_ptr<const void>(other._sharedValue);
+        break;
+    default:
+        _integerValue = other._integerValue;
+        break;
+    }
+}
+
+mujinplc::PLCValue::PLCValue(mujinplc::PLCValue&& other) noexcept : _type(other._type) {
+    switch (_type) {
+    case mujinplc::PLCValueType_String:
+        new (&_stringValue) std::string(std::move(other._stringValue));
+        break;
+    case mujinplc::PLCValueType_Boolean:
+        _booleanValue = other._booleanValue;
+        break;
+    case mujinplc::PLCValueType_Double:
+        _doubleValue = other._doubleValue;
+        break;
+    case mujinplc::PLCValueType_Integer64:
+        _integer64Value = other._integer64Value;
+        break;
+    case mujinplc::PLCValueType_IntegerArray:
+    case mujinplc::PLCValueType_DoubleArray:
+    case mujinplc::PLCValueType_Blob:
+        new (&_sharedValue) std::shared_ptr<const void>(std::move(other._sharedValue));
+        break;
+    default:
+        _integerValue = other._integerValue;
+        break;
+    }
 }
 
 mujinplc::PLCValue::~PLCValue() {
+    _Destroy();
+}
+
+void mujinplc::PLCValue::_Destroy() noexcept {
+    if (_type == mujinplc::PLCValueType_String) {
+        _stringValue.~basic_string();
+    }
+    else if (_IsShared()) {
+        _sharedValue.~shared_ptr();
+    }
+    _type = mujinplc::PLCValueType_Null;
+    _integer64Value = 0;
+}
+
+bool mujinplc::PLCValue::_IsShared() const {
+    return _type == mujinplc::PLCValueType_IntegerArray || _type == mujinplc::PLCValueType_DoubleArray || _type == mujinplc::PLCValueType_Blob;
+}
+
+void mujinplc::PLCValue::_SetShared(mujinplc::PLCValueType type, std::shared_ptr<const void> value) {
+    if (_IsShared()) {
+        _sharedValue = std::move(value);
+    }
+    else {
+        _Destroy();
+        new (&_sharedValue) std::shared_ptr<const void>(std::move(value));
+    }
+    _type = type;
+}
+
+mujinplc::PLCValue& mujinplc::PLCValue::operator=(const mujinplc::PLCValue& other) {
+    if (this == &other) {
+        return *this;
+    }
+    switch (other._type) {
+    case mujinplc::PLCValueType_String:
+        SetString(other._stringValue);
+        break;
+    case mujinplc::PLCValueType_Boolean:
+        SetBoolean(other._booleanValue);
+        break;
+    case mujinplc::PLCValueType_Integer:
+        SetInteger(other._integerValue);
+        break;
+    case mujinplc::PLCValueType_Double:
+        SetDouble(other._doubleValue);
+        break;
+    case mujinplc::PLCValueType_Integer64:
+        SetInteger64(other._integer64Value);
+        break;
+    case mujinplc::PLCValueType_IntegerArray:
+    case mujinplc::PLCValueType_DoubleArray:
+    case mujinplc::PLCValueType_Blob:
+        _SetShared(other._type, other._sharedValue);
+        break;
+    default:
+        SetNull();
+        break;
+    }
+    return *this;
+}
+
+mujinplc::PLCValue& mujinplc::PLCValue::operator=(mujinplc::PLCValue&& other) noexcept {
+    if (this == &other) {
+        return *this;
+    }
+    switch (other._type) {
+    case mujinplc::PLCValueType_String:
+        if (_type == mujinplc::PLCValueType_String) {
+            _stringValue = std::move(other._stringValue);
+        }
+        else {
+            _Destroy();
+            new (&_stringValue) std::string(std::move(other._stringValue));
+            _type = mujinplc::PLCValueType_String;
+        }
+        break;
+    case mujinplc::PLCValueType_Boolean:
+        SetBoolean(other._booleanValue);
+        break;
+    case mujinplc::PLCValueType_Integer:
+        SetInteger(other._integerValue);
+        break;
+    case mujinplc::PLCValueType_Double:
+        SetDouble(other._doubleValue);
+        break;
+    case mujinplc::PLCValueType_Integer64:
+        SetInteger64(other._integer64Value);
+        break;
+    case mujinplc::PLCValueType_IntegerArray:
+    case mujinplc::PLCValueType_DoubleArray:
+    case mujinplc::PLCValueType_Blob:
+        _SetShared(other._type, std::move(other._sharedValue));
+        break;
+    default:
+        SetNull();
+        break;
+    }
+    return *this;
+}
+
+mujinplc::PLCValueType mujinplc::PLCValue::GetType() const {
+    return _type;
 }
 
 bool mujinplc::PLCValue::IsString() const {
@@ -23,12 +251,30 @@ bool mujinplc::PLCValue::IsString() const {
 }
 
 const std::string& mujinplc::PLCValue::GetString() const {
-    return _stringValue;
+    if (_type == mujinplc::PLCValueType_String) {
+        return _stringValue;
+    }
+    return mujinplc::s_emptyString;
 }
 
 void mujinplc::PLCValue::SetString(const std::string& value) {
+    if (_type == mujinplc::PLCValueType_String) {
+        _stringValue = value;
+        return;
+    }
+    _Destroy();
+    new (&_stringValue) std::string(value);
+    _type = mujinplc::PLCValueType_String;
+}
+
+void mujinplc::PLCValue::SetString(const char* value, size_t length) {
+    if (_type == mujinplc::PLCValueType_String) {
+        _stringValue.assign(value, length);
+        return;
+    }
+    _Destroy();
+    new (&_stringValue) std::string(value, length);
     _type = mujinplc::PLCValueType_String;
-    _stringValue = value;
 }
 
 bool mujinplc::PLCValue::IsBoolean() const {
@@ -36,10 +282,11 @@ bool mujinplc::PLCValue::IsBoolean() const {
 }
 
 bool mujinplc::PLCValue::GetBoolean() const {
-    return _booleanValue;
+    return _type == mujinplc::PLCValueType_Boolean && _booleanValue;
 }
 
 void mujinplc::PLCValue::SetBoolean(bool value) {
+    _Destroy();
     _type = mujinplc::PLCValueType_Boolean;
     _booleanValue = value;
 }
@@ -49,20 +296,173 @@ bool mujinplc::PLCValue::IsInteger() const {
 }
 
 int mujinplc::PLCValue::GetInteger() const {
-    return _integerValue;
+    if (_type == mujinplc::PLCValueType_Integer) {
+        return _integerValue;
+    }
+    return 0;
 }
 
 void mujinplc::PLCValue::SetInteger(int value) {
+    _Destroy();
     _type = mujinplc::PLCValueType_Integer;
     _integerValue = value;
 }
 
+bool mujinplc::PLCValue::IsDouble() const {
+    return _type == mujinplc::PLCValueType_Double;
+}
+
+double mujinplc::PLCValue::GetDouble() const {
+    if (_type == mujinplc::PLCValueType_Double) {
+        return _doubleValue;
+    }
+    return 0;
+}
+
+void mujinplc::PLCValue::SetDouble(double value) {
+    _Destroy();
+    _type = mujinplc::PLCValueType_Double;
+    _doubleValue = value;
+}
+
+bool mujinplc::PLCValue::IsInteger64() const {
+    return _type == mujinplc::PLCValueType_Integer64;
+}
+
+int64_t mujinplc::PLCValue::GetInteger64() const {
+    if (_type == mujinplc::PLCValueType_Integer64) {
+        return _integer64Value;
+    }
+    return 0;
+}
+
+void mujinplc::PLCValue::SetInteger64(int64_t value) {
+    _Destroy();
+    _type = mujinplc::PLCValueType_Integer64;
+    _integer64Value = value;
+}
+
+void* mujinplc::PLCValue::_GetMutableShared(mujinplc::PLCValueType type, bool keepElements) {
+    if (_type != type) {
+        _SetShared(type, std::shared_ptr<const void>());
+    }
+    // a value owning the storage alone is the only one that can hand out new references to it, so it is safe to modify in place
+    if (!_sharedValue || _sharedValue.use_count() != 1) {
+        switch (type) {
+        case mujinplc::PLCValueType_IntegerArray:
+            _sharedValue = keepElements ? std::make_shared<std::vector<int>>(GetIntegerArray()) : std::make_shared<std::vector<int>>();
+            break;
+        case mujinplc::PLCValueType_DoubleArray:
+            _sharedValue = keepElements ? std::make_shared<std::vector<double>>(GetDoubleArray()) : std::make_shared<std::vector<double>>();
+            break;
+        default:
+            _sharedValue = keepElements ? std::make_shared<std::string>(GetBlob()) : std::make_shared<std::string>();
+            break;
+        }
+    }
+    return const_cast<void*>(_sharedValue.get());
+}
+
+bool mujinplc::PLCValue::IsIntegerArray() const {
+    return _type == mujinplc::PLCValueType_IntegerArray;
+}
+
+const std::vector<int>& mujinplc::PLCValue::GetIntegerArray() const {
+    if (_type == mujinplc::PLCValueType_IntegerArray && !!_sharedValue) {
+        return *static_cast<const std::vector<int>*>(_sharedValue.get());
+    }
+    return mujinplc::s_emptyIntegerArray;
+}
+
+mujinplc::PLCIntegerArray mujinplc::PLCValue::GetSharedIntegerArray() const {
+    if (_type == mujinplc::PLCValueType_IntegerArray) {
+        return std::static_pointer_cast<const std::vector<int>>(_sharedValue);
+    }
+    return mujinplc::PLCIntegerArray();
+}
+
+std::vector<int>& mujinplc::PLCValue::GetMutableIntegerArray(bool keepElements) {
+    return *static_cast<std::vector<int>*>(_GetMutableShared(mujinplc::PLCValueType_IntegerArray, keepElements));
+}
+
+void mujinplc::PLCValue::SetIntegerArray(std::vector<int> value) {
+    _SetShared(mujinplc::PLCValueType_IntegerArray, std::make_shared<std::vector<int>>(std::move(value)));
+}
+
+void mujinplc::PLCValue::SetIntegerArray(mujinplc::PLCIntegerArray value) {
+    _SetShared(mujinplc::PLCValueType_IntegerArray, std::move(value));
+}
+
+bool mujinplc::PLCValue::IsDoubleArray() const {
+    return _type == mujinplc::PLCValueType_DoubleArray;
+}
+
+const std::vector<double>& mujinplc::PLCValue::GetDoubleArray() const {
+    if (_type == mujinplc::PLCValueType_DoubleArray && !!_sharedValue) {
+        return *static_cast<const std::vector<double>*>(_sharedValue.get());
+    }
+    return mujinplc::s_emptyDoubleArray;
+}
+
+mujinplc::PLCDoubleArray mujinplc::PLCValue::GetSharedDoubleArray() const {
+    if (_type == mujinplc::PLCValueType_DoubleArray) {
+        return std::static_pointer_cast<const std::vector<double>>(_sharedValue);
+    }
+    return mujinplc::PLCDoubleArray();
+}
+
+std::vector<double>& mujinplc::PLCValue::GetMutableDoubleArray(bool keepElements) {
+    return *static_cast<std::vector<double>*>(_GetMutableShared(mujinplc::PLCValueType_DoubleArray, keepElements));
+}
+
+void mujinplc::PLCValue::SetDoubleArray(std::vector<double> value) {
+    _SetShared(mujinplc::PLCValueType_DoubleArray, std::make_shared<std::vector<double>>(std::move(value)));
+}
+
+void mujinplc::PLCValue::SetDoubleArray(mujinplc::PLCDoubleArray value) {
+    _SetShared(mujinplc::PLCValueType_DoubleArray, std::move(value));
+}
+
+bool mujinplc::PLCValue::IsBlob() const {
+    return _type == mujinplc::PLCValueType_Blob;
+}
+
+const std::string& mujinplc::PLCValue::GetBlob() const {
+    if (_type == mujinplc::PLCValueType_Blob && !!_sharedValue) {
+        return *static_cast<const std::string*>(_sharedValue.get());
+    }
+    return mujinplc::s_emptyString;
+}
+
+mujinplc::PLCBlob mujinplc::PLCValue::GetSharedBlob() const {
+    if (_type == mujinplc::PLCValueType_Blob) {
+        return std::static_pointer_cast<const std::string>(_sharedValue);
+    }
+    return mujinplc::PLCBlob();
+}
+
+std::string& mujinplc::PLCValue::GetMutableBlob(bool keepElements) {
+    return *static_cast<std::string*>(_GetMutableShared(mujinplc::PLCValueType_Blob, keepElements));
+}
+
+void mujinplc::PLCValue::SetBlob(std::string value) {
+    _SetShared(mujinplc::PLCValueType_Blob, std::make_shared<std::string>(std::move(value)));
+}
+
+void mujinplc::PLCValue::SetBlob(const char* value, size_t length) {
+    _SetShared(mujinplc::PLCValueType_Blob, std::make_shared<std::string>(value, length));
+}
+
+void mujinplc::PLCValue::SetBlob(mujinplc::PLCBlob value) {
+    _SetShared(mujinplc::PLCValueType_Blob, std::move(value));
+}
+
 bool mujinplc::PLCValue::IsNull() const {
     return _type == mujinplc::PLCValueType_Null;
 }
 
 void mujinplc::PLCValue::SetNull() {
-    _type = mujinplc::PLCValueType_Null;
+    _Destroy();
 }
 
 bool mujinplc::operator==(const mujinplc::PLCValue& lhs, const mujinplc::PLCValue& rhs) {
@@ -75,6 +475,22 @@ bool mujinplc::operator==(const mujinplc::PLCValue& lhs, const mujinplc::PLCValu
     if (lhs.IsInteger()) {
         return rhs.IsInteger() && lhs.GetInteger() == rhs.GetInteger();
     }
+    if (lhs.IsDouble()) {
+        return rhs.IsDouble() && lhs.GetDouble() == rhs.GetDouble();
+    }
+    if (lhs.IsInteger64()) {
+        return rhs.IsInteger64() && lhs.GetInteger64() == rhs.GetInteger64();
+    }
+    // shared storage is equal without looking at the elements, which is what a copy made through the memory compares to
+    if (lhs.IsIntegerArray()) {
+        return rhs.IsIntegerArray() && (&lhs.GetIntegerArray() == &rhs.GetIntegerArray() || lhs.GetIntegerArray() == rhs.GetIntegerArray());
+    }
+    if (lhs.IsDoubleArray()) {
+        return rhs.IsDoubleArray() && (&lhs.GetDoubleArray() == &rhs.GetDoubleArray() || lhs.GetDoubleArray() == rhs.GetDoubleArray());
+    }
+    if (lhs.IsBlob()) {
+        return rhs.IsBlob() && (&lhs.GetBlob() == &rhs.GetBlob() || lhs.GetBlob() == rhs.GetBlob());
+    }
     if (lhs.IsNull()) {
         return rhs.IsNull();
     }
@@ -85,10 +501,175 @@ bool mujinplc::operator!=(const mujinplc::PLCValue& lhs, const mujinplc::PLCValu
     return !(lhs == rhs);
 }
 
-mujinplc::PLCMemory::PLCMemory() {
+mujinplc::PLCKeyRegistry::PLCKeyRegistry() {
+}
+
+mujinplc::PLCKeyRegistry::~PLCKeyRegistry() {
+}
+
+mujinplc::PLCKeyHandle mujinplc::PLCKeyRegistry::Intern(const std::string& key) {
+    auto it = _handles.find(key);
+    if (it != _handles.end()) {
+        return it->second;
+    }
+    mujinplc::PLCKeyHandle handle = (mujinplc::PLCKeyHandle)_names.size();
+    _names.push_back(key);
+    _handles.emplace(key, handle);
+    return handle;
+}
+
+mujinplc::PLCKeyHandle mujinplc::PLCKeyRegistry::Find(const std::string& key) const {
+    auto it = _handles.find(key);
+    if (it != _handles.end()) {
+        return it->second;
+    }
+    return mujinplc::PLCKeyHandle_Invalid;
+}
+
+const std::string& mujinplc::PLCKeyRegistry::GetName(mujinplc::PLCKeyHandle handle) const {
+    return _names.at(handle);
+}
+
+size_t mujinplc::PLCKeyRegistry::GetSize() const {
+    return _names.size();
+}
+
+mujinplc::PLCMemory::PLCMemory() : _newest(mujinplc::PLCKeyHandle_Invalid), _sequence(0), _dispatching(false), _maxPendingBatches(0), _dispatcherShutdown(true), _draining(false) {
 }
 
 mujinplc::PLCMemory::~PLCMemory() {
+    StopDispatcher();
+}
+
+mujinplc::PLCKeyHandle mujinplc::PLCMemory::_Intern(const std::string& key) {
+    mujinplc::PLCKeyHandle handle = _registry.Intern(key);
+    if (handle < _entries.size()) {
+        return handle;
+    }
+    _entries.resize(handle + 1);
+    _orderedKeys.emplace(_registry.GetName(handle), handle);
+
+    // newly registered key, index it for the prefix subscriptions once
+    for (uint32_t index = 0; index < _subscriptions.size(); ++index) {
+        for (auto& prefix : _subscriptions[index].prefixes) {
+            if (key.compare(0, prefix.size(), prefix) == 0) {
+                _entries[handle].subscribers.push_back(index);
+                break;
+            }
+        }
+    }
+    return handle;
+}
+
+bool mujinplc::PLCMemory::_Assign(mujinplc::PLCKeyHandle key, const mujinplc::PLCValue& value, uint64_t sequence) {
+    Entry& entry = _entries[key];
+    if (entry.sequence != 0 && entry.value == value) {
+        return false;
+    }
+    entry.value = value;
+
+    if (_newest == key) {
+        entry.sequence = sequence;
+        return true;
+    }
+
+    // unlink from its current position in the list
+    if (entry.newer != mujinplc::PLCKeyHandle_Invalid) {
+        _entries[entry.newer].older = entry.older;
+    }
+    if (entry.older != mujinplc::PLCKeyHandle_Invalid) {
+        _entries[entry.older].newer = entry.newer;
+    }
+
+    // move to the head
+    entry.sequence = sequence;
+    entry.newer = mujinplc::PLCKeyHandle_Invalid;
+    entry.older = _newest;
+    if (_newest != mujinplc::PLCKeyHandle_Invalid) {
+        _entries[_newest].newer = key;
+    }
+    _newest = key;
+    return true;
+}
+
+void mujinplc::PLCMemory::_Commit(const std::vector<mujinplc::PLCKeyHandle>& modifiedKeys, std::map<std::string, mujinplc::PLCValue>& modifications, std::vector<Notification>& notifications) {
+    if (modifiedKeys.empty()) {
+        return;
+    }
+    ++_sequence;
+    _metrics.writes.Add();
+    _metrics.modifiedKeys.Add(modifiedKeys.size());
+
+    // observers that get everything share the full modifications
+    bool hasAll = false;
+    for (uint32_t index = 0; index < _subscriptions.size(); ++index) {
+        if (_subscriptions[index].all) {
+            notifications.emplace_back();
+            notifications.back().subscription = index;
+            notifications.back().observer = _subscriptions[index].observer;
+            notifications.back().all = true;
+            hasAll = true;
+        }
+    }
+
+    // filtered observers only get the slice they subscribed to
+    std::map<uint32_t, size_t> notificationIndices;
+    for (auto& key : modifiedKeys) {
+        const std::string& name = _registry.GetName(key);
+        const Entry& entry = _entries[key];
+        if (hasAll) {
+            modifications[name] = entry.value;
+        }
+        for (auto& subscriber : entry.subscribers) {
+            auto it = notificationIndices.find(subscriber);
+            if (it == notificationIndices.end()) {
+                it = notificationIndices.emplace(subscriber, notifications.size()).first;
+                notifications.emplace_back();
+                notifications.back().subscription = subscriber;
+                notifications.back().observer = _subscriptions[subscriber].observer;
+            }
+            notifications[it->second].keyvalues[name] = entry.value;
+        }
+    }
+}
+
+void mujinplc::PLCMemory::_Notify(uint64_t sequence, const std::map<std::string, mujinplc::PLCValue>& modifications, const std::vector<Notification>& notifications) {
+    if (notifications.empty()) {
+        return;
+    }
+    _WaitUntilDrained();
+    for (auto& notification : notifications) {
+        if (auto observer = notification.observer.lock()) {
+            auto start = std::chrono::steady_clock::now();
+            observer->MemoryModified(sequence, notification.all ? modifications : notification.keyvalues);
+            _metrics.observerCallbackTime.RecordSince(start);
+        }
+    }
+}
+
+mujinplc::PLCKeyHandle mujinplc::PLCMemory::GetKeyHandle(const std::string& key) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _Intern(key);
+}
+
+mujinplc::PLCKeyHandle mujinplc::PLCMemory::FindKeyHandle(const std::string& key) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _registry.Find(key);
+}
+
+void mujinplc::PLCMemory::GetKeyHandles(const std::vector<std::string>& keys, std::vector<mujinplc::PLCKeyHandle>& handles) {
+    handles.clear();
+    handles.reserve(keys.size());
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto& key : keys) {
+        handles.push_back(_Intern(key));
+    }
+}
+
+const std::string& mujinplc::PLCMemory::GetKeyName(mujinplc::PLCKeyHandle handle) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _registry.GetName(handle);
 }
 
 void mujinplc::PLCMemory::Read(const std::vector<std::string> &keys, std::map<std::string, mujinplc::PLCValue> &keyvalues) {
@@ -97,55 +678,489 @@ void mujinplc::PLCMemory::Read(const std::vector<std::string> &keys, std::map<st
     {
         std::lock_guard<std::mutex> lock(_mutex);
         for (auto& key : keys) {
-            auto it = _entries.find(key);
-            if (it != _entries.end()) {
-                keyvalues.emplace(it->first, it->second);
+            mujinplc::PLCKeyHandle handle = _registry.Find(key);
+            if (handle != mujinplc::PLCKeyHandle_Invalid && _entries[handle].sequence != 0) {
+                keyvalues.emplace(key, _entries[handle].value);
             }
         }
     }
 }
 
+void mujinplc::PLCMemory::Read(const std::vector<std::string>& keys, std::vector<std::pair<std::string, mujinplc::PLCValue>>& keyvalues) {
+    size_t numKeyValues = 0;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto& key : keys) {
+            mujinplc::PLCKeyHandle handle = _registry.Find(key);
+            if (handle == mujinplc::PLCKeyHandle_Invalid || _entries[handle].sequence == 0) {
+                continue;
+            }
+            mujinplc::AssignKeyValue(keyvalues, numKeyValues++, key, _entries[handle].value);
+        }
+    }
+    keyvalues.resize(numKeyValues);
+}
+
+uint64_t mujinplc::PLCMemory::ReadPrefixes(const std::vector<std::string>& prefixes, std::vector<std::pair<std::string, mujinplc::PLCValue>>& keyvalues) {
+    // drop the prefixes covered by a shorter one, the rest match disjoint runs of keys that follow each other in order
+    std::vector<std::string_view> runs(prefixes.begin(), prefixes.end());
+    if (runs.empty()) {
+        runs.emplace_back();
+    }
+    std::sort(runs.begin(), runs.end());
+    size_t numRuns = 0;
+    for (auto& prefix : runs) {
+        if (numRuns == 0 || prefix.compare(0, runs[numRuns - 1].size(), runs[numRuns - 1]) != 0) {
+            runs[numRuns++] = prefix;
+        }
+    }
+    runs.resize(numRuns);
+
+    size_t numKeyValues = 0;
+    uint64_t sequence;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        sequence = _sequence;
+        for (auto& prefix : runs) {
+            for (auto it = _orderedKeys.lower_bound(prefix); it != _orderedKeys.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+                const Entry& entry = _entries[it->second];
+                if (entry.sequence != 0) {
+                    mujinplc::AssignKeyValue(keyvalues, numKeyValues++, it->first, entry.value);
+                }
+            }
+        }
+    }
+    keyvalues.resize(numKeyValues);
+    return sequence;
+}
+
+uint64_t mujinplc::PLCMemory::ReadRange(const std::string& begin, const std::string& end, std::vector<std::pair<std::string, mujinplc::PLCValue>>& keyvalues, size_t maxKeys) {
+    size_t numKeyValues = 0;
+    uint64_t sequence;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        sequence = _sequence;
+        if (end.empty() || begin < end) {
+            auto last = end.empty() ? _orderedKeys.end() : _orderedKeys.lower_bound(end);
+            for (auto it = _orderedKeys.lower_bound(begin); it != last && (maxKeys == 0 || numKeyValues < maxKeys); ++it) {
+                const Entry& entry = _entries[it->second];
+                if (entry.sequence != 0) {
+                    mujinplc::AssignKeyValue(keyvalues, numKeyValues++, it->first, entry.value);
+                }
+            }
+        }
+    }
+    keyvalues.resize(numKeyValues);
+    return sequence;
+}
+
+bool mujinplc::PLCMemory::Read(mujinplc::PLCKeyHandle key, mujinplc::PLCValue& value) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (key < _entries.size() && _entries[key].sequence != 0) {
+        value = _entries[key].value;
+        return true;
+    }
+    return false;
+}
+
+void mujinplc::PLCMemory::Read(const std::vector<mujinplc::PLCKeyHandle>& keys, std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& keyvalues) {
+    keyvalues.clear();
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (auto& key : keys) {
+            if (key < _entries.size() && _entries[key].sequence != 0) {
+                keyvalues.emplace_back(key, _entries[key].value);
+            }
+        }
+    }
+}
 
 void mujinplc::PLCMemory::Write(const std::map<std::string, mujinplc::PLCValue> &keyvalues) {
     std::map<std::string, mujinplc::PLCValue> modifications;
-    std::vector<std::weak_ptr<PLCMemoryObserver>> observersCopy;
+    std::vector<Notification> notifications;
+    std::vector<mujinplc::PLCKeyHandle> modifiedKeys;
+    uint64_t sequence;
 
     {
-        std::lock_guard<std::mutex> lock(_mutex);
+        mujinplc::TimedLockGuard lock(_mutex, _metrics);
         for (auto& keyvalue : keyvalues) {
-            auto it = _entries.find(keyvalue.first);
-            if (it != _entries.end()) {
-                if (it->second != keyvalue.second) {
-                    it->second = keyvalue.second;
-                    modifications.emplace(keyvalue.first, keyvalue.second);
-                }
-            } else {
-                _entries.emplace(keyvalue.first, keyvalue.second);
-                modifications.emplace(keyvalue.first, keyvalue.second);
+            mujinplc::PLCKeyHandle key = _Intern(keyvalue.first);
+            if (_Assign(key, keyvalue.second, _sequence + 1)) {
+                modifiedKeys.push_back(key);
             }
         }
 
-        // copy under lock
-        if (modifications.size() > 0) {
-            observersCopy =  _observers;
+        // collect notifications under lock
+        _Commit(modifiedKeys, modifications, notifications);
+        sequence = _sequence;
+        if (_dispatching) {
+            _Post(sequence, modifications, notifications);
+            return;
         }
     }
 
-    for (auto& observerWeak : observersCopy) {
-        if (auto observer = observerWeak.lock()) {
-            observer->MemoryModified(modifications);
+    _Notify(sequence, modifications, notifications);
+}
+
+void mujinplc::PLCMemory::Write(mujinplc::PLCKeyHandle key, const mujinplc::PLCValue& value) {
+    std::map<std::string, mujinplc::PLCValue> modifications;
+    std::vector<Notification> notifications;
+    std::vector<mujinplc::PLCKeyHandle> modifiedKeys;
+    uint64_t sequence;
+
+    {
+        mujinplc::TimedLockGuard lock(_mutex, _metrics);
+        if (key >= _entries.size()) {
+            throw std::invalid_argument("invalid key handle " + std::to_string(key));
+        }
+        if (_Assign(key, value, _sequence + 1)) {
+            modifiedKeys.push_back(key);
+        }
+
+        // collect notifications under lock
+        _Commit(modifiedKeys, modifications, notifications);
+        sequence = _sequence;
+        if (_dispatching) {
+            _Post(sequence, modifications, notifications);
+            return;
         }
     }
+
+    _Notify(sequence, modifications, notifications);
+}
+
+void mujinplc::PLCMemory::Write(const std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& keyvalues) {
+    std::map<std::string, mujinplc::PLCValue> modifications;
+    std::vector<Notification> notifications;
+    std::vector<mujinplc::PLCKeyHandle> modifiedKeys;
+    uint64_t sequence;
+
+    {
+        mujinplc::TimedLockGuard lock(_mutex, _metrics);
+        // all or nothing, check every handle before writing the first
+        for (auto& keyvalue : keyvalues) {
+            if (keyvalue.first >= _entries.size()) {
+                throw std::invalid_argument("invalid key handle " + std::to_string(keyvalue.first));
+            }
+        }
+        for (auto& keyvalue : keyvalues) {
+            if (_Assign(keyvalue.first, keyvalue.second, _sequence + 1)) {
+                modifiedKeys.push_back(keyvalue.first);
+            }
+        }
+
+        // collect notifications under lock
+        _Commit(modifiedKeys, modifications, notifications);
+        sequence = _sequence;
+        if (_dispatching) {
+            _Post(sequence, modifications, notifications);
+            return;
+        }
+    }
+
+    _Notify(sequence, modifications, notifications);
+}
+
+uint64_t mujinplc::PLCMemory::Execute(const std::vector<mujinplc::PLCOperation>& operations, std::vector<mujinplc::PLCOperationResult>& results) {
+    std::map<std::string, mujinplc::PLCValue> modifications;
+    std::vector<Notification> notifications;
+    std::vector<mujinplc::PLCKeyHandle> modifiedKeys;
+    uint64_t sequence;
+
+    results.resize(operations.size());
+
+    {
+        mujinplc::TimedLockGuard lock(_mutex, _metrics);
+        for (size_t index = 0; index < operations.size(); ++index) {
+            const mujinplc::PLCOperation& operation = operations[index];
+            mujinplc::PLCOperationResult& result = results[index];
+
+            // only writes register new keys
+            mujinplc::PLCKeyHandle key = _registry.Find(operation.key);
+            bool hasValue = key != mujinplc::PLCKeyHandle_Invalid && _entries[key].sequence != 0;
+            if (hasValue) {
+                result.value = _entries[key].value;
+            }
+            else {
+                result.value.SetNull();
+            }
+
+            switch (operation.type) {
+            case mujinplc::PLCOperationType_Read:
+                result.success = hasValue;
+                break;
+            case mujinplc::PLCOperationType_Write:
+                result.success = true;
+                break;
+            case mujinplc::PLCOperationType_CompareAndSwap:
+                result.success = hasValue ? result.value == operation.expected : operation.expected.IsNull();
+                break;
+            }
+
+            if (operation.type != mujinplc::PLCOperationType_Read && result.success) {
+                if (key == mujinplc::PLCKeyHandle_Invalid) {
+                    key = _Intern(operation.key);
+                }
+                if (_Assign(key, operation.value, _sequence + 1)) {
+                    modifiedKeys.push_back(key);
+                }
+            }
+        }
+
+        // collect notifications under lock
+        _Commit(modifiedKeys, modifications, notifications);
+        sequence = modifiedKeys.empty() ? 0 : _sequence;
+        if (_dispatching) {
+            _Post(sequence, modifications, notifications);
+            return sequence;
+        }
+    }
+
+    _Notify(sequence, modifications, notifications);
+    return sequence;
+}
+
+uint64_t mujinplc::PLCMemory::GetSequence() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _sequence;
+}
+
+uint64_t mujinplc::PLCMemory::ReadModifiedSince(uint64_t sequence, std::map<std::string, mujinplc::PLCValue>& keyvalues) {
+    keyvalues.clear();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (sequence > _sequence) {
+        sequence = 0;
+    }
+    for (mujinplc::PLCKeyHandle handle = _newest; handle != mujinplc::PLCKeyHandle_Invalid && _entries[handle].sequence > sequence; handle = _entries[handle].older) {
+        keyvalues.emplace(_registry.GetName(handle), _entries[handle].value);
+    }
+    return _sequence;
+}
+
+uint64_t mujinplc::PLCMemory::ReadModifiedSince(uint64_t sequence, std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& keyvalues) {
+    keyvalues.clear();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (sequence > _sequence) {
+        sequence = 0;
+    }
+    for (mujinplc::PLCKeyHandle handle = _newest; handle != mujinplc::PLCKeyHandle_Invalid && _entries[handle].sequence > sequence; handle = _entries[handle].older) {
+        keyvalues.emplace_back(handle, _entries[handle].value);
+    }
+    return _sequence;
 }
 
 void mujinplc::PLCMemory::AddObserver(const std::shared_ptr<PLCMemoryObserver>& observer) {
+    _Subscribe(observer, true, std::vector<std::string>(), std::vector<std::string>());
+}
+
+void mujinplc::PLCMemory::AddObserver(const std::shared_ptr<PLCMemoryObserver>& observer, const std::vector<std::string>& keys, const std::vector<std::string>& prefixes) {
+    _Subscribe(observer, false, keys, prefixes);
+}
+
+void mujinplc::PLCMemory::_Subscribe(const std::shared_ptr<PLCMemoryObserver>& observer, bool all, const std::vector<std::string>& keys, const std::vector<std::string>& prefixes) {
     std::map<std::string, mujinplc::PLCValue> entriesCopy;
+    uint64_t sequence;
     {
         std::lock_guard<std::mutex> lock(_mutex);
-        _observers.push_back(observer);
-        entriesCopy = _entries;
+        sequence = _sequence;
+        uint32_t index = (uint32_t)_subscriptions.size();
+        _subscriptions.emplace_back();
+        _subscriptions.back().observer = observer;
+        _subscriptions.back().all = all;
+
+        if (all) {
+            for (mujinplc::PLCKeyHandle handle = 0; handle < _entries.size(); ++handle) {
+                if (_entries[handle].sequence != 0) {
+                    entriesCopy.emplace(_registry.GetName(handle), _entries[handle].value);
+                }
+            }
+        }
+        else {
+            // index the keys that already exist, keys registered later are matched in _Intern
+            for (auto& prefix : prefixes) {
+                for (auto it = _orderedKeys.lower_bound(prefix); it != _orderedKeys.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+                    Entry& entry = _entries[it->second];
+                    if (entry.subscribers.empty() || entry.subscribers.back() != index) {
+                        entry.subscribers.push_back(index);
+                    }
+                }
+            }
+            for (auto& key : keys) {
+                Entry& entry = _entries[_Intern(key)];
+                if (entry.subscribers.empty() || entry.subscribers.back() != index) {
+                    entry.subscribers.push_back(index);
+                }
+            }
+            _subscriptions.back().prefixes = prefixes;
+
+            for (mujinplc::PLCKeyHandle handle = 0; handle < _entries.size(); ++handle) {
+                const Entry& entry = _entries[handle];
+                if (entry.sequence != 0 && !entry.subscribers.empty() && entry.subscribers.back() == index) {
+                    entriesCopy.emplace(_registry.GetName(handle), entry.value);
+                }
+            }
+        }
+
+        // when dispatching, the initial state has to be delivered before any batch queued after this
+        if (_dispatching) {
+            if (entriesCopy.size() > 0) {
+                std::lock_guard<std::mutex> dispatcherLock(_dispatcherMutex);
+                std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+                batch->sequence = sequence;
+                batch->keyvalues.swap(entriesCopy);
+                _Post(index, observer, batch);
+                _dispatcherCondition.notify_one();
+            }
+            return;
+        }
     }
     if (entriesCopy.size() > 0) {
-        observer->MemoryModified(entriesCopy);
+        _WaitUntilDrained();
+        observer->MemoryModified(sequence, entriesCopy);
+    }
+}
+
+void mujinplc::PLCMemory::StartDispatcher(size_t maxPendingBatches) {
+    StopDispatcher();
+
+    {
+        std::lock_guard<std::mutex> dispatcherLock(_dispatcherMutex);
+        _maxPendingBatches = maxPendingBatches;
+        _dispatcherShutdown = false;
+        _dispatcherThread = std::thread(&mujinplc::PLCMemory::_RunDispatcherThread, this);
+        _dispatcherThreadId = _dispatcherThread.get_id();
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _dispatching = true;
+}
+
+void mujinplc::PLCMemory::StopDispatcher() {
+    {
+        // writes after this notify on their own threads, but only once the batches posted before are delivered
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::lock_guard<std::mutex> dispatcherLock(_dispatcherMutex);
+        _dispatching = false;
+        _dispatcherShutdown = true;
+        if (_dispatcherThread.joinable()) {
+            _draining = true;
+        }
+    }
+    _dispatcherCondition.notify_all();
+    if (_dispatcherThread.joinable()) {
+        _dispatcherThread.join();
+    }
+}
+
+bool mujinplc::PLCMemory::IsDispatcherThread() {
+    std::lock_guard<std::mutex> dispatcherLock(_dispatcherMutex);
+    return _dispatcherThread.joinable() && std::this_thread::get_id() == _dispatcherThreadId;
+}
+
+mujinplc::PLCMemoryMetrics& mujinplc::PLCMemory::GetMetrics() {
+    return _metrics;
+}
+
+void mujinplc::PLCMemory::_WaitUntilDrained() {
+    if (!_draining.load()) {
+        return;
+    }
+    std::unique_lock<std::mutex> dispatcherLock(_dispatcherMutex);
+    // an observer writing from the dispatcher thread would wait for itself
+    if (std::this_thread::get_id() == _dispatcherThreadId) {
+        return;
+    }
+    _dispatcherCondition.wait(dispatcherLock, [this] { return !_draining.load(); });
+}
+
+void mujinplc::PLCMemory::_Post(uint64_t sequence, std::map<std::string, mujinplc::PLCValue>& modifications, std::vector<Notification>& notifications) {
+    if (notifications.empty()) {
+        return;
+    }
+
+    std::shared_ptr<Batch> all;
+    std::lock_guard<std::mutex> dispatcherLock(_dispatcherMutex);
+    for (auto& notification : notifications) {
+        if (notification.all) {
+            if (!all) {
+                all = std::make_shared<Batch>();
+                all->sequence = sequence;
+                all->keyvalues.swap(modifications);
+            }
+            _Post(notification.subscription, notification.observer, all);
+        }
+        else {
+            std::shared_ptr<Batch> batch = std::make_shared<Batch>();
+            batch->sequence = sequence;
+            batch->keyvalues.swap(notification.keyvalues);
+            _Post(notification.subscription, notification.observer, batch);
+        }
+    }
+    _dispatcherCondition.notify_one();
+}
+
+void mujinplc::PLCMemory::_Post(uint32_t subscription, const std::weak_ptr<PLCMemoryObserver>& observer, const std::shared_ptr<Batch>& batch) {
+    if (subscription >= _pending.size()) {
+        _pending.resize(subscription + 1);
+    }
+    PendingBatches& pending = _pending[subscription];
+    if (pending.batches.empty()) {
+        pending.observer = observer;
+        pending.batches.push_back(batch);
+        _ready.push_back(subscription);
+        return;
+    }
+
+    if (_maxPendingBatches == 0 || pending.batches.size() < _maxPendingBatches) {
+        pending.batches.push_back(batch);
+        return;
+    }
+
+    // observer is falling behind, coalesce into the last batch, copying it first if anyone else still refers to it
+    std::shared_ptr<Batch>& last = pending.batches.back();
+    if (last.use_count() > 1) {
+        last = std::make_shared<Batch>(*last);
+    }
+    last->sequence = batch->sequence;
+    for (auto& keyvalue : batch->keyvalues) {
+        last->keyvalues[keyvalue.first] = keyvalue.second;
+    }
+}
+
+void mujinplc::PLCMemory::_RunDispatcherThread() {
+    while (true) {
+        std::weak_ptr<PLCMemoryObserver> observerWeak;
+        std::shared_ptr<Batch> batch;
+        {
+            std::unique_lock<std::mutex> dispatcherLock(_dispatcherMutex);
+            _dispatcherCondition.wait(dispatcherLock, [this] { return _dispatcherShutdown || !_ready.empty(); });
+            if (_ready.empty()) {
+                // shutdown, and everything delivered
+                _draining = false;
+                _dispatcherCondition.notify_all();
+                return;
+            }
+
+            // round robin between observers so a slow one does not starve the others
+            uint32_t subscription = _ready.front();
+            _ready.pop_front();
+            PendingBatches& pending = _pending[subscription];
+            observerWeak = pending.observer;
+            batch = pending.batches.front();
+            pending.batches.pop_front();
+            if (!pending.batches.empty()) {
+                _ready.push_back(subscription);
+            }
+        }
+
+        if (auto observer = observerWeak.lock()) {
+            auto start = std::chrono::steady_clock::now();
+            observer->MemoryModified(batch->sequence, batch->keyvalues);
+            _metrics.observerCallbackTime.RecordSince(start);
+        }
     }
 }
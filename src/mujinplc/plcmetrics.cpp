@@ -0,0 +1,223 @@
+#include "mujinplc/plcmetrics.h"
+#include "mujinplc/plcprotocol.h"
+
+#include <cstdio>
+
+namespace mujinplc {
+
+static void WriteCounter(const char* name, uint64_t value, std::string& json) {
+    char buffer[64];
+    std::snprintf(buffer, sizeof(buffer), "\"%s\": %llu", name, (unsigned long long)value);
+    json += buffer;
+}
+
+static void WriteHistogram(const char* name, const PLCHistogram& histogram, std::string& json) {
+    uint64_t count = histogram.GetCount();
+    char buffer[256];
+    std::snprintf(buffer, sizeof(buffer), "\"%s\": {\"count\": %llu, \"mean\": %llu, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+                  name,
+                  (unsigned long long)count,
+                  (unsigned long long)(count > 0 ? histogram.GetSum() / count : 0),
+                  (unsigned long long)histogram.GetPercentile(50),
+                  (unsigned long long)histogram.GetPercentile(90),
+                  (unsigned long long)histogram.GetPercentile(99),
+                  (unsigned long long)histogram.GetPercentile(99.9),
+                  (unsigned long long)histogram.GetMax());
+    json += buffer;
+}
+
+}
+
+void mujinplc::PLCGauge::Add(int64_t delta) {
+    int64_t value = _value.fetch_add(delta, std::memory_order_relaxed) + delta;
+    int64_t max = _max.load(std::memory_order_relaxed);
+    while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+void mujinplc::PLCGauge::Reset() {
+    _max.store(_value.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+const size_t mujinplc::PLCHistogram::NumSubBuckets;
+const size_t mujinplc::PLCHistogram::NumBuckets;
+
+size_t mujinplc::PLCHistogram::_GetBucket(uint64_t value) {
+    if (value < NumSubBuckets) {
+        return value;
+    }
+    // highest set bit picks the power of two, the three bits below it the linear bucket within
+    int msb = 63 - __builtin_clzll(value);
+    return (msb - 2) * NumSubBuckets + ((value >> (msb - 3)) & (NumSubBuckets - 1));
+}
+
+uint64_t mujinplc::PLCHistogram::_GetUpperBound(size_t bucket) {
+    if (bucket < NumSubBuckets) {
+        return bucket;
+    }
+    int msb = int(bucket / NumSubBuckets) + 2;
+    uint64_t width = uint64_t(1) << (msb - 3);
+    return (NumSubBuckets + bucket % NumSubBuckets) * width + (width - 1);
+}
+
+void mujinplc::PLCHistogram::Record(uint64_t value) {
+    // the count is summed from the buckets when read, to keep recording at two atomic adds
+    _buckets[_GetBucket(value)].fetch_add(1, std::memory_order_relaxed);
+    _sum.fetch_add(value, std::memory_order_relaxed);
+    uint64_t max = _max.load(std::memory_order_relaxed);
+    while (value > max && !_max.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+}
+
+uint64_t mujinplc::PLCHistogram::GetCount() const {
+    uint64_t count = 0;
+    for (auto& bucket : _buckets) {
+        count += bucket.load(std::memory_order_relaxed);
+    }
+    return count;
+}
+
+uint64_t mujinplc::PLCHistogram::GetSum() const {
+    return _sum.load(std::memory_order_relaxed);
+}
+
+uint64_t mujinplc::PLCHistogram::GetMax() const {
+    return _max.load(std::memory_order_relaxed);
+}
+
+uint64_t mujinplc::PLCHistogram::GetPercentile(double percentile) const {
+    // the buckets are read one by one while others keep recording, the total is taken from the same reads
+    uint64_t counts[NumBuckets];
+    uint64_t total = 0;
+    for (size_t bucket = 0; bucket < NumBuckets; ++bucket) {
+        counts[bucket] = _buckets[bucket].load(std::memory_order_relaxed);
+        total += counts[bucket];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = uint64_t(percentile / 100.0 * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < NumBuckets; ++bucket) {
+        seen += counts[bucket];
+        if (seen >= rank) {
+            uint64_t upperBound = _GetUpperBound(bucket);
+            uint64_t max = GetMax();
+            return upperBound < max ? upperBound : max;
+        }
+    }
+    return GetMax();
+}
+
+void mujinplc::PLCHistogram::Reset() {
+    for (auto& bucket : _buckets) {
+        bucket.store(0, std::memory_order_relaxed);
+    }
+    _sum.store(0, std::memory_order_relaxed);
+    _max.store(0, std::memory_order_relaxed);
+}
+
+const size_t mujinplc::PLCServerMetrics::NumCommands;
+
+void mujinplc::PLCServerMetrics::Reset() {
+    for (auto& counter : requests) {
+        counter.Reset();
+    }
+    rejectedRequests.Reset();
+    decodeTime.Reset();
+    handleTime.Reset();
+    encodeTime.Reset();
+    requestTime.Reset();
+}
+
+void mujinplc::PLCServerMetrics::Write(std::string& json) const {
+    json += "{\"requests\": {";
+    bool first = true;
+    for (size_t command = 0; command < NumCommands; ++command) {
+        uint64_t count = requests[command].Get();
+        if (count == 0) {
+            continue;
+        }
+        if (!first) {
+            json += ", ";
+        }
+        first = false;
+        mujinplc::WriteCounter(mujinplc::GetCommandName((mujinplc::PLCCommand)command), count, json);
+    }
+    json += "}, ";
+    mujinplc::WriteCounter("rejectedRequests", rejectedRequests.Get(), json);
+    json += ", ";
+    mujinplc::WriteHistogram("decodeTime", decodeTime, json);
+    json += ", ";
+    mujinplc::WriteHistogram("handleTime", handleTime, json);
+    json += ", ";
+    mujinplc::WriteHistogram("encodeTime", encodeTime, json);
+    json += ", ";
+    mujinplc::WriteHistogram("requestTime", requestTime, json);
+    json += "}";
+}
+
+const uint32_t mujinplc::PLCMemoryMetrics::LockHoldSampling;
+
+void mujinplc::PLCMemoryMetrics::Reset() {
+    writes.Reset();
+    modifiedKeys.Reset();
+    lockWaitTime.Reset();
+    lockHoldTime.Reset();
+    observerCallbackTime.Reset();
+}
+
+void mujinplc::PLCMemoryMetrics::Write(std::string& json) const {
+    json += "{";
+    mujinplc::WriteCounter("writes", writes.Get(), json);
+    json += ", ";
+    mujinplc::WriteCounter("modifiedKeys", modifiedKeys.Get(), json);
+    json += ", ";
+    mujinplc::WriteHistogram("lockWaitTime", lockWaitTime, json);
+    json += ", ";
+    mujinplc::WriteHistogram("lockHoldTime", lockHoldTime, json);
+    json += ", ";
+    mujinplc::WriteHistogram("observerCallbackTime", observerCallbackTime, json);
+    json += "}";
+}
+
+void mujinplc::PLCControllerMetrics::Reset() {
+    enqueued.Reset();
+    dequeued.Reset();
+    queueDepth.Reset();
+    queueEntries.Reset();
+    queueDepthAtEnqueue.Reset();
+    coalesced.Reset();
+    droppedEdges.Reset();
+    blockedTime.Reset();
+}
+
+void mujinplc::PLCControllerMetrics::Write(std::string& json) const {
+    json += "{";
+    mujinplc::WriteCounter("enqueued", enqueued.Get(), json);
+    json += ", ";
+    mujinplc::WriteCounter("dequeued", dequeued.Get(), json);
+    json += ", ";
+    int64_t depth = queueDepth.Get();
+    mujinplc::WriteCounter("queueDepth", depth > 0 ? depth : 0, json);
+    json += ", ";
+    mujinplc::WriteCounter("maxQueueDepth", queueDepth.GetMax(), json);
+    json += ", ";
+    int64_t entries = queueEntries.Get();
+    mujinplc::WriteCounter("queueEntries", entries > 0 ? entries : 0, json);
+    json += ", ";
+    mujinplc::WriteCounter("maxQueueEntries", queueEntries.GetMax(), json);
+    json += ", ";
+    mujinplc::WriteHistogram("queueDepthAtEnqueue", queueDepthAtEnqueue, json);
+    json += ", ";
+    mujinplc::WriteCounter("coalesced", coalesced.Get(), json);
+    json += ", ";
+    mujinplc::WriteCounter("droppedEdges", droppedEdges.Get(), json);
+    json += ", ";
+    mujinplc::WriteHistogram("blockedTime", blockedTime, json);
+    json += "}";
+}
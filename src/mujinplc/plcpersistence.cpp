@@ -0,0 +1,435 @@
+#include "mujinplc/plcpersistence.h"
+#include "mujinplc/plcprotocol.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mujinplc {
+
+static const uint32_t s_logMagic = 0x4d504c57; // "MPLW"
+static const uint32_t s_snapshotMagic = 0x4d504c53; // "MPLS"
+static const uint32_t s_persistenceVersion = 1;
+
+/// start of the log file, records follow at sizeof(LogHeader)
+struct alignas(64) LogHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;
+};
+
+/// precedes every payload, in the log and in the snapshot
+struct RecordHeader {
+    uint32_t length; ///< of the payload, written last so a record is only complete once it is set
+    uint32_t checksum; ///< crc32 of the generation followed by the payload
+};
+
+struct SnapshotHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t generation;
+    RecordHeader record;
+};
+
+static uint32_t Checksum(uint64_t generation, const char* data, size_t size) {
+    static const struct Table {
+        uint32_t entries[256];
+        Table() {
+            for (uint32_t index = 0; index < 256; ++index) {
+                uint32_t crc = index;
+                for (int bit = 0; bit < 8; ++bit) {
+                    crc = (crc & 1) ? (crc >> 1) ^ 0xedb88320u : crc >> 1;
+                }
+                entries[index] = crc;
+            }
+        }
+    } table;
+
+    uint32_t crc = 0xffffffffu;
+    const unsigned char* generationBytes = reinterpret_cast<const unsigned char*>(&generation);
+    for (size_t index = 0; index < sizeof(generation); ++index) {
+        crc = table.entries[(crc ^ generationBytes[index]) & 0xff] ^ (crc >> 8);
+    }
+    for (size_t index = 0; index < size; ++index) {
+        crc = table.entries[(crc ^ (unsigned char)data[index]) & 0xff] ^ (crc >> 8);
+    }
+    return crc ^ 0xffffffffu;
+}
+
+static void WriteFully(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::system_error(errno, std::generic_category(), "write");
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+static void SyncDirectory(const std::string& directory) {
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + directory);
+    }
+    ::fsync(fd);
+    ::close(fd);
+}
+
+}
+
+mujinplc::PLCPersistence::PLCPersistence(const std::shared_ptr<mujinplc::PLCMemory>& memory, const std::string& directory, std::chrono::milliseconds flushInterval, size_t logSize, bool syncToDisk) :
+    _memory(memory),
+    _directory(directory),
+    _flushInterval(flushInterval),
+    _logSize(logSize),
+    _syncToDisk(syncToDisk),
+    _shutdown(true),
+    _running(false),
+    _logFd(-1),
+    _log(NULL),
+    _mappedSize(0),
+    _logOffset(0),
+    _generation(0),
+    _sequence(0) {
+    if (_logSize < sizeof(mujinplc::LogHeader) + 4096) {
+        throw std::invalid_argument("log size too small");
+    }
+}
+
+mujinplc::PLCPersistence::~PLCPersistence() {
+    try {
+        Stop();
+    } catch (const std::exception&) {
+        // nothing to report to in a destructor, the log keeps what was flushed before
+    }
+    if (_log != NULL) {
+        ::munmap(_log, _mappedSize);
+    }
+    if (_logFd >= 0) {
+        ::close(_logFd);
+    }
+}
+
+size_t mujinplc::PLCPersistence::Start() {
+    Stop();
+
+    std::map<std::string, mujinplc::PLCValue> keyvalues;
+    bool compact;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (::mkdir(_directory.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::system_error(errno, std::generic_category(), "mkdir " + _directory);
+        }
+
+        mujinplc::PLCRequest request;
+        _generation = 0;
+        if (_ReadSnapshot(_payload)) {
+            if (!mujinplc::DecodeRequest(_payload.data(), _payload.size(), request) || request.command != mujinplc::PLCCommand_Write) {
+                throw std::runtime_error("corrupt snapshot in " + _directory);
+            }
+            keyvalues.swap(request.keyvalues);
+        }
+
+        _OpenLog();
+        const mujinplc::LogHeader* header = reinterpret_cast<const mujinplc::LogHeader*>(_log);
+        bool replay = header->magic == mujinplc::s_logMagic && header->generation == _generation;
+        if (header->magic == mujinplc::s_logMagic && header->generation > _generation) {
+            throw std::runtime_error("log in " + _directory + " is newer than its snapshot");
+        }
+        if (header->magic != mujinplc::s_logMagic && header->magic != 0) {
+            throw std::runtime_error("corrupt log in " + _directory);
+        }
+
+        // a log older than the snapshot is left over from a compaction that was interrupted, the snapshot already has it
+        struct stat st;
+        if (::fstat(_logFd, &st) != 0) {
+            throw std::system_error(errno, std::generic_category(), "fstat");
+        }
+        size_t fileSize = st.st_size;
+        _logOffset = sizeof(mujinplc::LogHeader);
+        while (replay && _logOffset + sizeof(mujinplc::RecordHeader) <= fileSize) {
+            mujinplc::RecordHeader record;
+            std::memcpy(&record, _log + _logOffset, sizeof(record));
+            const char* payload = _log + _logOffset + sizeof(record);
+            if (record.length == 0 || record.length > fileSize - _logOffset - sizeof(record)) {
+                break;
+            }
+            // a torn record, or one of an older generation that the current one did not overwrite yet, ends the log
+            if (record.checksum != mujinplc::Checksum(_generation, payload, record.length)) {
+                break;
+            }
+            if (!mujinplc::DecodeRequest(payload, record.length, request) || request.command != mujinplc::PLCCommand_Write) {
+                break;
+            }
+            for (auto& keyvalue : request.keyvalues) {
+                keyvalues[keyvalue.first] = std::move(keyvalue.second);
+            }
+            _logOffset += sizeof(record) + record.length;
+        }
+
+        if (!replay) {
+            _ResetLog(_generation);
+        }
+        // a log written with another size, or a log already half full, is compacted once the memory has its content
+        compact = _logOffset > _logSize / 2 || fileSize != _logSize;
+    }
+
+    if (!keyvalues.empty()) {
+        _memory->Write(keyvalues);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _sequence = _memory->GetSequence();
+        if (compact) {
+            _Compact();
+        }
+        _running = true;
+    }
+
+    _shutdown = false;
+    _thread = std::thread(&mujinplc::PLCPersistence::_RunThread, this);
+    return keyvalues.size();
+}
+
+void mujinplc::PLCPersistence::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _shutdown = true;
+    }
+    _condition.notify_all();
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_running) {
+        _running = false;
+        _Flush();
+        ::msync(_log, _mappedSize, MS_SYNC);
+    }
+}
+
+bool mujinplc::PLCPersistence::IsRunning() const {
+    return !_shutdown;
+}
+
+void mujinplc::PLCPersistence::Flush() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_running) {
+        _Flush();
+    }
+}
+
+void mujinplc::PLCPersistence::Compact() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_running) {
+        _Compact();
+    }
+}
+
+void mujinplc::PLCPersistence::_RunThread() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_shutdown) {
+        _condition.wait_for(lock, _flushInterval, [this] { return !!_shutdown; });
+        if (_shutdown) {
+            break;
+        }
+        try {
+            _Flush();
+        } catch (const std::exception&) {
+            // e.g. the disk is full, try again next time. Flush and Stop report it to the caller.
+        }
+    }
+}
+
+void mujinplc::PLCPersistence::_Flush() {
+    mujinplc::PLCRequest request;
+    request.command = mujinplc::PLCCommand_Write;
+    uint64_t sequence = _memory->ReadModifiedSince(_sequence, request.keyvalues);
+    if (request.keyvalues.empty()) {
+        _sequence = sequence;
+        return;
+    }
+
+    mujinplc::EncodeRequest(request, mujinplc::PLCEncoding_Binary, _payload);
+    if (_logOffset + sizeof(mujinplc::RecordHeader) + _payload.size() > _logSize) {
+        // the snapshot picks up these modifications as well
+        _Compact();
+        return;
+    }
+    _Append(_payload);
+    _sequence = sequence;
+
+    if (_logOffset > _logSize / 2) {
+        _Compact();
+    }
+}
+
+void mujinplc::PLCPersistence::_Compact() {
+    mujinplc::PLCRequest request;
+    request.command = mujinplc::PLCCommand_Write;
+    uint64_t sequence = _memory->ReadModifiedSince(0, request.keyvalues);
+    mujinplc::EncodeRequest(request, mujinplc::PLCEncoding_Binary, _payload);
+
+    // the snapshot is renamed into place before the log moves on to its generation, a crash in between leaves an older
+    // log that is ignored on restore
+    _WriteSnapshot(_generation + 1, _payload);
+    _ResetLog(_generation + 1);
+    _generation++;
+    _sequence = sequence;
+}
+
+void mujinplc::PLCPersistence::_OpenLog() {
+    if (_log != NULL) {
+        ::munmap(_log, _mappedSize);
+        _log = NULL;
+    }
+    if (_logFd >= 0) {
+        ::close(_logFd);
+        _logFd = -1;
+    }
+
+    std::string path = _directory + "/plc.log";
+    _logFd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (_logFd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+    struct stat st;
+    if (::fstat(_logFd, &st) != 0) {
+        throw std::system_error(errno, std::generic_category(), "fstat " + path);
+    }
+    if ((size_t)st.st_size < sizeof(mujinplc::LogHeader) && ::ftruncate(_logFd, _logSize) != 0) {
+        throw std::system_error(errno, std::generic_category(), "ftruncate " + path);
+    }
+
+    // a log written with another size is replayed through this mapping, then reset to _logSize.
+    // pages past the end of a shorter file are never touched before that.
+    size_t size = std::max((size_t)st.st_size, _logSize);
+    void* data = ::mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _logFd, 0);
+    if (data == MAP_FAILED) {
+        throw std::system_error(errno, std::generic_category(), "mmap " + path);
+    }
+    _log = static_cast<char*>(data);
+    _mappedSize = size;
+}
+
+void mujinplc::PLCPersistence::_ResetLog(uint64_t generation) {
+    struct stat st;
+    if (::fstat(_logFd, &st) != 0) {
+        throw std::system_error(errno, std::generic_category(), "fstat");
+    }
+    if ((size_t)st.st_size != _logSize || _mappedSize != _logSize) {
+        ::munmap(_log, _mappedSize);
+        _log = NULL;
+        if (::ftruncate(_logFd, _logSize) != 0) {
+            throw std::system_error(errno, std::generic_category(), "ftruncate");
+        }
+        void* data = ::mmap(NULL, _logSize, PROT_READ | PROT_WRITE, MAP_SHARED, _logFd, 0);
+        if (data == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "mmap");
+        }
+        _log = static_cast<char*>(data);
+        _mappedSize = _logSize;
+    }
+
+    // records of the previous generation stay behind, their checksums do not match the new one
+    mujinplc::LogHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = mujinplc::s_logMagic;
+    header.version = mujinplc::s_persistenceVersion;
+    header.generation = generation;
+    std::memcpy(_log, &header, sizeof(header));
+    std::memset(_log + sizeof(header), 0, sizeof(mujinplc::RecordHeader));
+    _logOffset = sizeof(header);
+    if (_syncToDisk) {
+        ::msync(_log, sizeof(header) + sizeof(mujinplc::RecordHeader), MS_SYNC);
+    }
+}
+
+bool mujinplc::PLCPersistence::_ReadSnapshot(std::string& payload) {
+    std::string path = _directory + "/plc.snapshot";
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return false;
+        }
+        throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+
+    mujinplc::SnapshotHeader header;
+    ssize_t numRead = ::pread(fd, &header, sizeof(header), 0);
+    if (numRead != (ssize_t)sizeof(header) || header.magic != mujinplc::s_snapshotMagic || header.version != mujinplc::s_persistenceVersion) {
+        ::close(fd);
+        throw std::runtime_error("corrupt snapshot " + path);
+    }
+    payload.resize(header.record.length);
+    numRead = ::pread(fd, &payload[0], payload.size(), sizeof(header));
+    ::close(fd);
+    if (numRead != (ssize_t)payload.size() || header.record.checksum != mujinplc::Checksum(header.generation, payload.data(), payload.size())) {
+        throw std::runtime_error("corrupt snapshot " + path);
+    }
+    _generation = header.generation;
+    return true;
+}
+
+void mujinplc::PLCPersistence::_WriteSnapshot(uint64_t generation, const std::string& payload) {
+    std::string path = _directory + "/plc.snapshot";
+    std::string temporaryPath = path + ".tmp";
+    int fd = ::open(temporaryPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "open " + temporaryPath);
+    }
+
+    mujinplc::SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = mujinplc::s_snapshotMagic;
+    header.version = mujinplc::s_persistenceVersion;
+    header.generation = generation;
+    header.record.length = (uint32_t)payload.size();
+    header.record.checksum = mujinplc::Checksum(generation, payload.data(), payload.size());
+    try {
+        mujinplc::WriteFully(fd, reinterpret_cast<const char*>(&header), sizeof(header));
+        mujinplc::WriteFully(fd, payload.data(), payload.size());
+        if (::fsync(fd) != 0) {
+            throw std::system_error(errno, std::generic_category(), "fsync " + temporaryPath);
+        }
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+
+    if (::rename(temporaryPath.c_str(), path.c_str()) != 0) {
+        throw std::system_error(errno, std::generic_category(), "rename " + temporaryPath);
+    }
+    mujinplc::SyncDirectory(_directory);
+}
+
+void mujinplc::PLCPersistence::_Append(const std::string& payload) {
+    char* record = _log + _logOffset;
+    mujinplc::RecordHeader header;
+    header.length = (uint32_t)payload.size();
+    header.checksum = mujinplc::Checksum(_generation, payload.data(), payload.size());
+    std::memcpy(record + sizeof(header), payload.data(), payload.size());
+    std::memcpy(record + offsetof(mujinplc::RecordHeader, checksum), &header.checksum, sizeof(header.checksum));
+    std::memcpy(record, &header.length, sizeof(header.length));
+    _logOffset += sizeof(header) + payload.size();
+
+    if (_syncToDisk) {
+        // msync wants a page aligned start
+        size_t pageSize = (size_t)::sysconf(_SC_PAGESIZE);
+        size_t start = (record - _log) / pageSize * pageSize;
+        ::msync(_log + start, _logOffset - start, MS_SYNC);
+    }
+}
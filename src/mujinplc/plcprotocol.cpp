@@ -0,0 +1,1175 @@
+#include "mujinplc/plcprotocol.h"
+
+#include <cmath>
+#include <cstring>
+#include <rapidjson/document.h>
+#include <rapidjson/writer.h>
+
+namespace mujinplc {
+
+/// bounds checked reader over a binary message
+class BinaryReader {
+public:
+    BinaryReader(const char* data, size_t size) : _data((const unsigned char*)data), _size(size), _offset(0) {
+    }
+
+    bool IsEnd() const {
+        return _offset == _size;
+    }
+
+    bool ReadByte(uint8_t& value) {
+        if (_offset >= _size) {
+            return false;
+        }
+        value = _data[_offset++];
+        return true;
+    }
+
+    bool ReadVarint(uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            uint8_t byte;
+            if (!ReadByte(byte)) {
+                return false;
+            }
+            value |= uint64_t(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool ReadString(std::string& value) {
+        uint64_t length;
+        if (!ReadVarint(length) || length > _size - _offset) {
+            return false;
+        }
+        value.assign((const char*)_data + _offset, length);
+        _offset += length;
+        return true;
+    }
+
+    bool ReadFixed32(uint32_t& value) {
+        if (_size - _offset < 4) {
+            return false;
+        }
+        value = uint32_t(_data[_offset]) | (uint32_t(_data[_offset + 1]) << 8) | (uint32_t(_data[_offset + 2]) << 16) | (uint32_t(_data[_offset + 3]) << 24);
+        _offset += 4;
+        return true;
+    }
+
+    bool ReadFixed64(uint64_t& value) {
+        if (_size - _offset < 8) {
+            return false;
+        }
+        value = 0;
+        for (int index = 7; index >= 0; --index) {
+            value = (value << 8) | _data[_offset + index];
+        }
+        _offset += 8;
+        return true;
+    }
+
+    bool ReadDouble(double& value) {
+        uint64_t bits;
+        if (!ReadFixed64(bits)) {
+            return false;
+        }
+        std::memcpy(&value, &bits, sizeof(value));
+        return true;
+    }
+
+    // reads the element count of an array, checking that the message is long enough for that many elements
+    bool ReadCount(size_t elementSize, uint64_t& count) {
+        return ReadVarint(count) && count <= (_size - _offset) / elementSize;
+    }
+
+    bool ReadValue(PLCValue& value) {
+        uint8_t type;
+        if (!ReadByte(type)) {
+            return false;
+        }
+        switch (type) {
+        case PLCValueType_Null:
+            value.SetNull();
+            return true;
+        case PLCValueType_Boolean: {
+            uint8_t boolean;
+            if (!ReadByte(boolean)) {
+                return false;
+            }
+            value.SetBoolean(boolean != 0);
+            return true;
+        }
+        case PLCValueType_Integer: {
+            uint32_t integer;
+            if (!ReadFixed32(integer)) {
+                return false;
+            }
+            value.SetInteger((int)integer);
+            return true;
+        }
+        case PLCValueType_String: {
+            uint64_t length;
+            if (!ReadVarint(length) || length > _size - _offset) {
+                return false;
+            }
+            value.SetString((const char*)_data + _offset, length);
+            _offset += length;
+            return true;
+        }
+        case PLCValueType_Double: {
+            double number;
+            if (!ReadDouble(number)) {
+                return false;
+            }
+            value.SetDouble(number);
+            return true;
+        }
+        case PLCValueType_Integer64: {
+            uint64_t integer;
+            if (!ReadFixed64(integer)) {
+                return false;
+            }
+            value.SetInteger64((int64_t)integer);
+            return true;
+        }
+        case PLCValueType_IntegerArray: {
+            uint64_t count;
+            if (!ReadCount(4, count)) {
+                return false;
+            }
+            // a value decoded into again reuses its storage, unless it was shared meanwhile
+            std::vector<int>& integers = value.GetMutableIntegerArray(false);
+            integers.resize(count);
+            for (auto& integer : integers) {
+                uint32_t element;
+                ReadFixed32(element);
+                integer = (int)element;
+            }
+            return true;
+        }
+        case PLCValueType_DoubleArray: {
+            uint64_t count;
+            if (!ReadCount(8, count)) {
+                return false;
+            }
+            std::vector<double>& numbers = value.GetMutableDoubleArray(false);
+            numbers.resize(count);
+            for (auto& number : numbers) {
+                ReadDouble(number);
+            }
+            return true;
+        }
+        case PLCValueType_Blob: {
+            uint64_t length;
+            if (!ReadCount(1, length)) {
+                return false;
+            }
+            value.GetMutableBlob(false).assign((const char*)_data + _offset, length);
+            _offset += length;
+            return true;
+        }
+        }
+        return false;
+    }
+
+    bool ReadKeys(std::vector<std::string>& keys) {
+        uint64_t count;
+        if (!ReadVarint(count) || count > _size - _offset) {
+            return false;
+        }
+        keys.resize(count);
+        for (auto& key : keys) {
+            if (!ReadString(key)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool ReadKeyValues(std::map<std::string, PLCValue>& keyvalues) {
+        uint64_t count;
+        if (!ReadVarint(count) || count > _size - _offset) {
+            return false;
+        }
+        std::string key;
+        PLCValue value;
+        for (uint64_t index = 0; index < count; ++index) {
+            if (!ReadString(key) || !ReadValue(value)) {
+                return false;
+            }
+            // the first of duplicate keys is kept, same as ParseJSONKeyValues
+            keyvalues.emplace(key, std::move(value));
+        }
+        return true;
+    }
+
+    bool ReadKeyValues(std::vector<std::pair<std::string, PLCValue>>& keyvalues) {
+        uint64_t count;
+        if (!ReadVarint(count) || count > _size - _offset) {
+            return false;
+        }
+        keyvalues.resize(count);
+        for (auto& keyvalue : keyvalues) {
+            if (!ReadString(keyvalue.first) || !ReadValue(keyvalue.second)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool ReadOperations(std::vector<PLCOperation>& operations) {
+        uint64_t count;
+        if (!ReadVarint(count) || count > _size - _offset) {
+            return false;
+        }
+        operations.resize(count);
+        for (auto& operation : operations) {
+            uint8_t type;
+            if (!ReadByte(type) || type > PLCOperationType_CompareAndSwap || !ReadString(operation.key)) {
+                return false;
+            }
+            operation.type = (PLCOperationType)type;
+            if (operation.type == PLCOperationType_CompareAndSwap && !ReadValue(operation.expected)) {
+                return false;
+            }
+            if (operation.type != PLCOperationType_Read && !ReadValue(operation.value)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool ReadResults(std::vector<PLCOperationResult>& results) {
+        uint64_t count;
+        if (!ReadVarint(count) || count > _size - _offset) {
+            return false;
+        }
+        results.resize(count);
+        for (auto& result : results) {
+            uint8_t success;
+            if (!ReadByte(success) || !ReadValue(result.value)) {
+                return false;
+            }
+            result.success = success != 0;
+        }
+        return true;
+    }
+
+private:
+    const unsigned char* _data;
+    size_t _size;
+    size_t _offset;
+};
+
+static void WriteVarint(uint64_t value, std::string& data) {
+    while (value >= 0x80) {
+        data.push_back(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    data.push_back(char(value));
+}
+
+static void WriteString(const std::string& value, std::string& data) {
+    WriteVarint(value.size(), data);
+    data.append(value);
+}
+
+static void WriteFixed32(uint32_t value, std::string& data) {
+    data.push_back(char(value & 0xff));
+    data.push_back(char((value >> 8) & 0xff));
+    data.push_back(char((value >> 16) & 0xff));
+    data.push_back(char((value >> 24) & 0xff));
+}
+
+static void WriteFixed64(uint64_t value, std::string& data) {
+    for (int index = 0; index < 8; ++index) {
+        data.push_back(char((value >> (8 * index)) & 0xff));
+    }
+}
+
+static void WriteDouble(double value, std::string& data) {
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    WriteFixed64(bits, data);
+}
+
+static void WriteValue(const PLCValue& value, std::string& data) {
+    data.push_back(char(value.GetType()));
+    switch (value.GetType()) {
+    case PLCValueType_Boolean:
+        data.push_back(value.GetBoolean() ? 1 : 0);
+        break;
+    case PLCValueType_Integer:
+        WriteFixed32((uint32_t)value.GetInteger(), data);
+        break;
+    case PLCValueType_String:
+        WriteString(value.GetString(), data);
+        break;
+    case PLCValueType_Double:
+        WriteDouble(value.GetDouble(), data);
+        break;
+    case PLCValueType_Integer64:
+        WriteFixed64((uint64_t)value.GetInteger64(), data);
+        break;
+    case PLCValueType_IntegerArray: {
+        const std::vector<int>& integers = value.GetIntegerArray();
+        WriteVarint(integers.size(), data);
+        data.reserve(data.size() + 4 * integers.size());
+        for (int integer : integers) {
+            WriteFixed32((uint32_t)integer, data);
+        }
+        break;
+    }
+    case PLCValueType_DoubleArray: {
+        const std::vector<double>& numbers = value.GetDoubleArray();
+        WriteVarint(numbers.size(), data);
+        data.reserve(data.size() + 8 * numbers.size());
+        for (double number : numbers) {
+            WriteDouble(number, data);
+        }
+        break;
+    }
+    case PLCValueType_Blob:
+        WriteString(value.GetBlob(), data);
+        break;
+    default:
+        break;
+    }
+}
+
+static void WriteKeys(const std::vector<std::string>& keys, std::string& data) {
+    WriteVarint(keys.size(), data);
+    for (auto& key : keys) {
+        WriteString(key, data);
+    }
+}
+
+template <typename KeyValues>
+static void WriteKeyValues(const KeyValues& keyvalues, std::string& data) {
+    WriteVarint(keyvalues.size(), data);
+    for (auto& keyvalue : keyvalues) {
+        WriteString(keyvalue.first, data);
+        WriteValue(keyvalue.second, data);
+    }
+}
+
+static void WriteOperations(const std::vector<PLCOperation>& operations, std::string& data) {
+    WriteVarint(operations.size(), data);
+    for (auto& operation : operations) {
+        data.push_back(char(operation.type));
+        WriteString(operation.key, data);
+        if (operation.type == PLCOperationType_CompareAndSwap) {
+            WriteValue(operation.expected, data);
+        }
+        if (operation.type != PLCOperationType_Read) {
+            WriteValue(operation.value, data);
+        }
+    }
+}
+
+static void WriteResults(const std::vector<PLCOperationResult>& results, std::string& data) {
+    WriteVarint(results.size(), data);
+    for (auto& result : results) {
+        data.push_back(result.success ? 1 : 0);
+        WriteValue(result.value, data);
+    }
+}
+
+/// appends the output of a rapidjson writer to a string
+class StringOutputStream {
+public:
+    typedef char Ch;
+
+    void Put(char c) {
+        data->push_back(c);
+    }
+
+    void Flush() {
+    }
+
+    std::string* data = NULL;
+};
+
+typedef rapidjson::GenericDocument<rapidjson::UTF8<>, rapidjson::MemoryPoolAllocator<>, rapidjson::MemoryPoolAllocator<>> PooledDocument;
+typedef PooledDocument::ValueType PooledValue;
+
+/// per thread scratch space of the json codec, reused so that steady state messages do not allocate
+class JSONScratch {
+public:
+    JSONScratch() : valueBuffer(16384), parseBuffer(4096), writer(stream) {
+    }
+
+    std::vector<char> text; ///< nul terminated copy of the message to parse in situ, zmq frames are not nul terminated
+    std::vector<char> valueBuffer; ///< arena of the parsed values, spills over to the heap for large messages
+    std::vector<char> parseBuffer; ///< arena of the parser stack
+    StringOutputStream stream;
+    rapidjson::Writer<StringOutputStream> writer; ///< kept for its stack, rebound to the output of every message
+};
+
+static thread_local JSONScratch s_jsonScratch;
+
+/// parse a message in situ from the scratch arenas, the document must not outlive the allocators
+static bool ParseJSON(const char* data, size_t size, PooledDocument& doc) {
+    std::vector<char>& text = s_jsonScratch.text;
+    text.assign(data, data + size);
+    text.push_back('\0');
+    doc.ParseInsitu<rapidjson::kParseFullPrecisionFlag>(text.data());
+    return !doc.HasParseError() && doc.IsObject();
+}
+
+static const char s_base64Alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void EncodeBase64(const std::string& bytes, std::string& text) {
+    text.clear();
+    text.reserve((bytes.size() + 2) / 3 * 4);
+    size_t index = 0;
+    for (; index + 3 <= bytes.size(); index += 3) {
+        uint32_t triple = (uint32_t((unsigned char)bytes[index]) << 16) | (uint32_t((unsigned char)bytes[index + 1]) << 8) | uint32_t((unsigned char)bytes[index + 2]);
+        text.push_back(s_base64Alphabet[(triple >> 18) & 0x3f]);
+        text.push_back(s_base64Alphabet[(triple >> 12) & 0x3f]);
+        text.push_back(s_base64Alphabet[(triple >> 6) & 0x3f]);
+        text.push_back(s_base64Alphabet[triple & 0x3f]);
+    }
+    if (index < bytes.size()) {
+        uint32_t triple = uint32_t((unsigned char)bytes[index]) << 16;
+        if (index + 1 < bytes.size()) {
+            triple |= uint32_t((unsigned char)bytes[index + 1]) << 8;
+        }
+        text.push_back(s_base64Alphabet[(triple >> 18) & 0x3f]);
+        text.push_back(s_base64Alphabet[(triple >> 12) & 0x3f]);
+        text.push_back(index + 1 < bytes.size() ? s_base64Alphabet[(triple >> 6) & 0x3f] : '=');
+        text.push_back('=');
+    }
+}
+
+/// returns false for text that is not padded base64
+static bool DecodeBase64(const char* text, size_t length, std::string& bytes) {
+    if (length % 4 != 0) {
+        return false;
+    }
+    bytes.clear();
+    bytes.reserve(length / 4 * 3);
+    uint32_t bits = 0;
+    int numBits = 0;
+    size_t numPadding = 0;
+    for (size_t index = 0; index < length; ++index) {
+        char c = text[index];
+        uint32_t sextet;
+        if (c == '=' && index + 2 >= length) {
+            numPadding++;
+            continue;
+        }
+        else if (numPadding > 0) {
+            return false;
+        }
+        else if (c >= 'A' && c <= 'Z') {
+            sextet = c - 'A';
+        }
+        else if (c >= 'a' && c <= 'z') {
+            sextet = c - 'a' + 26;
+        }
+        else if (c >= '0' && c <= '9') {
+            sextet = c - '0' + 52;
+        }
+        else if (c == '+') {
+            sextet = 62;
+        }
+        else if (c == '/') {
+            sextet = 63;
+        }
+        else {
+            return false;
+        }
+        bits = (bits << 6) | sextet;
+        numBits += 6;
+        if (numBits >= 8) {
+            numBits -= 8;
+            bytes.push_back(char((bits >> numBits) & 0xff));
+        }
+    }
+    return true;
+}
+
+/// convert a json value into a PLCValue, unsupported types become null.
+/// numbers become the narrowest of integer, integer64 and double, arrays of numbers an integer array if every element
+/// is an integer and a double array otherwise, and {"blob": base64} a blob.
+static void ParseJSONValue(const PooledValue& value, PLCValue& result) {
+    if (value.IsString()) {
+        result.SetString(value.GetString(), value.GetStringLength());
+    }
+    else if (value.IsBool()) {
+        result.SetBoolean(value.GetBool());
+    }
+    else if (value.IsInt()) {
+        result.SetInteger(value.GetInt());
+    }
+    else if (value.IsInt64()) {
+        result.SetInteger64(value.GetInt64());
+    }
+    else if (value.IsNumber()) {
+        result.SetDouble(value.GetDouble());
+    }
+    else if (value.IsArray()) {
+        bool integers = true;
+        for (auto& element : value.GetArray()) {
+            if (!element.IsNumber()) {
+                result.SetNull();
+                return;
+            }
+            integers = integers && element.IsInt();
+        }
+        if (integers) {
+            std::vector<int>& array = result.GetMutableIntegerArray(false);
+            array.clear();
+            for (auto& element : value.GetArray()) {
+                array.push_back(element.GetInt());
+            }
+        }
+        else {
+            std::vector<double>& array = result.GetMutableDoubleArray(false);
+            array.clear();
+            for (auto& element : value.GetArray()) {
+                array.push_back(element.GetDouble());
+            }
+        }
+    }
+    else if (value.IsObject() && value.MemberCount() == 1 && value.HasMember("blob") && value["blob"].IsString()) {
+        const PooledValue& text = value["blob"];
+        if (!DecodeBase64(text.GetString(), text.GetStringLength(), result.GetMutableBlob(false))) {
+            result.SetNull();
+        }
+    }
+    else {
+        result.SetNull();
+    }
+}
+
+/// overwrites result in place, keeping the storage of the strings already there
+static void ParseJSONKeys(const PooledValue& keys, std::vector<std::string>& result) {
+    size_t numKeys = 0;
+    for (auto& key : keys.GetArray()) {
+        if (!key.IsString()) {
+            continue;
+        }
+        if (numKeys < result.size()) {
+            result[numKeys].assign(key.GetString(), key.GetStringLength());
+        }
+        else {
+            result.emplace_back(key.GetString(), key.GetStringLength());
+        }
+        numKeys++;
+    }
+    result.resize(numKeys);
+}
+
+static void ParseJSONKeyValues(const PooledValue& keyvalues, std::vector<std::pair<std::string, PLCValue>>& result) {
+    size_t numKeyValues = 0;
+    for (auto& keyvalue : keyvalues.GetObject()) {
+        if (!keyvalue.name.IsString()) {
+            continue;
+        }
+        if (numKeyValues >= result.size()) {
+            result.emplace_back();
+        }
+        result[numKeyValues].first.assign(keyvalue.name.GetString(), keyvalue.name.GetStringLength());
+        ParseJSONValue(keyvalue.value, result[numKeyValues].second);
+        numKeyValues++;
+    }
+    result.resize(numKeyValues);
+}
+
+static void ParseJSONKeyValues(const PooledValue& keyvalues, std::map<std::string, PLCValue>& result) {
+    result.clear();
+    PLCValue value;
+    for (auto& keyvalue : keyvalues.GetObject()) {
+        if (!keyvalue.name.IsString()) {
+            continue;
+        }
+        ParseJSONValue(keyvalue.value, value);
+        result.emplace(std::string(keyvalue.name.GetString(), keyvalue.name.GetStringLength()), value);
+    }
+}
+
+template <typename Writer>
+static void WriteJSONValue(const PLCValue& value, Writer& writer) {
+    if (value.IsString()) {
+        writer.String(value.GetString().c_str(), (rapidjson::SizeType)value.GetString().size());
+    }
+    else if (value.IsInteger()) {
+        writer.Int(value.GetInteger());
+    }
+    else if (value.IsBoolean()) {
+        writer.Bool(value.GetBoolean());
+    }
+    else if (value.IsDouble() && std::isfinite(value.GetDouble())) {
+        writer.Double(value.GetDouble());
+    }
+    else if (value.IsInteger64()) {
+        writer.Int64(value.GetInteger64());
+    }
+    else if (value.IsIntegerArray()) {
+        writer.StartArray();
+        for (int integer : value.GetIntegerArray()) {
+            writer.Int(integer);
+        }
+        writer.EndArray();
+    }
+    else if (value.IsDoubleArray()) {
+        // json has no nan and infinity, they become null like a non finite double
+        writer.StartArray();
+        for (double number : value.GetDoubleArray()) {
+            if (std::isfinite(number)) {
+                writer.Double(number);
+            }
+            else {
+                writer.Null();
+            }
+        }
+        writer.EndArray();
+    }
+    else if (value.IsBlob()) {
+        static thread_local std::string text;
+        EncodeBase64(value.GetBlob(), text);
+        writer.StartObject();
+        writer.Key("blob", 4);
+        writer.String(text.c_str(), (rapidjson::SizeType)text.size());
+        writer.EndObject();
+    }
+    else {
+        writer.Null();
+    }
+}
+
+template <typename KeyValues, typename Writer>
+static void WriteJSONKeyValues(const KeyValues& keyvalues, Writer& writer) {
+    writer.StartObject();
+    for (auto& keyvalue : keyvalues) {
+        writer.Key(keyvalue.first.c_str(), (rapidjson::SizeType)keyvalue.first.size());
+        WriteJSONValue(keyvalue.second, writer);
+    }
+    writer.EndObject();
+}
+
+static const char* const s_operationNames[] = {"read", "write", "cas"}; ///< indexed by PLCOperationType
+
+static const char* const s_commandNames[] = {"unknown", "read", "write", "readmodified", "snapshot", "batch", "stats", "readrange"}; ///< indexed by PLCCommand
+
+template <typename Writer>
+static void WriteJSONOperations(const std::vector<PLCOperation>& operations, Writer& writer) {
+    writer.StartArray();
+    for (auto& operation : operations) {
+        writer.StartObject();
+        writer.Key("op");
+        writer.String(s_operationNames[operation.type]);
+        writer.Key("key");
+        writer.String(operation.key.c_str(), (rapidjson::SizeType)operation.key.size());
+        if (operation.type == PLCOperationType_CompareAndSwap) {
+            writer.Key("expected");
+            WriteJSONValue(operation.expected, writer);
+        }
+        if (operation.type != PLCOperationType_Read) {
+            writer.Key("value");
+            WriteJSONValue(operation.value, writer);
+        }
+        writer.EndObject();
+    }
+    writer.EndArray();
+}
+
+template <typename Writer>
+static void WriteJSONResults(const std::vector<PLCOperationResult>& results, Writer& writer) {
+    writer.StartArray();
+    for (auto& result : results) {
+        writer.StartObject();
+        writer.Key("success");
+        writer.Bool(result.success);
+        writer.Key("value");
+        WriteJSONValue(result.value, writer);
+        writer.EndObject();
+    }
+    writer.EndArray();
+}
+
+/// parse the operations of a batch command, fails on any malformed operation so that nothing is executed partially
+static bool ParseJSONOperations(const PooledValue& operations, std::vector<PLCOperation>& result) {
+    result.resize(operations.GetArray().Size());
+    size_t index = 0;
+    for (auto& operation : operations.GetArray()) {
+        if (!operation.IsObject() || !operation.HasMember("op") || !operation["op"].IsString() || !operation.HasMember("key") || !operation["key"].IsString()) {
+            return false;
+        }
+
+        PLCOperation& parsed = result[index++];
+        const char* name = operation["op"].GetString();
+        if (std::strcmp(name, "read") == 0) {
+            parsed.type = PLCOperationType_Read;
+        }
+        else if (std::strcmp(name, "write") == 0) {
+            parsed.type = PLCOperationType_Write;
+        }
+        else if (std::strcmp(name, "cas") == 0) {
+            parsed.type = PLCOperationType_CompareAndSwap;
+        }
+        else {
+            return false;
+        }
+        parsed.key.assign(operation["key"].GetString(), operation["key"].GetStringLength());
+
+        if (parsed.type != PLCOperationType_Read && !operation.HasMember("value")) {
+            return false;
+        }
+        if (parsed.type == PLCOperationType_CompareAndSwap && !operation.HasMember("expected")) {
+            return false;
+        }
+        if (parsed.type != PLCOperationType_Read) {
+            ParseJSONValue(operation["value"], parsed.value);
+        }
+        if (parsed.type == PLCOperationType_CompareAndSwap) {
+            ParseJSONValue(operation["expected"], parsed.expected);
+        }
+    }
+    return true;
+}
+
+static void ParseJSONResults(const PooledValue& results, std::vector<PLCOperationResult>& parsed) {
+    parsed.resize(0);
+    for (auto& result : results.GetArray()) {
+        parsed.emplace_back();
+        if (!result.IsObject()) {
+            continue;
+        }
+        if (result.HasMember("success") && result["success"].IsBool()) {
+            parsed.back().success = result["success"].GetBool();
+        }
+        if (result.HasMember("value")) {
+            ParseJSONValue(result["value"], parsed.back().value);
+        }
+    }
+}
+
+template <typename Writer>
+static void WriteJSONKeys(const std::vector<std::string>& keys, Writer& writer) {
+    writer.StartArray();
+    for (auto& key : keys) {
+        writer.String(key.c_str(), (rapidjson::SizeType)key.size());
+    }
+    writer.EndArray();
+}
+
+}
+
+const char* mujinplc::GetCommandName(mujinplc::PLCCommand command) {
+    if (command < 0 || (size_t)command >= sizeof(mujinplc::s_commandNames) / sizeof(mujinplc::s_commandNames[0])) {
+        return mujinplc::s_commandNames[mujinplc::PLCCommand_Unknown];
+    }
+    return mujinplc::s_commandNames[command];
+}
+
+mujinplc::PLCEncoding mujinplc::GetEncoding(const char* data, size_t size) {
+    if (size > 0 && (unsigned char)data[0] == mujinplc::PLCBinaryHeader) {
+        return mujinplc::PLCEncoding_Binary;
+    }
+    return mujinplc::PLCEncoding_JSON;
+}
+
+bool mujinplc::DecodeRequest(const char* data, size_t size, mujinplc::PLCRequest& request) {
+    // keys are not cleared, so that their strings can be reused
+    request.command = mujinplc::PLCCommand_Unknown;
+    request.hasKeys = false;
+    request.keyvalues.clear();
+    request.sequence = 0;
+    request.prefixes.clear();
+    request.operations.clear();
+    request.begin.clear();
+    request.end.clear();
+    request.limit = 0;
+
+    if (mujinplc::GetEncoding(data, size) == mujinplc::PLCEncoding_Binary) {
+        mujinplc::BinaryReader reader(data + 1, size - 1);
+        uint8_t command, hasKeys;
+        if (!reader.ReadByte(command)) {
+            return false;
+        }
+        switch (command) {
+        case mujinplc::PLCCommand_Read:
+            if (!reader.ReadKeys(request.keys)) {
+                return false;
+            }
+            request.hasKeys = true;
+            break;
+        case mujinplc::PLCCommand_Write:
+            request.keys.clear();
+            if (!reader.ReadKeyValues(request.keyvalues)) {
+                return false;
+            }
+            break;
+        case mujinplc::PLCCommand_ReadModified:
+            if (!reader.ReadVarint(request.sequence) || !reader.ReadByte(hasKeys)) {
+                return false;
+            }
+            request.hasKeys = hasKeys != 0;
+            if (!request.hasKeys) {
+                request.keys.clear();
+            }
+            else if (!reader.ReadKeys(request.keys)) {
+                return false;
+            }
+            break;
+        case mujinplc::PLCCommand_Snapshot:
+            request.keys.clear();
+            if (!reader.ReadKeys(request.prefixes)) {
+                return false;
+            }
+            break;
+        case mujinplc::PLCCommand_Batch:
+            request.keys.clear();
+            if (!reader.ReadOperations(request.operations)) {
+                return false;
+            }
+            break;
+        case mujinplc::PLCCommand_Stats:
+            request.keys.clear();
+            break;
+        case mujinplc::PLCCommand_ReadRange:
+            request.keys.clear();
+            if (!reader.ReadString(request.begin) || !reader.ReadString(request.end) || !reader.ReadVarint(request.limit)) {
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+        if (!reader.IsEnd()) {
+            return false;
+        }
+        request.command = (mujinplc::PLCCommand)command;
+        return true;
+    }
+
+    rapidjson::MemoryPoolAllocator<> valueAllocator(mujinplc::s_jsonScratch.valueBuffer.data(), mujinplc::s_jsonScratch.valueBuffer.size());
+    rapidjson::MemoryPoolAllocator<> parseAllocator(mujinplc::s_jsonScratch.parseBuffer.data(), mujinplc::s_jsonScratch.parseBuffer.size());
+    mujinplc::PooledDocument doc(&valueAllocator, 1024, &parseAllocator);
+    if (!mujinplc::ParseJSON(data, size, doc) || !doc.HasMember("command") || !doc["command"].IsString()) {
+        return false;
+    }
+
+    const char* command = doc["command"].GetString();
+
+    // read command, expects a list of keys
+    if (std::strcmp(command, "read") == 0 &&
+        doc.HasMember("keys") &&
+        doc["keys"].IsArray()) {
+
+        ParseJSONKeys(doc["keys"], request.keys);
+        request.hasKeys = true;
+        request.command = mujinplc::PLCCommand_Read;
+        return true;
+    }
+
+    // write command, expects a dict of keyvalues
+    if (std::strcmp(command, "write") == 0 &&
+        doc.HasMember("keyvalues") &&
+        doc["keyvalues"].IsObject()) {
+
+        request.keys.clear();
+        ParseJSONKeyValues(doc["keyvalues"], request.keyvalues);
+        request.command = mujinplc::PLCCommand_Write;
+        return true;
+    }
+
+    // readmodified command, expects the sequence number returned by the previous readmodified and an optional list of keys
+    if (std::strcmp(command, "readmodified") == 0 &&
+        doc.HasMember("sequence") &&
+        doc["sequence"].IsUint64()) {
+
+        request.sequence = doc["sequence"].GetUint64();
+        if (doc.HasMember("keys") && doc["keys"].IsArray()) {
+            ParseJSONKeys(doc["keys"], request.keys);
+            request.hasKeys = true;
+        }
+        else {
+            request.keys.clear();
+        }
+        request.command = mujinplc::PLCCommand_ReadModified;
+        return true;
+    }
+
+    // snapshot command, expects an optional list of key prefixes
+    if (std::strcmp(command, "snapshot") == 0) {
+        request.keys.clear();
+        if (doc.HasMember("prefixes") && doc["prefixes"].IsArray()) {
+            ParseJSONKeys(doc["prefixes"], request.prefixes);
+        }
+        request.command = mujinplc::PLCCommand_Snapshot;
+        return true;
+    }
+
+    // batch command, expects a list of operations, each {"op": "read"|"write"|"cas", "key": ..., "expected": ..., "value": ...}
+    if (std::strcmp(command, "batch") == 0 &&
+        doc.HasMember("operations") &&
+        doc["operations"].IsArray()) {
+
+        request.keys.clear();
+        if (!ParseJSONOperations(doc["operations"], request.operations)) {
+            return false;
+        }
+        request.command = mujinplc::PLCCommand_Batch;
+        return true;
+    }
+
+    // stats command, no arguments
+    if (std::strcmp(command, "stats") == 0) {
+        request.keys.clear();
+        request.command = mujinplc::PLCCommand_Stats;
+        return true;
+    }
+
+    // readrange command, expects an optional first key, key after the last one and maximum number of keys
+    if (std::strcmp(command, "readrange") == 0) {
+        request.keys.clear();
+        if (doc.HasMember("begin") && doc["begin"].IsString()) {
+            request.begin.assign(doc["begin"].GetString(), doc["begin"].GetStringLength());
+        }
+        if (doc.HasMember("end") && doc["end"].IsString()) {
+            request.end.assign(doc["end"].GetString(), doc["end"].GetStringLength());
+        }
+        if (doc.HasMember("limit") && doc["limit"].IsUint64()) {
+            request.limit = doc["limit"].GetUint64();
+        }
+        request.command = mujinplc::PLCCommand_ReadRange;
+        return true;
+    }
+
+    return false;
+}
+
+void mujinplc::EncodeRequest(const mujinplc::PLCRequest& request, mujinplc::PLCEncoding encoding, std::string& data) {
+    data.clear();
+
+    if (encoding == mujinplc::PLCEncoding_Binary) {
+        data.push_back(char(mujinplc::PLCBinaryHeader));
+        data.push_back(char(request.command));
+        switch (request.command) {
+        case mujinplc::PLCCommand_Read:
+            WriteKeys(request.keys, data);
+            break;
+        case mujinplc::PLCCommand_Write:
+            WriteKeyValues(request.keyvalues, data);
+            break;
+        case mujinplc::PLCCommand_ReadModified:
+            WriteVarint(request.sequence, data);
+            data.push_back(request.hasKeys ? 1 : 0);
+            if (request.hasKeys) {
+                WriteKeys(request.keys, data);
+            }
+            break;
+        case mujinplc::PLCCommand_Snapshot:
+            WriteKeys(request.prefixes, data);
+            break;
+        case mujinplc::PLCCommand_Batch:
+            WriteOperations(request.operations, data);
+            break;
+        case mujinplc::PLCCommand_ReadRange:
+            WriteString(request.begin, data);
+            WriteString(request.end, data);
+            WriteVarint(request.limit, data);
+            break;
+        default:
+            break;
+        }
+        return;
+    }
+
+    mujinplc::s_jsonScratch.stream.data = &data;
+    rapidjson::Writer<mujinplc::StringOutputStream>& writer = mujinplc::s_jsonScratch.writer;
+    writer.Reset(mujinplc::s_jsonScratch.stream);
+    writer.StartObject();
+    writer.Key("command");
+    switch (request.command) {
+    case mujinplc::PLCCommand_Read:
+        writer.String("read");
+        writer.Key("keys");
+        WriteJSONKeys(request.keys, writer);
+        break;
+    case mujinplc::PLCCommand_Write:
+        writer.String("write");
+        writer.Key("keyvalues");
+        WriteJSONKeyValues(request.keyvalues, writer);
+        break;
+    case mujinplc::PLCCommand_ReadModified:
+        writer.String("readmodified");
+        writer.Key("sequence");
+        writer.Uint64(request.sequence);
+        if (request.hasKeys) {
+            writer.Key("keys");
+            WriteJSONKeys(request.keys, writer);
+        }
+        break;
+    case mujinplc::PLCCommand_Snapshot:
+        writer.String("snapshot");
+        writer.Key("prefixes");
+        WriteJSONKeys(request.prefixes, writer);
+        break;
+    case mujinplc::PLCCommand_Batch:
+        writer.String("batch");
+        writer.Key("operations");
+        WriteJSONOperations(request.operations, writer);
+        break;
+    case mujinplc::PLCCommand_Stats:
+        writer.String("stats");
+        break;
+    case mujinplc::PLCCommand_ReadRange:
+        writer.String("readrange");
+        writer.Key("begin");
+        writer.String(request.begin.c_str(), (rapidjson::SizeType)request.begin.size());
+        if (!request.end.empty()) {
+            writer.Key("end");
+            writer.String(request.end.c_str(), (rapidjson::SizeType)request.end.size());
+        }
+        if (request.limit != 0) {
+            writer.Key("limit");
+            writer.Uint64(request.limit);
+        }
+        break;
+    default:
+        writer.Null();
+        break;
+    }
+    writer.EndObject();
+}
+
+bool mujinplc::DecodeResponse(const char* data, size_t size, mujinplc::PLCResponse& response) {
+    response.hasKeyValues = false;
+    response.hasSequence = false;
+    response.sequence = 0;
+    response.hasResults = false;
+    response.hasStats = false;
+    response.stats.clear();
+
+    if (mujinplc::GetEncoding(data, size) == mujinplc::PLCEncoding_Binary) {
+        mujinplc::BinaryReader reader(data + 1, size - 1);
+        uint8_t flags;
+        if (!reader.ReadByte(flags)) {
+            return false;
+        }
+        response.hasKeyValues = (flags & 1) != 0;
+        if (!response.hasKeyValues) {
+            response.keyvalues.clear();
+        }
+        else if (!reader.ReadKeyValues(response.keyvalues)) {
+            return false;
+        }
+        response.hasSequence = (flags & 2) != 0;
+        if (response.hasSequence && !reader.ReadVarint(response.sequence)) {
+            return false;
+        }
+        response.hasResults = (flags & 4) != 0;
+        if (!response.hasResults) {
+            response.results.clear();
+        }
+        else if (!reader.ReadResults(response.results)) {
+            return false;
+        }
+        response.hasStats = (flags & 8) != 0;
+        if (response.hasStats && !reader.ReadString(response.stats)) {
+            return false;
+        }
+        return reader.IsEnd();
+    }
+
+    rapidjson::MemoryPoolAllocator<> valueAllocator(mujinplc::s_jsonScratch.valueBuffer.data(), mujinplc::s_jsonScratch.valueBuffer.size());
+    rapidjson::MemoryPoolAllocator<> parseAllocator(mujinplc::s_jsonScratch.parseBuffer.data(), mujinplc::s_jsonScratch.parseBuffer.size());
+    mujinplc::PooledDocument doc(&valueAllocator, 1024, &parseAllocator);
+    if (!mujinplc::ParseJSON(data, size, doc)) {
+        return false;
+    }
+    if (doc.HasMember("keyvalues") && doc["keyvalues"].IsObject()) {
+        ParseJSONKeyValues(doc["keyvalues"], response.keyvalues);
+        response.hasKeyValues = true;
+    }
+    else {
+        response.keyvalues.clear();
+    }
+    if (doc.HasMember("sequence") && doc["sequence"].IsUint64()) {
+        response.sequence = doc["sequence"].GetUint64();
+        response.hasSequence = true;
+    }
+    if (doc.HasMember("results") && doc["results"].IsArray()) {
+        ParseJSONResults(doc["results"], response.results);
+        response.hasResults = true;
+    }
+    else {
+        response.results.clear();
+    }
+    if (doc.HasMember("stats") && doc["stats"].IsObject()) {
+        // handed out as text like in the binary encoding, stats are rare enough for a writer of their own
+        mujinplc::StringOutputStream stream;
+        stream.data = &response.stats;
+        rapidjson::Writer<mujinplc::StringOutputStream> writer(stream);
+        doc["stats"].Accept(writer);
+        response.hasStats = true;
+    }
+    return true;
+}
+
+void mujinplc::EncodeResponse(const mujinplc::PLCResponse& response, mujinplc::PLCEncoding encoding, std::string& data) {
+    data.clear();
+
+    if (encoding == mujinplc::PLCEncoding_Binary) {
+        data.push_back(char(mujinplc::PLCBinaryHeader));
+        data.push_back(char((response.hasKeyValues ? 1 : 0) | (response.hasSequence ? 2 : 0) | (response.hasResults ? 4 : 0) | (response.hasStats ? 8 : 0)));
+        if (response.hasKeyValues) {
+            WriteKeyValues(response.keyvalues, data);
+        }
+        if (response.hasSequence) {
+            WriteVarint(response.sequence, data);
+        }
+        if (response.hasResults) {
+            WriteResults(response.results, data);
+        }
+        if (response.hasStats) {
+            WriteString(response.stats, data);
+        }
+        return;
+    }
+
+    mujinplc::s_jsonScratch.stream.data = &data;
+    rapidjson::Writer<mujinplc::StringOutputStream>& writer = mujinplc::s_jsonScratch.writer;
+    writer.Reset(mujinplc::s_jsonScratch.stream);
+    writer.StartObject();
+    if (response.hasKeyValues) {
+        writer.Key("keyvalues");
+        WriteJSONKeyValues(response.keyvalues, writer);
+    }
+    if (response.hasSequence) {
+        writer.Key("sequence");
+        writer.Uint64(response.sequence);
+    }
+    if (response.hasResults) {
+        writer.Key("results");
+        WriteJSONResults(response.results, writer);
+    }
+    if (response.hasStats) {
+        writer.Key("stats");
+        writer.RawValue(response.stats.data(), response.stats.size(), rapidjson::kObjectType);
+    }
+    writer.EndObject();
+}
+
+void mujinplc::EncodeUpdate(uint64_t sequence, const mujinplc::PLCValue& value, std::string& data) {
+    data.clear();
+    data.push_back(char(mujinplc::PLCBinaryHeader));
+    WriteVarint(sequence, data);
+    WriteValue(value, data);
+}
+
+bool mujinplc::DecodeUpdate(const char* data, size_t size, uint64_t& sequence, mujinplc::PLCValue& value) {
+    if (mujinplc::GetEncoding(data, size) != mujinplc::PLCEncoding_Binary) {
+        return false;
+    }
+    mujinplc::BinaryReader reader(data + 1, size - 1);
+    return reader.ReadVarint(sequence) && reader.ReadValue(value) && reader.IsEnd();
+}
@@ -0,0 +1,232 @@
+#include "mujinplc/plcreactor.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <stdexcept>
+#include <system_error>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <zmq.h>
+
+namespace mujinplc {
+
+/// how long to wait before binding an endpoint again that could not be bound
+static const std::chrono::milliseconds s_retryInterval(100);
+
+}
+
+mujinplc::PLCReactor::PLCReactor(void* ctx) : _ctx(ctx), _ownsContext(false), _wakeupFd(-1), _generation(0), _appliedGeneration(0), _running(false), _shutdown(false) {
+    _wakeupFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (_wakeupFd < 0) {
+        throw std::system_error(errno, std::generic_category(), "eventfd");
+    }
+    if (_ctx == NULL) {
+        _ctx = zmq_ctx_new();
+        if (_ctx == NULL) {
+            close(_wakeupFd);
+            throw std::runtime_error(zmq_strerror(zmq_errno()));
+        }
+        _ownsContext = true;
+    }
+}
+
+mujinplc::PLCReactor::~PLCReactor() {
+    Stop();
+    for (auto& server : _servers) {
+        server->_shutdown = true;
+        server->_StopPublisher();
+        server->_hosted = false;
+    }
+    _servers.clear();
+    close(_wakeupFd);
+    if (_ownsContext) {
+        zmq_ctx_destroy(_ctx);
+    }
+}
+
+void mujinplc::PLCReactor::Add(const std::shared_ptr<mujinplc::PLCServer>& server) {
+    if (server->_numWorkers > 1) {
+        throw std::invalid_argument("server of " + server->_endpoint + " has several workers, a reactor only serves single worker servers");
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (server->IsRunning()) {
+            throw std::invalid_argument("server of " + server->_endpoint + " is already running");
+        }
+        server->_hosted = true;
+        server->_shutdown = false;
+        server->_StartPublisher();
+        _servers.push_back(server);
+        _generation++;
+    }
+    _Wakeup();
+}
+
+void mujinplc::PLCReactor::Remove(const std::shared_ptr<mujinplc::PLCServer>& server) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto it = std::find(_servers.begin(), _servers.end(), server);
+    if (it == _servers.end()) {
+        return;
+    }
+    _servers.erase(it);
+    uint64_t generation = ++_generation;
+    _Wakeup();
+
+    // the socket belongs to the reactor thread, it is closed there
+    _condition.wait(lock, [this, generation] {
+        return !_running || _appliedGeneration >= generation;
+    });
+    lock.unlock();
+
+    server->_shutdown = true;
+    server->_StopPublisher();
+    server->_hosted = false;
+}
+
+size_t mujinplc::PLCReactor::GetNumServers() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _servers.size();
+}
+
+bool mujinplc::PLCReactor::IsRunning() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _running;
+}
+
+void mujinplc::PLCReactor::Start() {
+    Stop();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _running = true;
+        _shutdown = false;
+    }
+    _thread = std::thread(&mujinplc::PLCReactor::_RunThread, this);
+}
+
+void mujinplc::PLCReactor::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _shutdown = true;
+    }
+    _Wakeup();
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+void mujinplc::PLCReactor::_Wakeup() {
+    uint64_t value = 1;
+    // only fails when the counter would overflow, with plenty of wakeups pending already
+    ssize_t written = write(_wakeupFd, &value, sizeof(value));
+    (void)written;
+}
+
+void mujinplc::PLCReactor::_Update(std::vector<Endpoint>& endpoints) {
+    // endpoints of removed servers close their sockets here, on the thread that used them
+    std::vector<Endpoint> updated;
+    updated.reserve(_servers.size());
+    for (auto& server : _servers) {
+        auto it = std::find_if(endpoints.begin(), endpoints.end(), [&server](const Endpoint& endpoint) {
+            return endpoint.server == server;
+        });
+        if (it != endpoints.end()) {
+            updated.push_back(std::move(*it));
+        }
+        else {
+            updated.emplace_back();
+            updated.back().server = server;
+        }
+    }
+    endpoints.swap(updated);
+    updated.clear();
+    _appliedGeneration = _generation;
+}
+
+void mujinplc::PLCReactor::_RunThread() {
+    std::vector<Endpoint> endpoints;
+    std::vector<zmq_pollitem_t> items;
+    std::vector<Endpoint*> polled; ///< endpoint of every item after the wakeup
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _Update(endpoints);
+    }
+
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_shutdown) {
+                break;
+            }
+            if (_appliedGeneration != _generation) {
+                _Update(endpoints);
+                _condition.notify_all();
+            }
+        }
+
+        // bind what is not bound yet, and sleep no longer than until the next attempt
+        auto now = std::chrono::steady_clock::now();
+        long timeout = -1;
+        items.resize(1);
+        items[0].socket = NULL;
+        items[0].fd = _wakeupFd;
+        items[0].events = ZMQ_POLLIN;
+        items[0].revents = 0;
+        polled.clear();
+        for (auto& endpoint : endpoints) {
+            PLCServer& server = *endpoint.server;
+            if (!endpoint.session && now >= endpoint.retry) {
+                endpoint.session = server._OpenSession(server._ctx != NULL ? server._ctx : _ctx, server._endpoint, false);
+                if (!endpoint.session) {
+                    endpoint.retry = now + s_retryInterval;
+                }
+            }
+            if (!endpoint.session) {
+                long wait = (long)std::chrono::duration_cast<std::chrono::milliseconds>(endpoint.retry - now).count() + 1;
+                if (timeout < 0 || wait < timeout) {
+                    timeout = wait;
+                }
+                continue;
+            }
+            zmq_pollitem_t item;
+            item.socket = PLCServer::_GetSocket(*endpoint.session);
+            item.fd = 0;
+            item.events = ZMQ_POLLIN;
+            item.revents = 0;
+            items.push_back(item);
+            polled.push_back(&endpoint);
+        }
+
+        int rc = zmq_poll(items.data(), (int)items.size(), timeout);
+        if (rc < 0) {
+            if (zmq_errno() == ETERM) {
+                // the context of the sockets is gone, nothing can be served any more
+                break;
+            }
+            continue;
+        }
+
+        if (items[0].revents & ZMQ_POLLIN) {
+            uint64_t value;
+            ssize_t numRead = read(_wakeupFd, &value, sizeof(value));
+            (void)numRead;
+        }
+
+        // one request per socket and round, so that a busy client does not starve the others
+        for (size_t index = 0; index < polled.size(); ++index) {
+            if ((items[1 + index].revents & ZMQ_POLLIN) == 0) {
+                continue;
+            }
+            Endpoint& endpoint = *polled[index];
+            if (!endpoint.server->_ServeRequest(*endpoint.session)) {
+                endpoint.session.reset();
+                endpoint.retry = now;
+            }
+        }
+    }
+
+    endpoints.clear();
+    std::lock_guard<std::mutex> lock(_mutex);
+    _running = false;
+    _appliedGeneration = _generation;
+    _condition.notify_all();
+}
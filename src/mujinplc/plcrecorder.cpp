@@ -0,0 +1,155 @@
+#include "mujinplc/plcrecorder.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+namespace mujinplc {
+
+static const uint32_t s_recordingMagic = 0x4d504c52; // "MPLR"
+static const uint32_t s_recordingVersion = 1;
+
+static void AppendVarint(uint64_t value, std::string& data) {
+    while (value >= 0x80) {
+        data.push_back(char((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    data.push_back(char(value));
+}
+
+}
+
+mujinplc::PLCRecorder::PLCRecorder(const std::string& filename, size_t maxBufferedBytes) : _file(NULL), _start(std::chrono::steady_clock::now()), _maxBufferedBytes(maxBufferedBytes), _numBuffered(0), _numWritten(0), _numDropped(0), _shutdown(false) {
+    _file = std::fopen(filename.c_str(), "wb");
+    if (_file == NULL) {
+        throw std::system_error(errno, std::generic_category(), "fopen " + filename);
+    }
+    uint32_t header[2] = {mujinplc::s_recordingMagic, mujinplc::s_recordingVersion};
+    std::fwrite(header, sizeof(header), 1, _file);
+
+    _thread = std::thread(&mujinplc::PLCRecorder::_RunThread, this);
+}
+
+mujinplc::PLCRecorder::~PLCRecorder() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _shutdown = true;
+    }
+    _condition.notify_all();
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+    std::fclose(_file);
+}
+
+void mujinplc::PLCRecorder::Record(const std::chrono::steady_clock::time_point& received, const std::chrono::steady_clock::time_point& replied, const char* request, size_t requestSize, const char* response, size_t responseSize) {
+    uint64_t time = received > _start ? std::chrono::duration_cast<std::chrono::nanoseconds>(received - _start).count() : 0;
+    uint64_t duration = replied > received ? std::chrono::duration_cast<std::chrono::nanoseconds>(replied - received).count() : 0;
+
+    bool wakeup;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_buffer.size() + requestSize + responseSize > _maxBufferedBytes) {
+            _numDropped++;
+            return;
+        }
+        wakeup = _buffer.empty();
+        mujinplc::AppendVarint(time, _buffer);
+        mujinplc::AppendVarint(duration, _buffer);
+        mujinplc::AppendVarint(requestSize, _buffer);
+        _buffer.append(request, requestSize);
+        mujinplc::AppendVarint(responseSize, _buffer);
+        _buffer.append(response, responseSize);
+        _numBuffered++;
+    }
+    if (wakeup) {
+        _condition.notify_all();
+    }
+}
+
+void mujinplc::PLCRecorder::Flush() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    uint64_t numBuffered = _numBuffered;
+    _condition.notify_all();
+    _condition.wait(lock, [&] { return _numWritten >= numBuffered || _shutdown; });
+}
+
+uint64_t mujinplc::PLCRecorder::GetNumRecorded() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _numBuffered;
+}
+
+uint64_t mujinplc::PLCRecorder::GetNumDropped() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _numDropped;
+}
+
+void mujinplc::PLCRecorder::_RunThread() {
+    // swap the buffer out and write it without the lock, so recording goes on meanwhile
+    std::string buffer;
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        _condition.wait(lock, [this] { return _shutdown || !_buffer.empty(); });
+        if (_buffer.empty()) {
+            // shutdown, and everything written
+            return;
+        }
+
+        buffer.swap(_buffer);
+        uint64_t numBuffered = _numBuffered;
+        lock.unlock();
+        std::fwrite(buffer.data(), 1, buffer.size(), _file);
+        std::fflush(_file);
+        buffer.clear();
+        lock.lock();
+
+        _numWritten = numBuffered;
+        _condition.notify_all();
+    }
+}
+
+mujinplc::PLCRecordReader::PLCRecordReader(const std::string& filename) : _file(NULL) {
+    _file = std::fopen(filename.c_str(), "rb");
+    if (_file == NULL) {
+        throw std::system_error(errno, std::generic_category(), "fopen " + filename);
+    }
+    uint32_t header[2];
+    if (std::fread(header, sizeof(header), 1, _file) != 1 || header[0] != mujinplc::s_recordingMagic || header[1] != mujinplc::s_recordingVersion) {
+        std::fclose(_file);
+        throw std::runtime_error(filename + " is not a recording");
+    }
+}
+
+mujinplc::PLCRecordReader::~PLCRecordReader() {
+    std::fclose(_file);
+}
+
+bool mujinplc::PLCRecordReader::Read(mujinplc::PLCRecord& record) {
+    return _ReadVarint(record.time) && _ReadVarint(record.duration) && _ReadBytes(record.request) && _ReadBytes(record.response);
+}
+
+bool mujinplc::PLCRecordReader::_ReadVarint(uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int byte = std::getc(_file);
+        if (byte == EOF) {
+            return false;
+        }
+        value |= uint64_t(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool mujinplc::PLCRecordReader::_ReadBytes(std::string& bytes) {
+    // a length beyond any zmq message is a torn record
+    uint64_t length;
+    if (!_ReadVarint(length) || length > (uint64_t(1) << 32)) {
+        return false;
+    }
+    bytes.resize(length);
+    return length == 0 || std::fread(&bytes[0], 1, length, _file) == length;
+}
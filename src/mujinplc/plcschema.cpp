@@ -0,0 +1,52 @@
+#include "mujinplc/plcschema.h"
+
+#include <stdexcept>
+
+const uint32_t mujinplc::PLCSchema::InvalidSlot;
+
+mujinplc::PLCSchema::PLCSchema(const mujinplc::PLCSignalInfo* signals, size_t numSignals) : _signals(signals, signals + numSignals) {
+    _names.reserve(numSignals);
+    for (size_t index = 0; index < numSignals; ++index) {
+        if (signals[index].slot != index) {
+            throw std::invalid_argument(std::string("signal ") + signals[index].name + " is not in slot " + std::to_string(signals[index].slot));
+        }
+        _names.push_back(signals[index].name);
+        if (!_slots.emplace(_names.back(), (uint32_t)index).second) {
+            throw std::invalid_argument("signal " + _names.back() + " is in the schema twice");
+        }
+    }
+    // point to our copies, the caller's array does not need to outlive the schema
+    for (size_t index = 0; index < numSignals; ++index) {
+        _signals[index].name = _names[index].c_str();
+    }
+}
+
+mujinplc::PLCSchema::~PLCSchema() {
+}
+
+size_t mujinplc::PLCSchema::GetNumSignals() const {
+    return _signals.size();
+}
+
+const mujinplc::PLCSignalInfo& mujinplc::PLCSchema::GetSignal(uint32_t slot) const {
+    return _signals.at(slot);
+}
+
+const std::string& mujinplc::PLCSchema::GetName(uint32_t slot) const {
+    return _names.at(slot);
+}
+
+uint32_t mujinplc::PLCSchema::Find(const std::string& name) const {
+    auto it = _slots.find(name);
+    return it != _slots.end() ? it->second : InvalidSlot;
+}
+
+bool mujinplc::PLCSchema::IsWritableByPLC(const std::string& key, const mujinplc::PLCValue& value, bool strict, uint32_t& slot) const {
+    slot = Find(key);
+    if (slot == InvalidSlot) {
+        return !strict;
+    }
+    // null clears a signal, whatever its type
+    const mujinplc::PLCSignalInfo& signal = _signals[slot];
+    return signal.direction != mujinplc::PLCSignalDirection_Output && (value.IsNull() || value.GetType() == signal.type);
+}
@@ -1,10 +1,17 @@
 #include "mujinplc/plcserver.h"
 
 #include <vector>
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
 #include <zmq.h>
-#include <rapidjson/document.h>
-#include <rapidjson/stringbuffer.h>
-#include <rapidjson/writer.h>
+
+#include "mujinplc/plccontroller.h"
+#include "mujinplc/plcmetrics.h"
+#include "mujinplc/plcprotocol.h"
+#include "mujinplc/plcrecorder.h"
 
 namespace mujinplc {
 
@@ -19,21 +26,134 @@ private:
     int _errno;
 };
 
+/// largest reply sent as a copy, zmq stores messages up to 33 bytes inside zmq_msg_t without allocating
+static const size_t s_maxInlineReplySize = 32;
+
+/// reply buffers handed over to zmq without a copy, given back to the pool once zmq has sent them.
+/// shared, so that buffers still queued in zmq can come back after the socket is gone.
+class ZMQBufferPool : public std::enable_shared_from_this<ZMQBufferPool> {
+public:
+    struct Buffer {
+        std::string data;
+        std::shared_ptr<ZMQBufferPool> pool; ///< keeps the pool alive while the buffer is in use
+    };
+
+    virtual ~ZMQBufferPool();
+
+    Buffer* Acquire();
+
+    // zmq_free_fn, hint is the buffer
+    static void Release(void* data, void* hint);
+
+private:
+    std::mutex _mutex;
+    std::vector<Buffer*> _buffers; ///< buffers not in use
+};
+
 class ZMQServerSocket {
 public:
-    ZMQServerSocket(void* ctxin, const std::string& endpoint);
+    // a REP socket bound to the endpoint, or for a worker, a PAIR socket connected to the router which carries the reply envelope explicitly
+    ZMQServerSocket(void* ctxin, const std::string& endpoint, bool worker=false);
     virtual ~ZMQServerSocket();
 
     bool Poll(long timeout);
-    void Receive(rapidjson::Document& doc);
-    void Send(const rapidjson::Value& value);
+
+    void* GetSocket() const {
+        return _socket;
+    }
+
+    // data points into the received message, valid until the next Receive
+    void Receive(const char*& data, size_t& size);
+
+    // buffer to encode the reply into, Send hands it over to zmq without a copy
+    std::string& GetReplyBuffer();
+    void Send();
 
 private:
     void* _ctx;
     void* _socket;
+    bool _worker;
+    std::vector<std::string> _envelope; ///< routing frames of the request being served, only for workers
     zmq_msg_t _message;
+    std::shared_ptr<ZMQBufferPool> _pool;
+    ZMQBufferPool::Buffer* _reply; ///< acquired by GetReplyBuffer, owned by zmq after Send
 };
 
+/// frontend of the multi worker mode, a ROUTER socket bound to the endpoint and one PAIR socket per worker.
+/// clients are assigned to a worker by a hash of their routing id, so the requests of one client stay in order.
+class ZMQRouter {
+public:
+    ZMQRouter(void* ctx, const std::string& endpoint, const std::vector<std::string>& workerEndpoints);
+    virtual ~ZMQRouter();
+
+    // forward messages in both directions, returns false if nothing arrived within the timeout
+    bool Route(long timeout);
+
+private:
+    void _Forward(void* from, void* to, zmq_msg_t& message); ///< forwards the rest of a multipart message whose first frame is already received
+
+    void* _frontend;
+    std::vector<void*> _backends;
+    std::vector<zmq_pollitem_t> _items;
+};
+
+/// PUB socket bound to the endpoint
+class ZMQPublisherSocket {
+public:
+    ZMQPublisherSocket(void* ctxin, const std::string& endpoint);
+    virtual ~ZMQPublisherSocket();
+
+    // send a message of two frames, the topic subscribers filter on and the data
+    void Publish(const std::string& topic, const std::string& data);
+
+private:
+    void* _ctx;
+    void* _socket;
+};
+
+/// collects the modifications of the memory for the publisher thread
+class PLCPublisherObserver : public PLCMemoryObserver {
+public:
+    struct Batch {
+        uint64_t sequence;
+        std::map<std::string, PLCValue> keyvalues;
+    };
+
+    virtual void MemoryModified(const std::map<std::string, PLCValue>& keyvalues) override;
+    virtual void MemoryModified(uint64_t sequence, const std::map<std::string, PLCValue>& keyvalues) override;
+
+    // take the collected batches, waits up to timeout if there are none, returns false if there are still none
+    bool Wait(std::vector<Batch>& batches, std::chrono::milliseconds timeout);
+
+    // drop the collected batches, while unbound nobody can be subscribed to them
+    void Clear();
+
+private:
+    static const size_t MaxBatches = 256; ///< further batches are merged into the last one, keeping the latest value of each key
+
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::vector<Batch> _batches; ///< protected by _mutex
+};
+
+/// socket of an endpoint being served and the scratch space of its requests, reused so that serving a request of
+/// the same shape as the previous one does not allocate
+class PLCServerSession {
+public:
+    PLCServerSession(void* ctx, const std::string& endpoint, bool worker, const std::shared_ptr<PLCRecorder>& recorder, const std::shared_ptr<PLCSchema>& schema) : socket(ctx, endpoint, worker), recorder(recorder), schema(schema) {
+    }
+
+    ZMQServerSocket socket;
+    PLCRequest request;
+    PLCResponse response;
+    std::shared_ptr<PLCRecorder> recorder; ///< taken when opened, configuration changes apply to the next session
+    std::shared_ptr<PLCSchema> schema;
+    std::vector<std::pair<PLCKeyHandle, PLCValue>> handlevalues;
+};
+
+/// execute a decoded request against the memory and fill the response, stats are those of the server and the memory
+static void HandleRequest(PLCMemory& memory, const PLCServerMetrics& metrics, const std::vector<std::weak_ptr<PLCController>>& controllers, const PLCRequest& request, PLCResponse& response);
+
 }
 
 mujinplc::ZMQError::ZMQError() : _errno(zmq_errno()) {
@@ -46,7 +166,43 @@ const char* mujinplc::ZMQError::what() const noexcept {
     return zmq_strerror(_errno);
 }
 
-mujinplc::ZMQServerSocket::ZMQServerSocket(void* ctx, const std::string& endpoint) : _ctx(NULL), _socket(NULL) {
+mujinplc::ZMQBufferPool::~ZMQBufferPool() {
+    for (auto& buffer : _buffers) {
+        delete buffer;
+    }
+    _buffers.clear();
+}
+
+mujinplc::ZMQBufferPool::Buffer* mujinplc::ZMQBufferPool::Acquire() {
+    Buffer* buffer = NULL;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_buffers.empty()) {
+            buffer = _buffers.back();
+            _buffers.pop_back();
+        }
+    }
+    if (buffer == NULL) {
+        buffer = new Buffer();
+    }
+    buffer->pool = shared_from_this();
+    return buffer;
+}
+
+void mujinplc::ZMQBufferPool::Release(void* /*data*/, void* hint) {
+    Buffer* buffer = (Buffer*)hint;
+    std::shared_ptr<ZMQBufferPool> pool;
+    pool.swap(buffer->pool);
+
+    std::lock_guard<std::mutex> lock(pool->_mutex);
+    pool->_buffers.push_back(buffer);
+}
+
+mujinplc::ZMQServerSocket::ZMQServerSocket(void* ctx, const std::string& endpoint, bool worker) : _ctx(NULL), _socket(NULL), _worker(worker), _pool(std::make_shared<mujinplc::ZMQBufferPool>()), _reply(NULL) {
+    if (zmq_msg_init(&_message)) {
+        throw mujinplc::ZMQError();
+    }
+
     if (!ctx) {
         _ctx = zmq_ctx_new();
         if (_ctx == NULL) {
@@ -55,27 +211,48 @@ mujinplc::ZMQServerSocket::ZMQServerSocket(void* ctx, const std::string& endpoin
         ctx = _ctx;
     }
 
-    _socket = zmq_socket(ctx, ZMQ_REP);
-    if (_socket == NULL) {
-        throw mujinplc::ZMQError();
-    }
+    try {
+        _socket = zmq_socket(ctx, _worker ? ZMQ_PAIR : ZMQ_REP);
+        if (_socket == NULL) {
+            throw mujinplc::ZMQError();
+        }
 
-    int linger = 100;
-    if (zmq_setsockopt(_socket, ZMQ_LINGER, &linger, sizeof(linger))) {
-        throw mujinplc::ZMQError();
-    }
+        int linger = 100;
+        if (zmq_setsockopt(_socket, ZMQ_LINGER, &linger, sizeof(linger))) {
+            throw mujinplc::ZMQError();
+        }
 
-    int sndhwm = 2;
-    if (zmq_setsockopt(_socket, ZMQ_SNDHWM, &sndhwm, sizeof(sndhwm))) {
-        throw mujinplc::ZMQError();
-    }
+        int sndhwm = 2;
+        if (zmq_setsockopt(_socket, ZMQ_SNDHWM, &sndhwm, sizeof(sndhwm))) {
+            throw mujinplc::ZMQError();
+        }
 
-    if (zmq_bind(_socket, endpoint.c_str())) {
-        throw mujinplc::ZMQError();
+        if (_worker) {
+            if (zmq_connect(_socket, endpoint.c_str())) {
+                throw mujinplc::ZMQError();
+            }
+        }
+        else if (zmq_bind(_socket, endpoint.c_str())) {
+            throw mujinplc::ZMQError();
+        }
+    } catch (const mujinplc::ZMQError&) {
+        // opening is retried, e.g. while the endpoint is still bound by someone else, so do not leak the attempts
+        if (_socket) {
+            zmq_close(_socket);
+        }
+        if (_ctx) {
+            zmq_ctx_destroy(_ctx);
+        }
+        zmq_msg_close(&_message);
+        throw;
     }
 }
 
 mujinplc::ZMQServerSocket::~ZMQServerSocket() {
+    if (_reply) {
+        mujinplc::ZMQBufferPool::Release(NULL, _reply);
+        _reply = NULL;
+    }
     zmq_msg_close(&_message);
     if (_socket) {
         zmq_close(_socket);
@@ -100,7 +277,7 @@ bool mujinplc::ZMQServerSocket::Poll(long timeout) {
     return rc > 0;
 }
 
-void mujinplc::ZMQServerSocket::Receive(rapidjson::Document& doc) {
+void mujinplc::ZMQServerSocket::Receive(const char*& data, size_t& size) {
     zmq_msg_close(&_message);
     if (zmq_msg_init(&_message)) {
         throw mujinplc::ZMQError();
@@ -111,22 +288,359 @@ void mujinplc::ZMQServerSocket::Receive(rapidjson::Document& doc) {
         throw mujinplc::ZMQError();
     }
 
-    std::string data((char*)zmq_msg_data(&_message), zmq_msg_size(&_message));
-    doc.Parse<rapidjson::kParseFullPrecisionFlag>(data.c_str());
+    // for workers, everything before the last frame is the envelope to send the reply back with
+    _envelope.clear();
+    while (_worker && zmq_msg_more(&_message)) {
+        _envelope.emplace_back((char*)zmq_msg_data(&_message), zmq_msg_size(&_message));
+        if (zmq_msg_recv(&_message, _socket, ZMQ_NOBLOCK) < 0) {
+            throw mujinplc::ZMQError();
+        }
+    }
+
+    data = (const char*)zmq_msg_data(&_message);
+    size = zmq_msg_size(&_message);
 }
 
-void mujinplc::ZMQServerSocket::Send(const rapidjson::Value& value) {
-    rapidjson::StringBuffer stringbuffer;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(stringbuffer);
-    value.Accept(writer);
+std::string& mujinplc::ZMQServerSocket::GetReplyBuffer() {
+    if (!_reply) {
+        _reply = _pool->Acquire();
+    }
+    return _reply->data;
+}
+
+void mujinplc::ZMQServerSocket::Send() {
+    GetReplyBuffer();
+
+    for (auto& frame : _envelope) {
+        if (zmq_send(_socket, frame.data(), frame.size(), ZMQ_SNDMORE) < 0) {
+            throw mujinplc::ZMQError();
+        }
+    }
+
+    // zmq copies a reply this small into the message itself, which allocates nothing and keeps the buffer for the next one.
+    // larger replies are handed over without a copy, for those zmq mallocs a reference count.
+    if (_reply->data.size() <= s_maxInlineReplySize) {
+        if (zmq_send(_socket, _reply->data.data(), _reply->data.size(), ZMQ_NOBLOCK) < 0) {
+            throw mujinplc::ZMQError();
+        }
+        return;
+    }
+
+    // from here on zmq owns the buffer and releases it to the pool once sent
+    ZMQBufferPool::Buffer* reply = _reply;
+    _reply = NULL;
+
+    zmq_msg_t message;
+    if (zmq_msg_init_data(&message, &reply->data[0], reply->data.size(), &mujinplc::ZMQBufferPool::Release, reply)) {
+        mujinplc::ZMQBufferPool::Release(NULL, reply);
+        throw mujinplc::ZMQError();
+    }
 
-    int nbytes = zmq_send(_socket, stringbuffer.GetString(), stringbuffer.GetSize(), ZMQ_NOBLOCK);
+    int nbytes = zmq_msg_send(&message, _socket, ZMQ_NOBLOCK);
     if (nbytes < 0) {
+        mujinplc::ZMQError error;
+        zmq_msg_close(&message);
+        throw error;
+    }
+}
+
+mujinplc::ZMQPublisherSocket::ZMQPublisherSocket(void* ctx, const std::string& endpoint) : _ctx(NULL), _socket(NULL) {
+    if (!ctx) {
+        _ctx = zmq_ctx_new();
+        if (_ctx == NULL) {
+            throw mujinplc::ZMQError();
+        }
+        ctx = _ctx;
+    }
+
+    try {
+        _socket = zmq_socket(ctx, ZMQ_PUB);
+        if (_socket == NULL) {
+            throw mujinplc::ZMQError();
+        }
+
+        int linger = 100;
+        if (zmq_setsockopt(_socket, ZMQ_LINGER, &linger, sizeof(linger))) {
+            throw mujinplc::ZMQError();
+        }
+
+        if (zmq_bind(_socket, endpoint.c_str())) {
+            throw mujinplc::ZMQError();
+        }
+    } catch (const mujinplc::ZMQError&) {
+        // binding is retried while the endpoint is busy, so do not leak the attempts
+        if (_socket) {
+            zmq_close(_socket);
+        }
+        if (_ctx) {
+            zmq_ctx_destroy(_ctx);
+        }
+        throw;
+    }
+}
+
+mujinplc::ZMQPublisherSocket::~ZMQPublisherSocket() {
+    if (_socket) {
+        zmq_close(_socket);
+        _socket = NULL;
+    }
+    if (_ctx) {
+        zmq_ctx_destroy(_ctx);
+        _ctx = NULL;
+    }
+}
+
+void mujinplc::ZMQPublisherSocket::Publish(const std::string& topic, const std::string& data) {
+    if (zmq_send(_socket, topic.data(), topic.size(), ZMQ_SNDMORE) < 0) {
+        throw mujinplc::ZMQError();
+    }
+    if (zmq_send(_socket, data.data(), data.size(), 0) < 0) {
         throw mujinplc::ZMQError();
     }
 }
 
-mujinplc::PLCServer::PLCServer(const std::shared_ptr<mujinplc::PLCMemory>& memory, void* ctx, const std::string& endpoint) : _shutdown(true), _memory(memory), _ctx(ctx), _endpoint(endpoint) {
+const size_t mujinplc::PLCPublisherObserver::MaxBatches;
+
+void mujinplc::PLCPublisherObserver::MemoryModified(const std::map<std::string, mujinplc::PLCValue>& /*keyvalues*/) {
+}
+
+void mujinplc::PLCPublisherObserver::MemoryModified(uint64_t sequence, const std::map<std::string, mujinplc::PLCValue>& keyvalues) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_batches.size() >= MaxBatches) {
+            // the publisher fell behind, subscribers only need the latest values to catch up
+            Batch& last = _batches.back();
+            last.sequence = sequence;
+            for (auto& keyvalue : keyvalues) {
+                last.keyvalues[keyvalue.first] = keyvalue.second;
+            }
+        }
+        else {
+            _batches.emplace_back();
+            _batches.back().sequence = sequence;
+            _batches.back().keyvalues = keyvalues;
+        }
+    }
+    _condition.notify_one();
+}
+
+bool mujinplc::PLCPublisherObserver::Wait(std::vector<Batch>& batches, std::chrono::milliseconds timeout) {
+    batches.clear();
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!_condition.wait_for(lock, timeout, [this] { return !_batches.empty(); })) {
+        return false;
+    }
+    batches.swap(_batches);
+    return true;
+}
+
+void mujinplc::PLCPublisherObserver::Clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _batches.clear();
+}
+
+mujinplc::ZMQRouter::ZMQRouter(void* ctx, const std::string& endpoint, const std::vector<std::string>& workerEndpoints) : _frontend(NULL) {
+    try {
+        _frontend = zmq_socket(ctx, ZMQ_ROUTER);
+        if (_frontend == NULL) {
+            throw mujinplc::ZMQError();
+        }
+
+        int linger = 100;
+        if (zmq_setsockopt(_frontend, ZMQ_LINGER, &linger, sizeof(linger))) {
+            throw mujinplc::ZMQError();
+        }
+
+        if (zmq_bind(_frontend, endpoint.c_str())) {
+            throw mujinplc::ZMQError();
+        }
+
+        for (auto& workerEndpoint : workerEndpoints) {
+            void* backend = zmq_socket(ctx, ZMQ_PAIR);
+            if (backend == NULL) {
+                throw mujinplc::ZMQError();
+            }
+            _backends.push_back(backend);
+
+            if (zmq_setsockopt(backend, ZMQ_LINGER, &linger, sizeof(linger))) {
+                throw mujinplc::ZMQError();
+            }
+
+            if (zmq_bind(backend, workerEndpoint.c_str())) {
+                throw mujinplc::ZMQError();
+            }
+        }
+    } catch (const mujinplc::ZMQError&) {
+        for (auto& backend : _backends) {
+            zmq_close(backend);
+        }
+        if (_frontend) {
+            zmq_close(_frontend);
+        }
+        throw;
+    }
+
+    _items.resize(1 + _backends.size());
+    _items[0].socket = _frontend;
+    _items[0].events = ZMQ_POLLIN;
+    for (size_t index = 0; index < _backends.size(); ++index) {
+        _items[1 + index].socket = _backends[index];
+        _items[1 + index].events = ZMQ_POLLIN;
+    }
+}
+
+mujinplc::ZMQRouter::~ZMQRouter() {
+    for (auto& backend : _backends) {
+        zmq_close(backend);
+    }
+    _backends.clear();
+    if (_frontend) {
+        zmq_close(_frontend);
+        _frontend = NULL;
+    }
+}
+
+bool mujinplc::ZMQRouter::Route(long timeout) {
+    int rc = zmq_poll(_items.data(), (int)_items.size(), timeout);
+    if (rc < 0) {
+        throw mujinplc::ZMQError();
+    }
+    if (rc == 0) {
+        return false;
+    }
+
+    zmq_msg_t message;
+    if (zmq_msg_init(&message)) {
+        throw mujinplc::ZMQError();
+    }
+
+    try {
+        // request from a client, the first frame is its routing id
+        if (_items[0].revents & ZMQ_POLLIN) {
+            if (zmq_msg_recv(&message, _frontend, ZMQ_NOBLOCK) < 0) {
+                throw mujinplc::ZMQError();
+            }
+
+            // fnv-1a of the routing id
+            uint32_t hash = 2166136261u;
+            const unsigned char* data = (const unsigned char*)zmq_msg_data(&message);
+            for (size_t index = 0; index < zmq_msg_size(&message); ++index) {
+                hash = (hash ^ data[index]) * 16777619u;
+            }
+            _Forward(_frontend, _backends[hash % _backends.size()], message);
+        }
+
+        // reply from a worker, already carries the envelope
+        for (size_t index = 0; index < _backends.size(); ++index) {
+            if (_items[1 + index].revents & ZMQ_POLLIN) {
+                if (zmq_msg_recv(&message, _backends[index], ZMQ_NOBLOCK) < 0) {
+                    throw mujinplc::ZMQError();
+                }
+                _Forward(_backends[index], _frontend, message);
+            }
+        }
+    } catch (const mujinplc::ZMQError&) {
+        zmq_msg_close(&message);
+        throw;
+    }
+
+    zmq_msg_close(&message);
+    return true;
+}
+
+void mujinplc::ZMQRouter::_Forward(void* from, void* to, zmq_msg_t& message) {
+    while (true) {
+        bool more = zmq_msg_more(&message);
+        if (zmq_msg_send(&message, to, more ? ZMQ_SNDMORE : 0) < 0) {
+            throw mujinplc::ZMQError();
+        }
+        if (!more) {
+            return;
+        }
+        if (zmq_msg_recv(&message, from, ZMQ_NOBLOCK) < 0) {
+            throw mujinplc::ZMQError();
+        }
+    }
+}
+
+void mujinplc::HandleRequest(mujinplc::PLCMemory& memory, const mujinplc::PLCServerMetrics& metrics, const std::vector<std::weak_ptr<mujinplc::PLCController>>& controllers, const mujinplc::PLCRequest& request, mujinplc::PLCResponse& response) {
+    switch (request.command) {
+    case mujinplc::PLCCommand_Read:
+        memory.Read(request.keys, response.keyvalues);
+        response.hasKeyValues = true;
+        break;
+
+    case mujinplc::PLCCommand_ReadModified: {
+        std::map<std::string, mujinplc::PLCValue> modifications;
+        response.sequence = memory.ReadModifiedSince(request.sequence, modifications);
+        response.hasSequence = true;
+        response.hasKeyValues = true;
+        response.keyvalues.clear();
+
+        // only keep the requested keys
+        if (request.hasKeys) {
+            for (auto& key : request.keys) {
+                auto it = modifications.find(key);
+                if (it != modifications.end()) {
+                    response.keyvalues.push_back(*it);
+                }
+            }
+        }
+        else {
+            response.keyvalues.assign(modifications.begin(), modifications.end());
+        }
+        break;
+    }
+
+    case mujinplc::PLCCommand_Write:
+        memory.Write(request.keyvalues);
+        break;
+
+    case mujinplc::PLCCommand_Batch:
+        memory.Execute(request.operations, response.results);
+        response.hasResults = true;
+        break;
+
+    case mujinplc::PLCCommand_Stats:
+        response.stats = "{\"server\": ";
+        metrics.Write(response.stats);
+        response.stats += ", \"memory\": ";
+        memory.GetMetrics().Write(response.stats);
+        response.stats += ", \"controllers\": [";
+        for (size_t index = 0; index < controllers.size(); ++index) {
+            if (index > 0) {
+                response.stats += ", ";
+            }
+            if (auto controller = controllers[index].lock()) {
+                controller->GetMetrics().Write(response.stats);
+            }
+            else {
+                response.stats += "null";
+            }
+        }
+        response.stats += "]}";
+        response.hasStats = true;
+        break;
+
+    case mujinplc::PLCCommand_Snapshot:
+        response.sequence = memory.ReadPrefixes(request.prefixes, response.keyvalues);
+        response.hasSequence = true;
+        response.hasKeyValues = true;
+        break;
+
+    case mujinplc::PLCCommand_ReadRange:
+        response.sequence = memory.ReadRange(request.begin, request.end, response.keyvalues, (size_t)request.limit);
+        response.hasSequence = true;
+        response.hasKeyValues = true;
+        break;
+
+    default:
+        break;
+    }
+}
+
+mujinplc::PLCServer::PLCServer(const std::shared_ptr<mujinplc::PLCMemory>& memory, void* ctx, const std::string& endpoint, size_t numWorkers, const std::string& publisherEndpoint) : _shutdown(true), _hosted(false), _memory(memory), _ctx(ctx), _endpoint(endpoint), _numWorkers(numWorkers), _publisherEndpoint(publisherEndpoint), _strictSchema(false) {
 }
 
 mujinplc::PLCServer::~PLCServer() {
@@ -137,113 +651,302 @@ bool mujinplc::PLCServer::IsRunning() const {
     return !_shutdown || _thread.joinable();
 }
 
+void mujinplc::PLCServer::SetRecorder(const std::shared_ptr<mujinplc::PLCRecorder>& recorder) {
+    _recorder = recorder;
+}
+
+void mujinplc::PLCServer::AddController(const std::shared_ptr<mujinplc::PLCController>& controller) {
+    _controllers.push_back(controller);
+}
+
+void mujinplc::PLCServer::SetSchema(const std::shared_ptr<mujinplc::PLCSchema>& schema, bool strict) {
+    _signalHandles.clear();
+    if (!!schema) {
+        std::vector<std::string> names;
+        for (uint32_t slot = 0; slot < schema->GetNumSignals(); ++slot) {
+            names.push_back(schema->GetName(slot));
+        }
+        _memory->GetKeyHandles(names, _signalHandles);
+    }
+    _schema = schema;
+    _strictSchema = strict;
+}
+
+bool mujinplc::PLCServer::_CheckSchema(const mujinplc::PLCSchema& schema, const mujinplc::PLCRequest& request, std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>>& handlevalues) const {
+    handlevalues.clear();
+    uint32_t slot;
+    switch (request.command) {
+    case mujinplc::PLCCommand_Write: {
+        bool resolved = true;
+        for (auto& keyvalue : request.keyvalues) {
+            if (!schema.IsWritableByPLC(keyvalue.first, keyvalue.second, _strictSchema, slot)) {
+                handlevalues.clear();
+                return false;
+            }
+            if (slot == mujinplc::PLCSchema::InvalidSlot) {
+                resolved = false;
+            }
+            else if (resolved) {
+                handlevalues.emplace_back(_signalHandles[slot], keyvalue.second);
+            }
+        }
+        if (!resolved) {
+            handlevalues.clear();
+        }
+        return true;
+    }
+
+    case mujinplc::PLCCommand_Batch:
+        for (auto& operation : request.operations) {
+            if (operation.type != mujinplc::PLCOperationType_Read && !schema.IsWritableByPLC(operation.key, operation.value, _strictSchema, slot)) {
+                return false;
+            }
+        }
+        return true;
+
+    default:
+        return true;
+    }
+}
+
 void mujinplc::PLCServer::Start() {
+    if (_hosted) {
+        throw std::runtime_error("server of " + _endpoint + " is served by a reactor, remove it from there first");
+    }
     Stop();
 
     _shutdown = false;
     _thread = std::thread(&mujinplc::PLCServer::_RunThread, this);
+    _StartPublisher();
 }
 
 void mujinplc::PLCServer::SetStop() {
+    if (_hosted) {
+        return;
+    }
     _shutdown = true;
 }
 
 void mujinplc::PLCServer::Stop() {
+    if (_hosted) {
+        return;
+    }
     SetStop();
     if (_thread.joinable()) {
         _thread.join();
     }
+    _StopPublisher();
+}
+
+mujinplc::PLCServerMetrics& mujinplc::PLCServer::GetMetrics() {
+    return _metrics;
+}
+
+void mujinplc::PLCServer::_StartPublisher() {
+    if (!_publisherEndpoint.empty()) {
+        _publisher.reset(new mujinplc::PLCPublisherObserver());
+        _memory->AddObserver(_publisher);
+        _publisherThread = std::thread(&mujinplc::PLCServer::_RunPublisher, this, _publisher);
+    }
+}
+
+void mujinplc::PLCServer::_StopPublisher() {
+    if (_publisherThread.joinable()) {
+        _publisherThread.join();
+    }
+    // the memory only keeps a weak reference, dropping it unsubscribes
+    _publisher.reset();
 }
 
 void mujinplc::PLCServer::_RunThread() {
-    std::unique_ptr<mujinplc::ZMQServerSocket> socket;
+    if (_numWorkers > 1) {
+        _RunRouter();
+        return;
+    }
+    _Serve(_ctx, _endpoint, false, _shutdown);
+}
+
+void mujinplc::PLCServer::_RunRouter() {
+    // workers talk to the router over inproc, which needs a shared context
+    void* ctx = _ctx;
+    if (!ctx) {
+        ctx = zmq_ctx_new();
+        if (ctx == NULL) {
+            return;
+        }
+    }
+
+    std::vector<std::string> workerEndpoints;
+    for (size_t index = 0; index < _numWorkers; ++index) {
+        workerEndpoints.push_back("inproc://mujinplcserver-" + std::to_string((uintptr_t)this) + "-" + std::to_string(index));
+    }
+
+    std::vector<std::thread> workers;
+    std::atomic<bool> stopWorkers(false);
+    auto joinWorkers = [&workers, &stopWorkers]() {
+        stopWorkers = true;
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+        stopWorkers = false;
+    };
 
+    std::unique_ptr<mujinplc::ZMQRouter> router;
     while (!_shutdown) {
-        if (!socket) {
-            socket.reset(new mujinplc::ZMQServerSocket(_ctx, _endpoint));
+        try {
+            if (!router) {
+                router.reset(new mujinplc::ZMQRouter(ctx, _endpoint, workerEndpoints));
+            }
+            if (workers.empty()) {
+                // start after the router is bound, so that workers connect to bound endpoints
+                for (auto& workerEndpoint : workerEndpoints) {
+                    workers.emplace_back(&mujinplc::PLCServer::_Serve, this, ctx, workerEndpoint, true, std::cref(stopWorkers));
+                }
+            }
+
+            router->Route(50);
+        } catch (const mujinplc::ZMQError& e) {
+            // std::cout << "Error caught: " << e.what() << std::endl;
+            // inproc does not reconnect, workers still paired with the closed backends would never be answered again.
+            // stop them before their sockets are bound anew, and try again after as long as a poll would have taken.
+            joinWorkers();
+            router.reset();
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+
+    joinWorkers();
+    router.reset();
+    if (ctx != _ctx) {
+        zmq_ctx_destroy(ctx);
+    }
+}
+
+void mujinplc::PLCServer::_Serve(void* ctx, const std::string& endpoint, bool worker, const std::atomic<bool>& stop) {
+    std::shared_ptr<mujinplc::PLCServerSession> session;
+    while (!_shutdown && !stop) {
+        if (!session) {
+            session = _OpenSession(ctx, endpoint, worker);
+            if (!session) {
+                // try binding again after as long as a poll would have taken
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                continue;
+            }
         }
 
         try {
-            if (!socket->Poll(50)) {
+            if (!session->socket.Poll(50)) {
                 continue;
             }
+        } catch (const mujinplc::ZMQError& e) {
+            session.reset();
+            continue;
+        }
+        if (!_ServeRequest(*session)) {
+            session.reset();
+        }
+    }
+}
 
-            // something on the socket, receive json
-            rapidjson::Document request, response;
-            response.SetObject();
-            socket->Receive(request);
-
-            // read command, expects a list of keys
-            if (request.IsObject() &&
-                request.HasMember("command") &&
-                request["command"].IsString() &&
-                request["command"].GetString() == std::string("read") &&
-                request.HasMember("keys") &&
-                request["keys"].IsArray()) {
-
-                std::vector<std::string> keys;
-                std::map<std::string, mujinplc::PLCValue> keyvalues;
-                for (auto& key : request["keys"].GetArray()) {
-                    if (key.IsString()) {
-                        keys.push_back(key.GetString());
-                    }
-                }
-                _memory->Read(keys, keyvalues);
-
-                rapidjson::Value key, value, values;
-                values.SetObject();
-                for (auto& keyvalue : keyvalues) {
-                    key.SetString(keyvalue.first.c_str(), response.GetAllocator());
-                    if (keyvalue.second.IsString()) {
-                        value.SetString(keyvalue.second.GetString().c_str(), response.GetAllocator());
-                    }
-                    else if (keyvalue.second.IsInteger()) {
-                        value.SetInt(keyvalue.second.GetInteger());
-                    }
-                    else if (keyvalue.second.IsBoolean()) {
-                        value.SetBool(keyvalue.second.GetBoolean());
-                    }
-                    else {
-                        value.SetNull();
-                    }
-                    values.AddMember(key, value, response.GetAllocator());
-                }
-                key.SetString("keyvalues", response.GetAllocator());
-                response.AddMember(key, values, response.GetAllocator());
-            }
-            // write command, expects a dict of keyvalues
-            else if (request.IsObject() && 
-                request.HasMember("command") &&
-                request["command"].IsString() &&
-                request["command"].GetString() == std::string("write") &&
-                request.HasMember("keyvalues") &&
-                request["keyvalues"].IsObject()) {
-
-                std::map<std::string, mujinplc::PLCValue> keyvalues;
-                for (auto& keyvalue : request["keyvalues"].GetObject()) {
-                    if (!keyvalue.name.IsString()) {
-                        continue;
-                    }
-                    if (keyvalue.value.IsString()) {
-                        keyvalues.emplace(keyvalue.name.GetString(), std::string(keyvalue.value.GetString()));
-                    }
-                    else if (keyvalue.value.IsBool()) {
-                        keyvalues.emplace(keyvalue.name.GetString(), bool(keyvalue.value.GetBool()));
-                    }
-                    else if (keyvalue.value.IsInt()) {
-                        keyvalues.emplace(keyvalue.name.GetString(), int(keyvalue.value.GetInt()));
-                    }
-                    else {
-                        keyvalues.emplace(keyvalue.name.GetString(), mujinplc::PLCValue());
-                    }
-                }
-                _memory->Write(keyvalues);
+std::shared_ptr<mujinplc::PLCServerSession> mujinplc::PLCServer::_OpenSession(void* ctx, const std::string& endpoint, bool worker) const {
+    try {
+        return std::make_shared<mujinplc::PLCServerSession>(ctx, endpoint, worker, _recorder, _schema);
+    } catch (const mujinplc::ZMQError& e) {
+        // std::cout << "Error caught: " << e.what() << std::endl;
+        return std::shared_ptr<mujinplc::PLCServerSession>();
+    }
+}
+
+void* mujinplc::PLCServer::_GetSocket(const mujinplc::PLCServerSession& session) {
+    return session.socket.GetSocket();
+}
+
+bool mujinplc::PLCServer::_ServeRequest(mujinplc::PLCServerSession& session) {
+    mujinplc::PLCRequest& request = session.request;
+    mujinplc::PLCResponse& response = session.response;
+    try {
+        // something on the socket, reply in the encoding of the request.
+        // malformed requests get an empty response, as before.
+        const char* data = NULL;
+        size_t size = 0;
+        session.socket.Receive(data, size);
+        auto received = std::chrono::steady_clock::now();
+
+        response.hasKeyValues = false;
+        response.hasSequence = false;
+        response.hasResults = false;
+        response.hasStats = false;
+        mujinplc::PLCEncoding encoding = mujinplc::GetEncoding(data, size);
+        mujinplc::PLCCommand command = mujinplc::PLCCommand_Unknown;
+        if (mujinplc::DecodeRequest(data, size, request)) {
+            command = request.command;
+            auto decoded = std::chrono::steady_clock::now();
+            _metrics.decodeTime.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(decoded - received).count());
+            if (!session.schema) {
+                HandleRequest(*_memory, _metrics, _controllers, request, response);
             }
+            else if (!_CheckSchema(*session.schema, request, session.handlevalues)) {
+                // answered like a malformed request
+                _metrics.rejectedRequests.Add();
+            }
+            else if (!session.handlevalues.empty()) {
+                _memory->Write(session.handlevalues);
+            }
+            else {
+                HandleRequest(*_memory, _metrics, _controllers, request, response);
+            }
+            _metrics.handleTime.RecordSince(decoded);
+        }
+
+        auto handled = std::chrono::steady_clock::now();
+        std::string& reply = session.socket.GetReplyBuffer();
+        mujinplc::EncodeResponse(response, encoding, reply);
+        auto encoded = std::chrono::steady_clock::now();
+        _metrics.encodeTime.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(encoded - handled).count());
+
+        // the reply buffer is handed over to zmq by Send
+        if (session.recorder) {
+            session.recorder->Record(received, encoded, data, size, reply.data(), reply.size());
+        }
+        session.socket.Send();
+        _metrics.requestTime.RecordSince(received);
+        _metrics.requests[(size_t)command < mujinplc::PLCServerMetrics::NumCommands ? command : mujinplc::PLCCommand_Unknown].Add();
+    } catch (const mujinplc::ZMQError& e) {
+        // std::cout << "Error caught: " << e.what() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void mujinplc::PLCServer::_RunPublisher(std::shared_ptr<mujinplc::PLCPublisherObserver> publisher) {
+    std::unique_ptr<mujinplc::ZMQPublisherSocket> socket;
+    std::vector<mujinplc::PLCPublisherObserver::Batch> batches;
+    std::string data;
 
-            socket->Send(response);
+    while (!_shutdown) {
+        try {
+            if (!socket) {
+                socket.reset(new mujinplc::ZMQPublisherSocket(_ctx, _publisherEndpoint));
+            }
+
+            if (!publisher->Wait(batches, std::chrono::milliseconds(50))) {
+                continue;
+            }
+
+            // subscribers resync on their own, so anything dropped because of an error is not retried
+            for (auto& batch : batches) {
+                for (auto& keyvalue : batch.keyvalues) {
+                    mujinplc::EncodeUpdate(batch.sequence, keyvalue.second, data);
+                    socket->Publish(keyvalue.first, data);
+                }
+            }
         } catch (const mujinplc::ZMQError& e) {
-            socket.release();
+            socket.reset();
             // std::cout << "Error caught: " << e.what() << std::endl;
+            // e.g. the endpoint is still bound by someone else, try again after as long as a wait would have taken
+            publisher->Clear();
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
         }
     }
 }
@@ -0,0 +1,509 @@
+#include "mujinplc/plcsharedmemory.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace mujinplc {
+
+static const uint32_t s_sharedMemoryMagic = 0x4d504c43; // "MPLC"
+static const uint32_t s_sharedMemoryVersion = 1;
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free, "atomics in shared memory have to be lock free");
+
+struct alignas(64) PLCSharedMemory::Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t numSlots;
+    uint32_t slotSize;
+    std::atomic<uint64_t> sequence; ///< sequence number of the last slot write
+    std::atomic<uint32_t> changeCounter; ///< futex word, bumped by every write batch
+    std::atomic<uint32_t> numWaiters; ///< processes blocked on changeCounter, writers only wake them up if there are any
+};
+
+struct alignas(64) PLCSharedMemory::Slot {
+    std::atomic<uint32_t> state; ///< 0 empty, 1 key being set, 2 key set
+    std::atomic<uint32_t> seqlock; ///< odd while the fields below are being written
+    uint32_t keyLength;
+    char key[MaxKeyLength];
+
+    // protected by the seqlock
+    uint64_t sequence; ///< 0 if never written
+    uint32_t writer;
+    uint32_t type;
+    int32_t integerValue; ///< also holds booleans
+    uint32_t stringLength;
+    char stringValue[MaxStringLength];
+};
+
+/// set to true while the bridge writes pulled changes into the memory, to not push back the notification it triggers on the same thread
+static thread_local bool s_pulling = false;
+
+static long Futex(std::atomic<uint32_t>* word, int op, uint32_t value, const struct timespec* timeout) {
+    return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, value, timeout, NULL, 0);
+}
+
+/// fnv-1a of the key
+static uint32_t HashKey(const std::string& key) {
+    uint32_t hash = 2166136261u;
+    for (char c : key) {
+        hash = (hash ^ (unsigned char)c) * 16777619u;
+    }
+    return hash;
+}
+
+}
+
+const size_t mujinplc::PLCSharedMemory::MaxKeyLength;
+const size_t mujinplc::PLCSharedMemory::MaxStringLength;
+
+std::shared_ptr<mujinplc::PLCSharedMemory> mujinplc::PLCSharedMemory::Create(const std::string& name, uint32_t numSlots) {
+    int fd;
+    if (name.empty()) {
+        fd = memfd_create("mujinplc", MFD_CLOEXEC);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "memfd_create");
+        }
+    }
+    else {
+        // fails if it already exists, a stale segment has to be unlinked first
+        fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+        }
+    }
+    return std::shared_ptr<mujinplc::PLCSharedMemory>(new mujinplc::PLCSharedMemory(fd, true, numSlots));
+}
+
+std::shared_ptr<mujinplc::PLCSharedMemory> mujinplc::PLCSharedMemory::Attach(const std::string& name) {
+    int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "shm_open " + name);
+    }
+    return std::shared_ptr<mujinplc::PLCSharedMemory>(new mujinplc::PLCSharedMemory(fd, false, 0));
+}
+
+std::shared_ptr<mujinplc::PLCSharedMemory> mujinplc::PLCSharedMemory::Attach(int fd) {
+    fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::system_error(errno, std::generic_category(), "fcntl");
+    }
+    return std::shared_ptr<mujinplc::PLCSharedMemory>(new mujinplc::PLCSharedMemory(fd, false, 0));
+}
+
+void mujinplc::PLCSharedMemory::Unlink(const std::string& name) {
+    shm_unlink(name.c_str());
+}
+
+mujinplc::PLCSharedMemory::PLCSharedMemory(int fd, bool create, uint32_t numSlots) : _fd(fd), _data(MAP_FAILED), _size(0), _header(NULL), _slots(NULL) {
+    try {
+        if (create) {
+            if (numSlots == 0) {
+                throw std::invalid_argument("shared memory needs at least one slot");
+            }
+            _size = sizeof(Header) + (size_t)numSlots * sizeof(Slot);
+            if (ftruncate(_fd, _size)) {
+                throw std::system_error(errno, std::generic_category(), "ftruncate");
+            }
+        }
+        else {
+            struct stat st;
+            if (fstat(_fd, &st)) {
+                throw std::system_error(errno, std::generic_category(), "fstat");
+            }
+            _size = st.st_size;
+            if (_size < sizeof(Header)) {
+                throw std::runtime_error("not a mujinplc shared memory segment");
+            }
+        }
+
+        _data = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (_data == MAP_FAILED) {
+            throw std::system_error(errno, std::generic_category(), "mmap");
+        }
+        _header = (Header*)_data;
+        _slots = (Slot*)((char*)_data + sizeof(Header));
+
+        if (create) {
+            // a fresh segment is zero filled, which is the empty state of everything
+            _header->magic = s_sharedMemoryMagic;
+            _header->version = s_sharedMemoryVersion;
+            _header->numSlots = numSlots;
+            _header->slotSize = sizeof(Slot);
+        }
+        else if (_header->magic != s_sharedMemoryMagic ||
+                 _header->version != s_sharedMemoryVersion ||
+                 _header->slotSize != sizeof(Slot) ||
+                 _size < sizeof(Header) + (size_t)_header->numSlots * sizeof(Slot)) {
+            throw std::runtime_error("not a mujinplc shared memory segment, or of an incompatible version");
+        }
+    } catch (...) {
+        if (_data != MAP_FAILED) {
+            munmap(_data, _size);
+        }
+        close(_fd);
+        throw;
+    }
+}
+
+mujinplc::PLCSharedMemory::~PLCSharedMemory() {
+    munmap(_data, _size);
+    close(_fd);
+}
+
+int mujinplc::PLCSharedMemory::GetFileDescriptor() const {
+    return _fd;
+}
+
+bool mujinplc::PLCSharedMemory::IsStorable(const std::string& key, const mujinplc::PLCValue& value) {
+    if (key.empty() || key.size() > MaxKeyLength) {
+        return false;
+    }
+    // slots only have room for a string or a 32 bit integer
+    switch (value.GetType()) {
+    case mujinplc::PLCValueType_Null:
+    case mujinplc::PLCValueType_Boolean:
+    case mujinplc::PLCValueType_Integer:
+        return true;
+    case mujinplc::PLCValueType_String:
+        return value.GetString().size() <= MaxStringLength;
+    default:
+        return false;
+    }
+}
+
+mujinplc::PLCSharedMemory::Slot* mujinplc::PLCSharedMemory::_FindSlot(const std::string& key, bool create) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _slotCache.find(key);
+        if (it != _slotCache.end()) {
+            return it->second;
+        }
+    }
+
+    // linear probing, slots are never freed so a lookup can stop at the first empty one
+    uint32_t numSlots = _header->numSlots;
+    uint32_t hash = mujinplc::HashKey(key);
+    for (uint32_t probe = 0; probe < numSlots; ++probe) {
+        Slot& slot = _slots[(hash + probe) % numSlots];
+        uint32_t state = slot.state.load(std::memory_order_acquire);
+        if (state == 0) {
+            if (!create) {
+                return NULL;
+            }
+            if (slot.state.compare_exchange_strong(state, 1, std::memory_order_acquire)) {
+                slot.keyLength = key.size();
+                std::memcpy(slot.key, key.data(), key.size());
+                slot.state.store(2, std::memory_order_release);
+                state = 2;
+            }
+        }
+        while (state == 1) {
+            // another process is setting the key of this slot right now
+            std::this_thread::yield();
+            state = slot.state.load(std::memory_order_acquire);
+        }
+        if (slot.keyLength == key.size() && std::memcmp(slot.key, key.data(), key.size()) == 0) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _slotCache[key] = &slot;
+            return &slot;
+        }
+    }
+    if (create) {
+        throw std::runtime_error("shared memory is out of slots");
+    }
+    return NULL;
+}
+
+bool mujinplc::PLCSharedMemory::Read(const std::string& key, mujinplc::PLCValue& value) {
+    Slot* slot = _FindSlot(key, false);
+    if (slot == NULL) {
+        return false;
+    }
+
+    uint64_t sequence;
+    uint32_t type, stringLength;
+    int32_t integerValue;
+    char stringValue[MaxStringLength];
+    while (true) {
+        uint32_t begin = slot->seqlock.load(std::memory_order_acquire);
+        if (begin & 1) {
+            continue;
+        }
+        sequence = slot->sequence;
+        type = slot->type;
+        integerValue = slot->integerValue;
+        stringLength = std::min<uint32_t>(slot->stringLength, MaxStringLength);
+        std::memcpy(stringValue, slot->stringValue, stringLength);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seqlock.load(std::memory_order_relaxed) == begin) {
+            break;
+        }
+    }
+
+    if (sequence == 0) {
+        return false;
+    }
+    switch (type) {
+    case mujinplc::PLCValueType_String:
+        value.SetString(stringValue, stringLength);
+        break;
+    case mujinplc::PLCValueType_Integer:
+        value.SetInteger(integerValue);
+        break;
+    case mujinplc::PLCValueType_Boolean:
+        value.SetBoolean(integerValue != 0);
+        break;
+    default:
+        value.SetNull();
+        break;
+    }
+    return true;
+}
+
+void mujinplc::PLCSharedMemory::Write(const std::vector<std::pair<std::string, mujinplc::PLCValue>>& keyvalues, uint32_t writer) {
+    for (auto& keyvalue : keyvalues) {
+        if (!IsStorable(keyvalue.first, keyvalue.second)) {
+            throw std::invalid_argument("key or value does not fit into a shared memory slot: " + keyvalue.first);
+        }
+    }
+
+    // slots written before running out of slots are visible already, so waiters have to be woken up for them as well
+    size_t numWritten = 0;
+    try {
+        for (auto& keyvalue : keyvalues) {
+            _WriteSlot(*_FindSlot(keyvalue.first, true), keyvalue.second, writer);
+            numWritten++;
+        }
+    } catch (const std::runtime_error&) {
+        if (numWritten > 0) {
+            _NotifyChange();
+        }
+        throw;
+    }
+    if (numWritten > 0) {
+        _NotifyChange();
+    }
+}
+
+void mujinplc::PLCSharedMemory::_WriteSlot(Slot& slot, const mujinplc::PLCValue& value, uint32_t writer) {
+    // take the seqlock, writers of other processes may compete for it
+    uint32_t begin = slot.seqlock.load(std::memory_order_relaxed);
+    while ((begin & 1) || !slot.seqlock.compare_exchange_weak(begin, begin + 1, std::memory_order_acquire)) {
+        begin = slot.seqlock.load(std::memory_order_relaxed);
+    }
+
+    // the sequence number is taken while holding the slot, so that ReadModifiedSince waits for the write to finish
+    slot.sequence = _header->sequence.fetch_add(1) + 1;
+    slot.writer = writer;
+    slot.type = value.GetType();
+    slot.integerValue = value.IsBoolean() ? value.GetBoolean() : value.GetInteger();
+    slot.stringLength = 0;
+    if (value.IsString()) {
+        slot.stringLength = value.GetString().size();
+        std::memcpy(slot.stringValue, value.GetString().data(), slot.stringLength);
+    }
+    slot.seqlock.store(begin + 2, std::memory_order_release);
+}
+
+void mujinplc::PLCSharedMemory::_NotifyChange() {
+    _header->changeCounter.fetch_add(1);
+    if (_header->numWaiters.load() > 0) {
+        mujinplc::Futex(&_header->changeCounter, FUTEX_WAKE, INT_MAX, NULL);
+    }
+}
+
+uint64_t mujinplc::PLCSharedMemory::GetSequence() const {
+    return _header->sequence.load();
+}
+
+uint64_t mujinplc::PLCSharedMemory::ReadModifiedSince(uint64_t sequence, std::vector<std::pair<std::string, mujinplc::PLCValue>>& keyvalues, uint32_t excludedWriter) {
+    keyvalues.clear();
+
+    // every slot write numbered up to here has at least taken its seqlock, so it is seen below
+    uint64_t current = _header->sequence.load();
+    if (sequence > current) {
+        sequence = 0;
+    }
+
+    mujinplc::PLCValue value;
+    for (uint32_t index = 0; index < _header->numSlots; ++index) {
+        Slot& slot = _slots[index];
+        if (slot.state.load(std::memory_order_acquire) != 2) {
+            continue;
+        }
+
+        uint64_t slotSequence;
+        uint32_t writer;
+        while (true) {
+            uint32_t begin = slot.seqlock.load(std::memory_order_acquire);
+            if (begin & 1) {
+                continue;
+            }
+            slotSequence = slot.sequence;
+            writer = slot.writer;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.seqlock.load(std::memory_order_relaxed) == begin) {
+                break;
+            }
+        }
+        if (slotSequence <= sequence || (excludedWriter != 0 && writer == excludedWriter)) {
+            continue;
+        }
+
+        std::string key(slot.key, slot.keyLength);
+        if (Read(key, value)) {
+            keyvalues.emplace_back(std::move(key), value);
+        }
+    }
+    return current;
+}
+
+uint32_t mujinplc::PLCSharedMemory::GetChangeCounter() const {
+    return _header->changeCounter.load();
+}
+
+bool mujinplc::PLCSharedMemory::WaitForChange(uint32_t changeCounter, std::chrono::milliseconds timeout) {
+    struct timespec ts;
+    ts.tv_sec = timeout.count() / 1000;
+    ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+
+    _header->numWaiters.fetch_add(1);
+    if (_header->changeCounter.load() == changeCounter) {
+        mujinplc::Futex(&_header->changeCounter, FUTEX_WAIT, changeCounter, &ts);
+    }
+    _header->numWaiters.fetch_sub(1);
+    return _header->changeCounter.load() != changeCounter;
+}
+
+mujinplc::PLCSharedMemoryBridge::PLCSharedMemoryBridge(const std::shared_ptr<mujinplc::PLCMemory>& memory, const std::shared_ptr<mujinplc::PLCSharedMemory>& sharedMemory) : _memory(memory), _sharedMemory(sharedMemory), _writer(0), _shutdown(true), _running(false), _observing(false), _sharedSequence(0) {
+    std::random_device random;
+    while (_writer == 0) {
+        _writer = random();
+    }
+}
+
+mujinplc::PLCSharedMemoryBridge::~PLCSharedMemoryBridge() {
+    Stop();
+}
+
+void mujinplc::PLCSharedMemoryBridge::Start() {
+    Stop();
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _sharedSequence = 0;
+        _running = true;
+    }
+    _Pull();
+
+    // the memory delivers all its keys right away, which pushes the ones the segment does not have yet
+    bool observing;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        observing = _observing;
+        _observing = true;
+    }
+    if (!observing) {
+        _memory->AddObserver(shared_from_this());
+    }
+
+    _shutdown = false;
+    _thread = std::thread(&mujinplc::PLCSharedMemoryBridge::_RunThread, this);
+}
+
+void mujinplc::PLCSharedMemoryBridge::Stop() {
+    _shutdown = true;
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _running = false;
+}
+
+bool mujinplc::PLCSharedMemoryBridge::IsRunning() const {
+    return !_shutdown;
+}
+
+void mujinplc::PLCSharedMemoryBridge::MemoryModified(const std::map<std::string, mujinplc::PLCValue>& /*keyvalues*/) {
+}
+
+void mujinplc::PLCSharedMemoryBridge::MemoryModified(uint64_t sequence, const std::map<std::string, mujinplc::PLCValue>& keyvalues) {
+    if (mujinplc::s_pulling) {
+        // notification of the pull itself
+        return;
+    }
+
+    std::vector<std::pair<std::string, mujinplc::PLCValue>> pushes;
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_running) {
+        return;
+    }
+    for (auto& keyvalue : keyvalues) {
+        // pulled in this batch or later, comes from the segment already. pushed in a later batch, this one is stale:
+        // observers are notified outside the lock of the memory, so concurrent writers can be notified out of order.
+        uint64_t& synced = _syncedSequences[keyvalue.first];
+        if (synced >= sequence) {
+            continue;
+        }
+        // signals that do not fit the slots stay local
+        if (mujinplc::PLCSharedMemory::IsStorable(keyvalue.first, keyvalue.second)) {
+            synced = sequence;
+            pushes.push_back(keyvalue);
+        }
+    }
+
+    try {
+        _sharedMemory->Write(pushes, _writer);
+    } catch (const std::runtime_error& e) {
+        // out of slots, the keys that did not fit stay local
+    }
+}
+
+void mujinplc::PLCSharedMemoryBridge::_RunThread() {
+    while (!_shutdown) {
+        uint32_t changeCounter = _sharedMemory->GetChangeCounter();
+        _Pull();
+        _sharedMemory->WaitForChange(changeCounter, std::chrono::milliseconds(50));
+    }
+}
+
+void mujinplc::PLCSharedMemoryBridge::_Pull() {
+    std::vector<std::pair<std::string, mujinplc::PLCValue>> keyvalues;
+    std::vector<mujinplc::PLCOperation> operations;
+    std::vector<mujinplc::PLCOperationResult> results;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _sharedSequence = _sharedMemory->ReadModifiedSince(_sharedSequence, keyvalues, _writer);
+    if (keyvalues.empty()) {
+        return;
+    }
+
+    operations.resize(keyvalues.size());
+    for (size_t index = 0; index < keyvalues.size(); ++index) {
+        operations[index].type = mujinplc::PLCOperationType_Write;
+        operations[index].key = keyvalues[index].first;
+        operations[index].value = keyvalues[index].second;
+    }
+
+    // without a dispatcher, the memory notifies observers of this batch on this thread, before Execute returns
+    mujinplc::s_pulling = true;
+    uint64_t sequence = _memory->Execute(operations, results);
+    mujinplc::s_pulling = false;
+
+    if (sequence != 0) {
+        for (auto& keyvalue : keyvalues) {
+            _syncedSequences[keyvalue.first] = sequence;
+        }
+    }
+}
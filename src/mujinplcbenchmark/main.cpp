@@ -0,0 +1,592 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <zmq.h>
+#include <mujinplc/mujinplc.h>
+
+// counts heap allocations made by the benchmark process
+static std::atomic<size_t> s_numAllocations(0);
+
+void* operator new(std::size_t size) {
+    s_numAllocations++;
+    void* ptr = std::malloc(size);
+    if (ptr == NULL) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+// one measurement of a benchmark, reported as "value unit"
+struct BenchmarkMetric {
+    std::string unit; ///< e.g. "ns/copy", becomes "ns_per_copy" in the json output
+    double value;
+};
+
+struct BenchmarkResult {
+    std::string name;
+    std::vector<BenchmarkMetric> metrics;
+};
+
+static std::vector<BenchmarkResult> s_results;
+
+// print the metrics of a benchmark and keep them for the json output
+void Report(const std::string& name, const std::vector<BenchmarkMetric>& metrics) {
+    std::cout << name << ": ";
+    for (size_t index = 0; index < metrics.size(); ++index) {
+        std::cout << (index > 0 ? ", " : "") << metrics[index].value << " " << metrics[index].unit;
+    }
+    std::cout << std::endl;
+    s_results.push_back(BenchmarkResult{name, metrics});
+}
+
+// latencies in microseconds, sorted in place
+void ReportLatencies(const std::string& name, std::vector<double>& latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    Report(name, {
+        {"us p50", latencies[latencies.size() / 2]},
+        {"us p99", latencies[latencies.size() * 99 / 100]},
+        {"us max", latencies.back()},
+    });
+}
+
+// write all results as {"benchmarks": [{"name": ..., "metric": value, ...}, ...]}, metric names are the units
+// with spaces and slashes replaced, e.g. "us p99" becomes "us_p99" and "ns/key" becomes "ns_per_key"
+bool WriteResults(const std::string& path) {
+    std::ofstream stream(path.c_str());
+    if (!stream) {
+        std::cout << "cannot write " << path << std::endl;
+        return false;
+    }
+    stream.precision(10);
+    stream << "{\"benchmarks\": [";
+    for (size_t index = 0; index < s_results.size(); ++index) {
+        stream << (index > 0 ? ",\n  " : "\n  ") << "{\"name\": \"" << s_results[index].name << "\"";
+        for (auto& metric : s_results[index].metrics) {
+            std::string key;
+            for (size_t position = 0; position < metric.unit.size(); ++position) {
+                char c = metric.unit[position];
+                if (c == '/') {
+                    key += "_per_";
+                }
+                else {
+                    key += c == ' ' ? '_' : c;
+                }
+            }
+            stream << ", \"" << key << "\": " << metric.value;
+        }
+        stream << "}";
+    }
+    stream << "\n]}" << std::endl;
+    return !!stream;
+}
+
+// layout of PLCValue before it became a tagged union, kept here to compare against
+class LegacyPLCValue {
+public:
+    LegacyPLCValue() : _type(mujinplc::PLCValueType_Null) {
+    }
+    LegacyPLCValue(std::string value) : _type(mujinplc::PLCValueType_String), _stringValue(value) {
+    }
+    LegacyPLCValue(int value) : _type(mujinplc::PLCValueType_Integer), _integerValue(value) {
+    }
+    LegacyPLCValue(bool value) : _type(mujinplc::PLCValueType_Boolean), _booleanValue(value) {
+    }
+    LegacyPLCValue(const LegacyPLCValue& other) : _type(other._type), _stringValue(other._stringValue), _integerValue(other._integerValue), _booleanValue(other._booleanValue) {
+    }
+    virtual ~LegacyPLCValue() {
+    }
+
+private:
+    mujinplc::PLCValueType _type;
+
+    std::string _stringValue;
+    int _integerValue = 0;
+    bool _booleanValue = false;
+};
+
+// copy the value into a vector many times, report nanoseconds and allocations per copy
+template <typename T>
+void BenchmarkCopy(const std::string& name, const T& value, size_t iterations) {
+    std::vector<T> values;
+    values.reserve(iterations);
+
+    size_t numAllocations = s_numAllocations;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t index = 0; index < iterations; ++index) {
+        values.push_back(value);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    numAllocations = s_numAllocations - numAllocations;
+
+    Report(name, {
+        {"ns/copy", std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / double(iterations)},
+        {"allocations/copy", numAllocations / double(iterations)},
+    });
+}
+
+// write batches through PLCMemory, report nanoseconds and allocations per written key
+void BenchmarkWrite(const std::string& name, const std::vector<mujinplc::PLCValue>& values, size_t numKeys, size_t iterations) {
+    std::shared_ptr<mujinplc::PLCMemory> memory(new mujinplc::PLCMemory());
+    std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>> keyvalues;
+    for (size_t index = 0; index < numKeys; ++index) {
+        keyvalues.emplace_back(memory->GetKeyHandle("key" + std::to_string(index)), mujinplc::PLCValue());
+    }
+
+    size_t numAllocations = s_numAllocations;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t iteration = 0; iteration < iterations; ++iteration) {
+        for (auto& keyvalue : keyvalues) {
+            keyvalue.second = values[iteration % values.size()];
+        }
+        memory->Write(keyvalues);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    numAllocations = s_numAllocations - numAllocations;
+
+    double numWrites = double(iterations) * numKeys;
+    Report(name, {
+        {"ns/key", std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / numWrites},
+        {"allocations/key", numAllocations / numWrites},
+    });
+}
+
+// numThreads threads read or write the same numKeys keys as one batch in a loop for the given duration,
+// report the keys read or written per second by all threads together
+void BenchmarkThroughput(const std::string& name, bool write, size_t numKeys, size_t numThreads, std::chrono::milliseconds duration) {
+    std::shared_ptr<mujinplc::PLCMemory> memory(new mujinplc::PLCMemory());
+    std::vector<mujinplc::PLCKeyHandle> keys;
+    std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>> initial;
+    for (size_t index = 0; index < numKeys; ++index) {
+        keys.push_back(memory->GetKeyHandle("key" + std::to_string(index)));
+        initial.emplace_back(keys.back(), mujinplc::PLCValue(0));
+    }
+    memory->Write(initial);
+
+    std::atomic<bool> stop(false);
+    std::vector<size_t> numBatches(numThreads, 0);
+    std::vector<std::thread> threads;
+    for (size_t thread = 0; thread < numThreads; ++thread) {
+        threads.emplace_back([&, thread]() {
+            std::vector<std::pair<mujinplc::PLCKeyHandle, mujinplc::PLCValue>> keyvalues(initial);
+            size_t count = 0;
+            while (!stop) {
+                if (write) {
+                    for (auto& keyvalue : keyvalues) {
+                        keyvalue.second.SetInteger(int(count));
+                    }
+                    memory->Write(keyvalues);
+                }
+                else {
+                    memory->Read(keys, keyvalues);
+                }
+                count++;
+            }
+            numBatches[thread] = count;
+        });
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    size_t total = 0;
+    for (auto count : numBatches) {
+        total += count;
+    }
+    double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / 1e9;
+    Report(name, {
+        {"keys/s", total * numKeys / seconds},
+        {"batches/s", total / seconds},
+    });
+}
+
+class NullObserver : public mujinplc::PLCMemoryObserver {
+public:
+    virtual void MemoryModified(const std::map<std::string, mujinplc::PLCValue>& /*keyvalues*/) override {
+    }
+};
+
+// write one key of a hundred with numObservers observers that do nothing, watching either everything or only that key,
+// report nanoseconds and allocations per write
+void BenchmarkObserverFanOut(const std::string& name, size_t numObservers, bool filtered, size_t iterations) {
+    std::shared_ptr<mujinplc::PLCMemory> memory(new mujinplc::PLCMemory());
+    std::map<std::string, mujinplc::PLCValue> keyvalues;
+    for (size_t index = 0; index < 100; ++index) {
+        keyvalues["key" + std::to_string(index)] = mujinplc::PLCValue(0);
+    }
+    memory->Write(keyvalues);
+
+    std::vector<std::shared_ptr<NullObserver>> observers;
+    for (size_t index = 0; index < numObservers; ++index) {
+        observers.emplace_back(new NullObserver());
+        if (filtered) {
+            memory->AddObserver(observers.back(), {"key0"});
+        }
+        else {
+            memory->AddObserver(observers.back());
+        }
+    }
+
+    mujinplc::PLCKeyHandle key = memory->GetKeyHandle("key0");
+    size_t numAllocations = s_numAllocations;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t index = 0; index < iterations; ++index) {
+        memory->Write(key, mujinplc::PLCValue(int(index + 1)));
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    numAllocations = s_numAllocations - numAllocations;
+
+    Report(name, {
+        {"ns/write", std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / double(iterations)},
+        {"allocations/write", numAllocations / double(iterations)},
+    });
+}
+
+// ping pong between two controllers through one memory, half the round trip is the Set to WaitUntil wake up latency
+void BenchmarkWakeLatency(const std::string& name, size_t iterations) {
+    std::shared_ptr<mujinplc::PLCMemory> memory(new mujinplc::PLCMemory());
+    std::shared_ptr<mujinplc::PLCController> controller(new mujinplc::PLCController(memory));
+    std::shared_ptr<mujinplc::PLCController> responder(new mujinplc::PLCController(memory));
+    mujinplc::PLCKeyHandle ping = memory->GetKeyHandle("ping");
+    mujinplc::PLCKeyHandle pong = memory->GetKeyHandle("pong");
+
+    std::thread responderThread([&]() {
+        for (size_t index = 1; index <= iterations; ++index) {
+            responder->WaitUntil(ping, mujinplc::PLCValue(int(index)));
+            responder->Set(pong, mujinplc::PLCValue(int(index)));
+        }
+    });
+
+    std::vector<double> latencies;
+    latencies.reserve(iterations);
+    for (size_t index = 1; index <= iterations; ++index) {
+        auto start = std::chrono::steady_clock::now();
+        controller->Set(ping, mujinplc::PLCValue(int(index)));
+        controller->WaitUntil(pong, mujinplc::PLCValue(int(index)));
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count() / 2000.0);
+    }
+    responderThread.join();
+
+    ReportLatencies(name, latencies);
+}
+
+// send the request to a PLCServer bound to endpoint from a REQ socket in the same context, report round trip latency percentiles
+void BenchmarkServerRoundTrip(const std::string& name, void* ctx, const std::string& endpoint, const mujinplc::PLCRequest& request, mujinplc::PLCEncoding encoding, size_t iterations) {
+    std::shared_ptr<mujinplc::PLCMemory> memory(new mujinplc::PLCMemory());
+    std::map<std::string, mujinplc::PLCValue> keyvalues;
+    for (auto& key : request.keys) {
+        keyvalues[key] = mujinplc::PLCValue(std::string("value of ") + key);
+    }
+    memory->Write(keyvalues);
+
+    std::shared_ptr<mujinplc::PLCServer> server(new mujinplc::PLCServer(memory, ctx, endpoint));
+    server->Start();
+
+    void* socket = zmq_socket(ctx, ZMQ_REQ);
+    int linger = 0, timeout = 5000;
+    zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+    zmq_setsockopt(socket, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    if (zmq_connect(socket, endpoint.c_str()) != 0) {
+        std::cout << name << ": cannot connect to " << endpoint << ", " << zmq_strerror(zmq_errno()) << std::endl;
+        zmq_close(socket);
+        server->Stop();
+        return;
+    }
+
+    std::string requestData;
+    mujinplc::EncodeRequest(request, encoding, requestData);
+    zmq_msg_t reply;
+    zmq_msg_init(&reply);
+
+    // the first hundred round trips warm up the connection and the reused buffers
+    const size_t numWarmups = 100;
+    std::vector<double> latencies;
+    latencies.reserve(iterations);
+    for (size_t index = 0; index < numWarmups + iterations; ++index) {
+        auto start = std::chrono::steady_clock::now();
+        if (zmq_send(socket, requestData.data(), requestData.size(), 0) < 0 || zmq_msg_recv(&reply, socket, 0) < 0) {
+            std::cout << name << ": no reply from " << endpoint << ", " << zmq_strerror(zmq_errno()) << std::endl;
+            latencies.clear();
+            break;
+        }
+        if (index >= numWarmups) {
+            latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count() / 1000.0);
+        }
+    }
+
+    zmq_msg_close(&reply);
+    zmq_close(socket);
+    server->Stop();
+
+    if (!latencies.empty()) {
+        ReportLatencies(name, latencies);
+    }
+}
+
+// encode and decode a request and its response in the given encoding, report nanoseconds and bytes per round trip
+void BenchmarkCodec(const std::string& name, const mujinplc::PLCRequest& request, const mujinplc::PLCResponse& response, mujinplc::PLCEncoding encoding, size_t iterations) {
+    std::string requestData, responseData;
+    mujinplc::PLCRequest decodedRequest;
+    mujinplc::PLCResponse decodedResponse;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t index = 0; index < iterations; ++index) {
+        mujinplc::EncodeRequest(request, encoding, requestData);
+        mujinplc::DecodeRequest(requestData.data(), requestData.size(), decodedRequest);
+        mujinplc::EncodeResponse(response, encoding, responseData);
+        mujinplc::DecodeResponse(responseData.data(), responseData.size(), decodedResponse);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    Report(name, {
+        {"ns/roundtrip", std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / double(iterations)},
+        {"request bytes", double(requestData.size())},
+        {"response bytes", double(responseData.size())},
+    });
+}
+
+// send read requests to a PLCServer over inproc, report heap allocations per round trip once warmed up.
+// counts the whole process, the server thread serving the request as well as the client. zmq itself mallocs a
+// reference count for every reply larger than it stores inline, which operator new does not see.
+bool BenchmarkServerAllocations(const std::string& name, void* ctx, const std::string& endpoint, const mujinplc::PLCRequest& request, mujinplc::PLCEncoding encoding, size_t iterations) {
+    std::shared_ptr<mujinplc::PLCMemory> memory(new mujinplc::PLCMemory());
+    std::map<std::string, mujinplc::PLCValue> keyvalues;
+    for (size_t index = 0; index < request.keys.size(); ++index) {
+        keyvalues[request.keys[index]] = index % 2 == 0 ? mujinplc::PLCValue(int(index)) : mujinplc::PLCValue(std::string("a string value longer than sso ") + std::to_string(index));
+    }
+    memory->Write(keyvalues);
+
+    std::shared_ptr<mujinplc::PLCServer> server(new mujinplc::PLCServer(memory, ctx, endpoint));
+    server->Start();
+
+    void* socket = zmq_socket(ctx, ZMQ_REQ);
+    int linger = 0, timeout = 5000;
+    zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+    zmq_setsockopt(socket, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    if (zmq_connect(socket, endpoint.c_str()) != 0) {
+        std::cout << name << ": FAILED, cannot connect to " << endpoint << ", " << zmq_strerror(zmq_errno()) << std::endl;
+        zmq_close(socket);
+        server->Stop();
+        return false;
+    }
+
+    std::string requestData;
+    mujinplc::EncodeRequest(request, encoding, requestData);
+    zmq_msg_t reply;
+    zmq_msg_init(&reply);
+
+    // the first hundred round trips warm up the connection and the reused buffers
+    const size_t numWarmups = 100;
+    size_t numAllocations = 0;
+    bool replied = true;
+    for (size_t index = 0; index < numWarmups + iterations; ++index) {
+        if (index == numWarmups) {
+            numAllocations = s_numAllocations;
+        }
+        if (zmq_send(socket, requestData.data(), requestData.size(), 0) < 0 || zmq_msg_recv(&reply, socket, 0) < 0) {
+            std::cout << name << ": FAILED, no reply from " << endpoint << ", " << zmq_strerror(zmq_errno()) << std::endl;
+            replied = false;
+            break;
+        }
+    }
+    numAllocations = s_numAllocations - numAllocations;
+
+    zmq_msg_close(&reply);
+    zmq_close(socket);
+    server->Stop();
+
+    if (!replied) {
+        return false;
+    }
+    Report(name, {{"allocations/request", numAllocations / double(iterations)}});
+    if (numAllocations != 0) {
+        std::cout << name << ": FAILED, steady state read requests should not allocate" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// persist numKeys keys written in batches of ten, half of them in the snapshot and half in the log,
+// then report how long a fresh memory takes to restore them
+void BenchmarkRestore(const std::string& name, size_t numKeys) {
+    char directory[] = "/tmp/mujinplcbenchmarkXXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        std::cout << name << ": cannot create " << directory << std::endl;
+        return;
+    }
+
+    {
+        std::shared_ptr<mujinplc::PLCMemory> memory(new mujinplc::PLCMemory());
+        mujinplc::PLCPersistence persistence(memory, directory);
+        persistence.Start();
+        for (size_t index = 0; index < numKeys; index += 10) {
+            if (index == numKeys / 2) {
+                persistence.Compact();
+            }
+            std::map<std::string, mujinplc::PLCValue> keyvalues;
+            for (size_t key = index; key < index + 10 && key < numKeys; ++key) {
+                keyvalues["key" + std::to_string(key)] = key % 2 == 0 ? mujinplc::PLCValue(int(key)) : mujinplc::PLCValue(std::string("value") + std::to_string(key));
+            }
+            memory->Write(keyvalues);
+            persistence.Flush();
+        }
+        persistence.Stop();
+    }
+
+    std::shared_ptr<mujinplc::PLCMemory> memory(new mujinplc::PLCMemory());
+    mujinplc::PLCPersistence persistence(memory, directory);
+    auto start = std::chrono::steady_clock::now();
+    size_t numRestored = persistence.Start();
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    persistence.Stop();
+
+    Report(name, {
+        {"ms", std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1000.0},
+        {"keys", double(numRestored)},
+    });
+
+    unlink((std::string(directory) + "/plc.snapshot").c_str());
+    unlink((std::string(directory) + "/plc.log").c_str());
+    rmdir(directory);
+}
+
+// a read of a handful of signals like the one of main, and a read of a key the memory does not have, whose reply zmq stores inline
+bool CheckServerAllocations(size_t iterations) {
+    mujinplc::PLCRequest readRequest, emptyReadRequest;
+    readRequest.command = mujinplc::PLCCommand_Read;
+    readRequest.hasKeys = true;
+    for (int index = 0; index < 16; ++index) {
+        readRequest.keys.push_back("isRunningOrderCycle" + std::to_string(index));
+    }
+    emptyReadRequest.command = mujinplc::PLCCommand_Read;
+    emptyReadRequest.hasKeys = true;
+    emptyReadRequest.keys.push_back("unknown");
+
+    // the client shares the context of the server, which inproc requires
+    void* ctx = zmq_ctx_new();
+    bool success = true;
+    success &= BenchmarkServerAllocations("json read request", ctx, "inproc://mujinplcbenchmarkallocations1", readRequest, mujinplc::PLCEncoding_JSON, iterations);
+    success &= BenchmarkServerAllocations("binary read request", ctx, "inproc://mujinplcbenchmarkallocations2", readRequest, mujinplc::PLCEncoding_Binary, iterations);
+    success &= BenchmarkServerAllocations("binary empty read request", ctx, "inproc://mujinplcbenchmarkallocations3", emptyReadRequest, mujinplc::PLCEncoding_Binary, iterations);
+    zmq_ctx_destroy(ctx);
+    return success;
+}
+
+int main(int argc, char** argv) {
+    const size_t iterations = 1000000;
+
+    std::string jsonPath;
+    bool checkOnly = false;
+    for (int index = 1; index < argc; ++index) {
+        if (std::strcmp(argv[index], "--json") == 0 && index + 1 < argc) {
+            jsonPath = argv[++index];
+        }
+        else if (std::strcmp(argv[index], "--check") == 0) {
+            checkOnly = true;
+        }
+        else {
+            std::cout << "usage: " << argv[0] << " [--json results.json] [--check]" << std::endl;
+            std::cout << "  --check  only check that the server serves steady state read requests without allocating" << std::endl;
+            return 1;
+        }
+    }
+
+    if (checkOnly) {
+        return CheckServerAllocations(iterations / 100) ? 0 : 1;
+    }
+
+    std::cout << "sizeof(LegacyPLCValue) = " << sizeof(LegacyPLCValue) << std::endl;
+    std::cout << "sizeof(PLCValue) = " << sizeof(mujinplc::PLCValue) << std::endl;
+
+    BenchmarkCopy("legacy integer copy", LegacyPLCValue(42), iterations);
+    BenchmarkCopy("integer copy", mujinplc::PLCValue(42), iterations);
+    BenchmarkCopy("legacy boolean copy", LegacyPLCValue(true), iterations);
+    BenchmarkCopy("boolean copy", mujinplc::PLCValue(true), iterations);
+    BenchmarkCopy("legacy short string copy", LegacyPLCValue(std::string("running")), iterations);
+    BenchmarkCopy("short string copy", mujinplc::PLCValue(std::string("running")), iterations);
+
+    BenchmarkWrite("integer write", {mujinplc::PLCValue(1), mujinplc::PLCValue(2)}, 100, iterations / 100);
+    BenchmarkWrite("short string write", {mujinplc::PLCValue(std::string("start")), mujinplc::PLCValue(std::string("stop"))}, 100, iterations / 100);
+
+    for (size_t numKeys : {10, 100, 1000}) {
+        for (size_t numThreads : {1, 2, 4, 8}) {
+            std::string suffix = " " + std::to_string(numKeys) + " keys " + std::to_string(numThreads) + " threads";
+            BenchmarkThroughput("read throughput" + suffix, false, numKeys, numThreads, std::chrono::milliseconds(200));
+            BenchmarkThroughput("write throughput" + suffix, true, numKeys, numThreads, std::chrono::milliseconds(200));
+        }
+    }
+
+    for (size_t numObservers : {0, 1, 10, 100}) {
+        BenchmarkObserverFanOut("observer fan out " + std::to_string(numObservers) + " all", numObservers, false, iterations / 10);
+        BenchmarkObserverFanOut("observer fan out " + std::to_string(numObservers) + " filtered", numObservers, true, iterations / 10);
+    }
+
+    BenchmarkWakeLatency("set to waituntil wake latency", 10000);
+
+    // typical traffic, a read of a handful of signals and a write of a few of them
+    mujinplc::PLCRequest readRequest, writeRequest;
+    mujinplc::PLCResponse readResponse, writeResponse;
+    readRequest.command = mujinplc::PLCCommand_Read;
+    readRequest.hasKeys = true;
+    writeRequest.command = mujinplc::PLCCommand_Write;
+    readResponse.hasKeyValues = true;
+    for (int index = 0; index < 16; ++index) {
+        readRequest.keys.push_back("isRunningOrderCycle" + std::to_string(index));
+        readResponse.keyvalues.emplace_back(readRequest.keys.back(), index % 3 == 0 ? mujinplc::PLCValue(index % 2 == 0) : (index % 3 == 1 ? mujinplc::PLCValue(index * 1000) : mujinplc::PLCValue(std::string("part") + std::to_string(index))));
+    }
+    for (int index = 0; index < 4; ++index) {
+        writeRequest.keyvalues["startOrderCycle" + std::to_string(index)] = mujinplc::PLCValue(true);
+    }
+
+    BenchmarkCodec("json read codec", readRequest, readResponse, mujinplc::PLCEncoding_JSON, iterations / 10);
+    BenchmarkCodec("binary read codec", readRequest, readResponse, mujinplc::PLCEncoding_Binary, iterations / 10);
+    BenchmarkCodec("json write codec", writeRequest, writeResponse, mujinplc::PLCEncoding_JSON, iterations / 10);
+    BenchmarkCodec("binary write codec", writeRequest, writeResponse, mujinplc::PLCEncoding_Binary, iterations / 10);
+
+    bool success = CheckServerAllocations(iterations / 10);
+
+    // the client shares the context of the server, which inproc requires
+    void* ctx = zmq_ctx_new();
+    // every server binds its own endpoint, so that it does not race with the previous one releasing it
+    const std::string ipcPath = "/tmp/mujinplcbenchmark" + std::to_string(getpid());
+    const std::vector<std::pair<std::string, std::string>> transports = {
+        {"inproc", "inproc://mujinplcbenchmark"},
+        {"ipc", "ipc://" + ipcPath},
+        {"tcp", "tcp://127.0.0.1:1555"},
+    };
+    for (auto& transport : transports) {
+        BenchmarkServerRoundTrip("json server roundtrip " + transport.first, ctx, transport.second + "5", readRequest, mujinplc::PLCEncoding_JSON, 10000);
+        BenchmarkServerRoundTrip("binary server roundtrip " + transport.first, ctx, transport.second + "6", readRequest, mujinplc::PLCEncoding_Binary, 10000);
+    }
+    zmq_ctx_destroy(ctx);
+    unlink((ipcPath + "5").c_str());
+    unlink((ipcPath + "6").c_str());
+
+    BenchmarkRestore("restore", 100000);
+
+    if (!jsonPath.empty()) {
+        success &= WriteResults(jsonPath);
+    }
+    return success ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+#include <iostream>
+#include <stdexcept>
+#include <mujinplc/mujinplc.h>
+
+// runs the order cycle handshake between a plc and a robot as coroutine flows of one PLCLogic, on one thread.
+// the plc side is simulated here too, a real one would write the same signals through PLCServer.
+// when the plc is done, its heartbeat stops and the robot's wait for the next order ends on the disconnect.
+// the results of co_await are stored before testing them, gcc 12 miscompiles a co_await in the condition of an if.
+
+struct Signals {
+    mujinplc::PLCKeyHandle heartbeat;
+    mujinplc::PLCKeyHandle startOrderCycle;
+    mujinplc::PLCKeyHandle orderNumber;
+    mujinplc::PLCKeyHandle isRunningOrderCycle;
+};
+
+mujinplc::PLCLogicFlow Heartbeat(mujinplc::PLCLogic& logic, const Signals& signals, const bool& stop) {
+    for (int beat = 1; !stop; ++beat) {
+        logic.Set(signals.heartbeat, mujinplc::PLCValue(beat));
+        co_await logic.Sleep(std::chrono::milliseconds(20));
+    }
+}
+
+mujinplc::PLCLogicFlow Plc(mujinplc::PLCLogic& logic, const Signals& signals, int numOrders, bool& done) {
+    for (int order = 1; order <= numOrders; ++order) {
+        logic.Set(signals.orderNumber, mujinplc::PLCValue(order));
+        logic.Set(signals.startOrderCycle, mujinplc::PLCValue(true));
+        bool started = co_await logic.WaitUntil(signals.isRunningOrderCycle, mujinplc::PLCValue(true), std::chrono::milliseconds(1000));
+        if (!started) {
+            // escapes out of PLCLogic::Run
+            throw std::runtime_error("robot did not start the order cycle");
+        }
+        logic.Set(signals.startOrderCycle, mujinplc::PLCValue(false));
+        bool finished = co_await logic.WaitUntil(signals.isRunningOrderCycle, mujinplc::PLCValue(false), std::chrono::milliseconds(1000));
+        if (!finished) {
+            throw std::runtime_error("robot did not finish the order cycle");
+        }
+        std::cout << "Order " << order << " finished." << std::endl;
+    }
+    done = true;
+}
+
+mujinplc::PLCLogicFlow Robot(mujinplc::PLCLogic& logic, const Signals& signals, int& numOrders, bool& disconnected) {
+    while (true) {
+        // no timeout, only the disconnect ends it without an order
+        bool started = co_await logic.WaitUntil(signals.startOrderCycle, mujinplc::PLCValue(true));
+        if (!started) {
+            disconnected = true;
+            co_return;
+        }
+        logic.Set(signals.isRunningOrderCycle, mujinplc::PLCValue(true));
+        std::cout << "Picking order " << logic.Get(signals.orderNumber).GetInteger() << " ..." << std::endl;
+        co_await logic.Sleep(std::chrono::milliseconds(50));
+
+        bool acknowledged = co_await logic.WaitUntil(signals.startOrderCycle, mujinplc::PLCValue(false), std::chrono::milliseconds(1000));
+        if (!acknowledged) {
+            throw std::runtime_error("plc did not acknowledge the order cycle");
+        }
+        logic.Set(signals.isRunningOrderCycle, mujinplc::PLCValue(false));
+        numOrders++;
+    }
+}
+
+int main() {
+    std::shared_ptr<mujinplc::PLCMemory> memory(new mujinplc::PLCMemory());
+    std::shared_ptr<mujinplc::PLCController> controller(new mujinplc::PLCController(memory, std::chrono::milliseconds(200), "heartbeat"));
+    mujinplc::PLCLogic logic(controller);
+
+    Signals signals;
+    signals.heartbeat = logic.GetKeyHandle("heartbeat");
+    signals.startOrderCycle = logic.GetKeyHandle("startOrderCycle");
+    signals.orderNumber = logic.GetKeyHandle("orderNumber");
+    signals.isRunningOrderCycle = logic.GetKeyHandle("isRunningOrderCycle");
+
+    const int numOrders = 3;
+    bool plcDone = false, disconnected = false;
+    int numFinished = 0;
+
+    // flows start in the order they are spawned, the first heartbeat connects before the robot waits
+    logic.Spawn(Heartbeat(logic, signals, plcDone));
+    logic.Spawn(Plc(logic, signals, numOrders, plcDone));
+    logic.Spawn(Robot(logic, signals, numFinished, disconnected));
+    try {
+        logic.Run(true);
+    }
+    catch (const std::exception& e) {
+        std::cout << "Flow failed: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << numFinished << " orders finished, " << (disconnected ? "robot saw the disconnect." : "robot did not see the disconnect.") << std::endl;
+    return numFinished == numOrders && disconnected ? 0 : 1;
+}
@@ -20,6 +20,21 @@ public:
             else if (keyvalue.second.IsBoolean()) {
                 std::cout << keyvalue.first << " = " << (keyvalue.second.GetBoolean() ? "true" : "false") << ", ";
             }
+            else if (keyvalue.second.IsDouble()) {
+                std::cout << keyvalue.first << " = " << keyvalue.second.GetDouble() << ", ";
+            }
+            else if (keyvalue.second.IsInteger64()) {
+                std::cout << keyvalue.first << " = " << keyvalue.second.GetInteger64() << ", ";
+            }
+            else if (keyvalue.second.IsIntegerArray()) {
+                std::cout << keyvalue.first << " = " << keyvalue.second.GetIntegerArray().size() << " integers, ";
+            }
+            else if (keyvalue.second.IsDoubleArray()) {
+                std::cout << keyvalue.first << " = " << keyvalue.second.GetDoubleArray().size() << " doubles, ";
+            }
+            else if (keyvalue.second.IsBlob()) {
+                std::cout << keyvalue.first << " = " << keyvalue.second.GetBlob().size() << " bytes, ";
+            }
             else {
                 std::cout << keyvalue.first << " = null, ";
             }
@@ -28,14 +43,23 @@ public:
     }
 };
 
-int main() {
+int main(int argc, char** argv) {
     std::shared_ptr<mujinplc::PLCMemory> memory(new mujinplc::PLCMemory());
     std::shared_ptr<MemoryLogger> logger(new MemoryLogger());
     memory->AddObserver(logger);
 
+    // printing is slow, keep it off the server thread
+    memory->StartDispatcher();
+
     std::shared_ptr<mujinplc::PLCController> controller(new mujinplc::PLCController(memory, std::chrono::milliseconds(1000), "test"));
 
-    std::shared_ptr<mujinplc::PLCServer> server(new mujinplc::PLCServer(memory, NULL, "tcp://*:5555"));
+    std::shared_ptr<mujinplc::PLCServer> server(new mujinplc::PLCServer(memory, NULL, "tcp://*:5555", 1, "tcp://*:5556"));
+    if (argc > 1) {
+        // record the traffic, to replay it later with mujinplcreplay
+        server->SetRecorder(std::shared_ptr<mujinplc::PLCRecorder>(new mujinplc::PLCRecorder(argv[1])));
+    }
+    // the queue of the controller shows up in the stats command
+    server->AddController(controller);
     server->Start();
 
     std::cout << "Server started. Waiting for connection ..." << std::endl;
@@ -0,0 +1,286 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zmq.h>
+#include <mujinplc/mujinplc.h>
+
+// simulates PLC and HMI clients polling a server, to find where it saturates.
+// every client has its own REQ socket and thread, and sends requests reading or writing random keys of the same set.
+// without --endpoint the clients load a server started in this process with --workers workers.
+
+struct LoadOptions {
+    std::string endpoint;
+    size_t numWorkers = 1; ///< of the server in this process
+    size_t numClients = 4;
+    size_t numKeys = 100;
+    size_t keysPerRequest = 1;
+    double rate = 0; ///< requests per second of every client, 0 to send the next request as soon as the reply is in
+    double writeRatio = 0.1; ///< fraction of the requests that write
+    std::string valueType = "integer"; ///< integer, boolean, string or mixed
+    size_t stringLength = 16;
+    double seconds = 10;
+    int timeout = 1000; ///< milliseconds to wait for a reply
+    mujinplc::PLCEncoding encoding = mujinplc::PLCEncoding_JSON;
+};
+
+/// what all clients measured, shared between their threads
+struct LoadResults {
+    mujinplc::PLCCounter numReads;
+    mujinplc::PLCCounter numWrites;
+    mujinplc::PLCCounter numErrors; ///< replies that are not a valid response to the request
+    mujinplc::PLCCounter numTimeouts;
+    mujinplc::PLCHistogram latency; ///< nanoseconds
+};
+
+void PrintUsage(const char* program) {
+    std::cout << "usage: " << program << " [options]" << std::endl
+              << "  --endpoint tcp://host:port  server to load, otherwise one is started in this process" << std::endl
+              << "  --workers 1                 workers of the server started in this process" << std::endl
+              << "  --clients 4                 clients sending requests concurrently" << std::endl
+              << "  --keys 100                  keys the clients read and write" << std::endl
+              << "  --keys-per-request 1" << std::endl
+              << "  --rate 0                    requests per second of every client, 0 for as fast as the server replies" << std::endl
+              << "  --write-ratio 0.1           fraction of the requests that write" << std::endl
+              << "  --type integer              values written, integer, boolean, string or mixed" << std::endl
+              << "  --string-length 16" << std::endl
+              << "  --seconds 10" << std::endl
+              << "  --timeout 1000              milliseconds to wait for a reply" << std::endl
+              << "  --binary                    use the binary encoding instead of json" << std::endl
+              << "  --json results.json" << std::endl;
+}
+
+void* OpenSocket(void* ctx, const LoadOptions& options) {
+    void* socket = zmq_socket(ctx, ZMQ_REQ);
+    int linger = 0;
+    zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+    zmq_setsockopt(socket, ZMQ_RCVTIMEO, &options.timeout, sizeof(options.timeout));
+    if (zmq_connect(socket, options.endpoint.c_str()) != 0) {
+        zmq_close(socket);
+        return NULL;
+    }
+    return socket;
+}
+
+void SetRandomValue(const LoadOptions& options, std::mt19937& random, mujinplc::PLCValue& value) {
+    std::string type = options.valueType;
+    if (type == "mixed") {
+        static const char* types[] = {"integer", "boolean", "string"};
+        type = types[random() % 3];
+    }
+    if (type == "boolean") {
+        value.SetBoolean(random() % 2 == 0);
+    }
+    else if (type == "string") {
+        char buffer[16];
+        std::snprintf(buffer, sizeof(buffer), "%08x", unsigned(random()));
+        std::string text(buffer);
+        text.resize(options.stringLength, '.');
+        value.SetString(text);
+    }
+    else {
+        value.SetInteger(int(random() & 0x7fffffff));
+    }
+}
+
+void RunClient(void* ctx, const LoadOptions& options, size_t client, std::chrono::steady_clock::time_point end, LoadResults& results) {
+    std::mt19937 random(uint32_t(client + 1));
+    std::uniform_real_distribution<double> uniform(0, 1);
+    mujinplc::PLCRequest request;
+    mujinplc::PLCResponse response;
+    std::string requestData;
+    zmq_msg_t reply;
+    zmq_msg_init(&reply);
+
+    void* socket = OpenSocket(ctx, options);
+    if (socket == NULL) {
+        std::cout << "cannot connect to " << options.endpoint << ", " << zmq_strerror(zmq_errno()) << std::endl;
+    }
+    auto start = std::chrono::steady_clock::now();
+    auto interval = std::chrono::nanoseconds(options.rate > 0 ? uint64_t(1e9 / options.rate) : 0);
+    // spread the first requests of the clients over one interval, so that they do not all send at once
+    auto due = start + interval * client / options.numClients;
+    while (socket != NULL && std::chrono::steady_clock::now() < end) {
+        if (options.rate > 0) {
+            std::this_thread::sleep_until(due);
+        }
+        else {
+            due = std::chrono::steady_clock::now();
+        }
+
+        bool write = uniform(random) < options.writeRatio;
+        if (write) {
+            request.command = mujinplc::PLCCommand_Write;
+            request.keyvalues.clear();
+            for (size_t index = 0; index < options.keysPerRequest; ++index) {
+                SetRandomValue(options, random, request.keyvalues["key" + std::to_string(random() % options.numKeys)]);
+            }
+        }
+        else {
+            request.command = mujinplc::PLCCommand_Read;
+            request.keys.resize(options.keysPerRequest);
+            for (auto& key : request.keys) {
+                key = "key" + std::to_string(random() % options.numKeys);
+            }
+        }
+        mujinplc::EncodeRequest(request, options.encoding, requestData);
+
+        if (zmq_send(socket, requestData.data(), requestData.size(), 0) < 0 || zmq_msg_recv(&reply, socket, 0) < 0) {
+            // a REQ socket cannot send again before it got its reply, start over with a new one
+            results.numTimeouts.Add();
+            zmq_close(socket);
+            socket = OpenSocket(ctx, options);
+        }
+        else {
+            // latency from when the request was due rather than sent, so that a server falling behind the rate shows
+            results.latency.RecordSince(due);
+            if (!mujinplc::DecodeResponse((const char*)zmq_msg_data(&reply), zmq_msg_size(&reply), response) || (!write && !response.hasKeyValues)) {
+                results.numErrors.Add();
+            }
+            (write ? results.numWrites : results.numReads).Add();
+        }
+        due += interval;
+    }
+
+    zmq_msg_close(&reply);
+    if (socket != NULL) {
+        zmq_close(socket);
+    }
+}
+
+int main(int argc, char** argv) {
+    LoadOptions options;
+    std::string jsonPath;
+    for (int index = 1; index < argc; ++index) {
+        std::string arg = argv[index];
+        if (arg == "--binary") {
+            options.encoding = mujinplc::PLCEncoding_Binary;
+            continue;
+        }
+        if (index + 1 >= argc) {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        const char* value = argv[++index];
+        if (arg == "--endpoint") {
+            options.endpoint = value;
+        }
+        else if (arg == "--workers") {
+            options.numWorkers = std::strtoul(value, NULL, 10);
+        }
+        else if (arg == "--clients") {
+            options.numClients = std::strtoul(value, NULL, 10);
+        }
+        else if (arg == "--keys") {
+            options.numKeys = std::strtoul(value, NULL, 10);
+        }
+        else if (arg == "--keys-per-request") {
+            options.keysPerRequest = std::strtoul(value, NULL, 10);
+        }
+        else if (arg == "--rate") {
+            options.rate = std::atof(value);
+        }
+        else if (arg == "--write-ratio") {
+            options.writeRatio = std::atof(value);
+        }
+        else if (arg == "--type") {
+            options.valueType = value;
+        }
+        else if (arg == "--string-length") {
+            options.stringLength = std::strtoul(value, NULL, 10);
+        }
+        else if (arg == "--seconds") {
+            options.seconds = std::atof(value);
+        }
+        else if (arg == "--timeout") {
+            options.timeout = std::atoi(value);
+        }
+        else if (arg == "--json") {
+            jsonPath = value;
+        }
+        else {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (options.numClients == 0 || options.numKeys == 0 || options.keysPerRequest == 0 || options.numWorkers == 0 || options.seconds <= 0 ||
+        (options.valueType != "integer" && options.valueType != "boolean" && options.valueType != "string" && options.valueType != "mixed")) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    void* ctx = zmq_ctx_new();
+    std::shared_ptr<mujinplc::PLCServer> server;
+    if (options.endpoint.empty()) {
+        options.endpoint = "inproc://mujinplcload";
+        std::shared_ptr<mujinplc::PLCMemory> memory(new mujinplc::PLCMemory());
+        std::map<std::string, mujinplc::PLCValue> keyvalues;
+        for (size_t index = 0; index < options.numKeys; ++index) {
+            keyvalues["key" + std::to_string(index)] = mujinplc::PLCValue(0);
+        }
+        memory->Write(keyvalues);
+        server.reset(new mujinplc::PLCServer(memory, ctx, options.endpoint, options.numWorkers));
+        server->Start();
+    }
+
+    LoadResults results;
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::nanoseconds(uint64_t(options.seconds * 1e9));
+    std::vector<std::thread> clients;
+    for (size_t client = 0; client < options.numClients; ++client) {
+        clients.emplace_back(RunClient, ctx, std::cref(options), client, end, std::ref(results));
+    }
+    for (auto& client : clients) {
+        client.join();
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    if (!!server) {
+        server->Stop();
+    }
+    zmq_ctx_destroy(ctx);
+
+    double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / 1e9;
+    uint64_t numRequests = results.numReads.Get() + results.numWrites.Get();
+    double offered = options.rate * options.numClients;
+    std::cout << options.numClients << " clients, " << numRequests << " requests in " << seconds << " s" << std::endl;
+    std::cout << "throughput " << numRequests / seconds << " requests/s";
+    if (offered > 0) {
+        std::cout << " of " << offered << " offered";
+    }
+    std::cout << ", " << results.numReads.Get() << " reads, " << results.numWrites.Get() << " writes" << std::endl;
+    std::cout << "latency us p50 " << results.latency.GetPercentile(50) / 1000.0
+              << ", p90 " << results.latency.GetPercentile(90) / 1000.0
+              << ", p99 " << results.latency.GetPercentile(99) / 1000.0
+              << ", p999 " << results.latency.GetPercentile(99.9) / 1000.0
+              << ", max " << results.latency.GetMax() / 1000.0 << std::endl;
+    std::cout << results.numErrors.Get() << " errors, " << results.numTimeouts.Get() << " timeouts" << std::endl;
+
+    if (!jsonPath.empty()) {
+        std::ofstream stream(jsonPath.c_str());
+        stream.precision(10);
+        stream << "{\"clients\": " << options.numClients
+               << ", \"requests\": " << numRequests
+               << ", \"requests_per_s\": " << numRequests / seconds
+               << ", \"offered_requests_per_s\": " << offered
+               << ", \"us_p50\": " << results.latency.GetPercentile(50) / 1000.0
+               << ", \"us_p90\": " << results.latency.GetPercentile(90) / 1000.0
+               << ", \"us_p99\": " << results.latency.GetPercentile(99) / 1000.0
+               << ", \"us_p999\": " << results.latency.GetPercentile(99.9) / 1000.0
+               << ", \"us_max\": " << results.latency.GetMax() / 1000.0
+               << ", \"errors\": " << results.numErrors.Get()
+               << ", \"timeouts\": " << results.numTimeouts.Get() << "}" << std::endl;
+        if (!stream) {
+            std::cout << "cannot write " << jsonPath << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
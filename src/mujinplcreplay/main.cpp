@@ -0,0 +1,171 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zmq.h>
+#include <mujinplc/mujinplc.h>
+
+// replays the requests of a recording made with PLCServer::SetRecorder against a server, and reports the latencies.
+// without --endpoint the requests go to a server with an empty memory started in this process, which then gets the
+// writes of the recording too.
+
+void PrintUsage(const char* program) {
+    std::cout << "usage: " << program << " recording [--endpoint tcp://host:port] [--speed 1] [--json results.json]" << std::endl;
+    std::cout << "  --speed 1 replays at the pace the requests were recorded, 2 twice as fast, 0 as fast as possible" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    std::string recordingPath, endpoint, jsonPath;
+    double speed = 1;
+    for (int index = 1; index < argc; ++index) {
+        if (std::strcmp(argv[index], "--endpoint") == 0 && index + 1 < argc) {
+            endpoint = argv[++index];
+        }
+        else if (std::strcmp(argv[index], "--speed") == 0 && index + 1 < argc) {
+            speed = std::atof(argv[++index]);
+        }
+        else if (std::strcmp(argv[index], "--json") == 0 && index + 1 < argc) {
+            jsonPath = argv[++index];
+        }
+        else if (recordingPath.empty() && argv[index][0] != '-') {
+            recordingPath = argv[index];
+        }
+        else {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+    if (recordingPath.empty() || speed < 0) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    // read the whole recording first, so that reading the file does not get into the timing
+    std::vector<mujinplc::PLCRecord> records;
+    uint64_t recordedDuration = 0;
+    try {
+        mujinplc::PLCRecordReader reader(recordingPath);
+        mujinplc::PLCRecord record;
+        while (reader.Read(record)) {
+            recordedDuration += record.duration;
+            records.push_back(std::move(record));
+        }
+    }
+    catch (const std::exception& e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
+    if (records.empty()) {
+        std::cout << recordingPath << " has no requests" << std::endl;
+        return 1;
+    }
+
+    // the workers of a server record in the order they reply, put the requests back in the order they were received
+    std::stable_sort(records.begin(), records.end(), [](const mujinplc::PLCRecord& lhs, const mujinplc::PLCRecord& rhs) {
+        return lhs.time < rhs.time;
+    });
+
+    void* ctx = zmq_ctx_new();
+    std::shared_ptr<mujinplc::PLCServer> server;
+    if (endpoint.empty()) {
+        endpoint = "inproc://mujinplcreplay";
+        std::shared_ptr<mujinplc::PLCMemory> memory(new mujinplc::PLCMemory());
+        server.reset(new mujinplc::PLCServer(memory, ctx, endpoint));
+        server->Start();
+    }
+
+    void* socket = zmq_socket(ctx, ZMQ_REQ);
+    int linger = 0, timeout = 5000;
+    zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+    zmq_setsockopt(socket, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    if (zmq_connect(socket, endpoint.c_str()) != 0) {
+        std::cout << "cannot connect to " << endpoint << ", " << zmq_strerror(zmq_errno()) << std::endl;
+        zmq_close(socket);
+        if (!!server) {
+            server->Stop();
+        }
+        zmq_ctx_destroy(ctx);
+        return 1;
+    }
+
+    zmq_msg_t reply;
+    zmq_msg_init(&reply);
+
+    // a request is late when the reply to the one before came after its recorded time, the replay only has one
+    // request in flight while the recorded clients may have had several
+    std::vector<double> latencies;
+    latencies.reserve(records.size());
+    size_t numDifferent = 0, numLate = 0;
+    bool success = true;
+    const uint64_t firstTime = records.front().time;
+    const auto start = std::chrono::steady_clock::now();
+    for (auto& record : records) {
+        auto sendTime = std::chrono::steady_clock::now();
+        if (speed > 0) {
+            auto dueTime = start + std::chrono::nanoseconds(uint64_t((record.time - firstTime) / speed));
+            if (dueTime > sendTime) {
+                std::this_thread::sleep_until(dueTime);
+                sendTime = std::chrono::steady_clock::now();
+            }
+            else if (sendTime - dueTime > std::chrono::milliseconds(1)) {
+                numLate++;
+            }
+        }
+        if (zmq_send(socket, record.request.data(), record.request.size(), 0) < 0 || zmq_msg_recv(&reply, socket, 0) < 0) {
+            std::cout << "no reply from " << endpoint << ", " << zmq_strerror(zmq_errno()) << std::endl;
+            success = false;
+            break;
+        }
+        latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - sendTime).count() / 1000.0);
+        if (zmq_msg_size(&reply) != record.response.size() || std::memcmp(zmq_msg_data(&reply), record.response.data(), record.response.size()) != 0) {
+            numDifferent++;
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+
+    zmq_msg_close(&reply);
+    zmq_close(socket);
+    if (!!server) {
+        server->Stop();
+    }
+    zmq_ctx_destroy(ctx);
+
+    if (latencies.empty()) {
+        return 1;
+    }
+
+    // latencies in microseconds
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&latencies](double value) {
+        return latencies[std::min(latencies.size() - 1, size_t(value / 100.0 * latencies.size()))];
+    };
+    double seconds = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / 1e9;
+    std::cout << "replayed " << latencies.size() << " of " << records.size() << " requests in " << seconds << " s" << std::endl;
+    std::cout << "latency us p50 " << percentile(50) << ", p90 " << percentile(90) << ", p99 " << percentile(99) << ", p999 " << percentile(99.9) << ", max " << latencies.back() << std::endl;
+    std::cout << "recorded server time us mean " << recordedDuration / 1000.0 / records.size() << std::endl;
+    std::cout << numDifferent << " responses differ from the recording, " << numLate << " requests sent late" << std::endl;
+
+    if (!jsonPath.empty()) {
+        std::ofstream stream(jsonPath.c_str());
+        stream.precision(10);
+        stream << "{\"requests\": " << latencies.size()
+               << ", \"seconds\": " << seconds
+               << ", \"us_p50\": " << percentile(50)
+               << ", \"us_p90\": " << percentile(90)
+               << ", \"us_p99\": " << percentile(99)
+               << ", \"us_p999\": " << percentile(99.9)
+               << ", \"us_max\": " << latencies.back()
+               << ", \"different\": " << numDifferent
+               << ", \"late\": " << numLate << "}" << std::endl;
+        if (!stream) {
+            std::cout << "cannot write " << jsonPath << std::endl;
+            success = false;
+        }
+    }
+    return success ? 0 : 1;
+}